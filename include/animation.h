@@ -0,0 +1,77 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H 1
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "aurora.h"
+#include "streaming.h"
+
+namespace mynanoleaf {
+
+/**
+ * A looping animation given as keyframes per panel, keyed by
+ * PanelPosition::id, which compiles into the animData of a custom
+ * effect. Once uploaded, the controller plays it on its own, with no
+ * further traffic from the host.
+ *
+ * Each keyframe is the colour a panel fades to, over its transition
+ * time in tenths of a second, from the keyframe before it; the first
+ * fades from the last when the animation loops.
+ */
+class AnimationTimeline {
+public:
+	/**
+	 * The controller does not publish how much effect data it accepts;
+	 * the defaults are conservative, and can be raised for firmware
+	 * known to take more.
+	 */
+	class Limits {
+	public:
+		size_t max_anim_data_bytes;
+		size_t max_frames_per_panel;
+	};
+	static const Limits DEFAULT_LIMITS;
+private:
+	std::map<uint16_t, std::vector<Frame> > panels;
+	static std::vector<Frame> merge_holds(const std::vector<Frame> &frames);
+public:
+	void add(uint16_t panel_id, const Frame &frame) { panels[panel_id].push_back(frame); }
+	void add(const PanelCommand &command);
+	void clear() { panels.clear(); }
+	size_t get_panel_count() const { return panels.size(); }
+	/**
+	 * Returns the animData: the panel count, then per panel its ID, frame
+	 * count and each frame's R, G, B, W and transition time. Runs of a
+	 * held colour become a single frame. Throws if a panel is not in the
+	 * layout, or the result exceeds the limits.
+	 */
+	std::string compile(const PanelLayout &layout, const Limits &limits = DEFAULT_LIMITS) const;
+	/**
+	 * The body of the "write" to PUT /effects. The "display" command
+	 * plays the effect; "add" also saves it under name.
+	 */
+	json make_effect(
+		const std::string &name,
+		const PanelLayout &layout,
+		bool save = false,
+		bool loop = true,
+		const Limits &limits = DEFAULT_LIMITS
+	) const;
+	/** Compiles against the controller's layout, and uploads. */
+	void upload(
+		Aurora &aurora,
+		const std::string &name,
+		bool save = false,
+		bool loop = true,
+		const Limits &limits = DEFAULT_LIMITS
+	) const {
+		aurora.write_effect(make_effect(name, aurora.get_panel_layout(), save, loop, limits));
+	}
+};
+
+}
+
+#endif /* ANIMATION_H */
@@ -0,0 +1,19 @@
+#ifndef ATOMICFILE_H
+#define ATOMICFILE_H 1
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace mynanoleaf {
+
+/**
+ * Replaces the file at path with body, by writing and syncing a
+ * temporary file beside it and renaming that over it, so the file is
+ * never seen half written, even after a crash.
+ */
+void replace_file(const std::string &path, const std::string &body, mode_t mode = 0644);
+
+}
+
+#endif /* ATOMICFILE_H */
@@ -1,10 +1,23 @@
 #ifndef AURORA_H
 #define AURORA_H 1
 
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+
 #include <nlohmann/json.hpp>
 
 #include "mycurlpp.h"
 #include "streaming.h"
+#include "requestengine.h"
+#include "jsonpush.h"
+#include "events.h"
+#include "credentials.h"
+#include "discoverycache.h"
 
 #define TOKEN_FILENAME "auth_token.dat"
 
@@ -13,6 +26,7 @@ namespace mynanoleaf {
 using json = nlohmann::json;
 
 class IPStream;
+enum ProtocolVersion : int;
 
 class ClampedValue {
 public:
@@ -80,17 +94,172 @@ public:
 	Rhythm rhythm;
 };
 
+/**
+ * Fills in an AuroraJson straight from the text of the controller's info
+ * document, without building a DOM. Unknown members are skipped, and
+ * containers are reused, so parsing the same device again allocates
+ * little. Every member from_json(AuroraJson) requires must be present
+ * with the type it expects, or parsing throws, so no field is left as
+ * it was before.
+ */
+class AuroraInfoParser : public JsonPushParser {
+private:
+	enum Context {
+		CTX_IGNORE,
+		CTX_ROOT,
+		CTX_STATE,
+		CTX_ON,
+		CTX_CLAMPED,
+		CTX_EFFECTS,
+		CTX_EFFECTS_LIST,
+		CTX_PANEL_LAYOUT,
+		CTX_LAYOUT,
+		CTX_POSITION_DATA,
+		CTX_POSITION,
+		CTX_RHYTHM,
+		CTX_POSITION_OF_RHYTHM,
+		CTX_COUNT
+	};
+	enum ValueType {
+		TYPE_STRING,
+		TYPE_INTEGER,
+		TYPE_BOOL,
+		TYPE_NULL,
+		TYPE_OBJECT,
+		TYPE_ARRAY
+	};
+	struct Member {
+		const char *key;
+		ValueType type;
+	};
+	struct Frame {
+		Context ctx;
+		void *target;
+		/** Elements seen so far, for arrays whose storage is reused. */
+		size_t count;
+		/** Which of the context's required members have been seen. */
+		unsigned int seen;
+	};
+	static const std::vector<Member> required_members[CTX_COUNT];
+	AuroraJson *info;
+	std::vector<Frame> stack;
+	std::string key;
+	long long num_panels;
+	void push(Context ctx, void *target) {
+		Frame f = { ctx, target, 0, 0 };
+		stack.push_back(f);
+	}
+	/** Checks the type of the value about to be stored under key. */
+	void check_member(ValueType type);
+protected:
+	virtual void on_start_object();
+	virtual void on_end_object();
+	virtual void on_start_array();
+	virtual void on_end_array();
+	virtual void on_key(const std::string &pkey) { key = pkey; }
+	virtual void on_string(const std::string &value);
+	virtual void on_integer(long long value);
+	virtual void on_bool(bool value);
+	virtual void on_null() { check_member(TYPE_NULL); }
+public:
+	AuroraInfoParser() : info(NULL), num_panels(0) {}
+	/** Starts parsing a new document into target. */
+	void begin(AuroraJson &target);
+};
+
+/**
+ * The parts of the controller's state which can be refreshed on their
+ * own, each from its own sub-endpoint.
+ */
+enum InfoField {
+	INFO_ON,
+	INFO_BRIGHTNESS,
+	INFO_HUE,
+	INFO_SAT,
+	INFO_CT,
+	INFO_COLOR_MODE,
+	INFO_CURRENT_EFFECT,
+	INFO_EFFECTS_LIST,
+	INFO_PANEL_LAYOUT,
+	INFO_FIELD_COUNT
+};
+
+struct string_and_offset {
+	std::string str;
+	size_t off;
+};
+
 class Aurora {
+public:
+	/**
+	 * Called when an asynchronous request finishes, with a null pointer
+	 * on success, or with what the synchronous version would have thrown.
+	 */
+	typedef std::function<void(std::exception_ptr error)> completion_t;
+	typedef std::function<void(IPStream *stream, std::exception_ptr error)> stream_completion_t;
+	typedef std::function<void(const AuroraEvent &event)> event_listener_t;
 private:
+	/** Guards instances, since discovery may create Auroras on its own thread. */
+	static std::mutex instances_mutex;
 	static std::vector<Aurora *> instances;
-	static const char *NANOLEAF_MDNS_SERVICE_TYPE;
 	static const char *API_PREFIX;
+	static const uint16_t EXT_CONTROL_V2_PORT;
+	static const std::chrono::milliseconds DEFAULT_MAX_AGE;
+	static const std::chrono::milliseconds DEFAULT_PAIRING_RETRY;
 private:
 	mycurlpp::Curl curl;
 	std::string token;
+	CredentialStore *credentials;
+	/** The device ID if known, else the hostname. */
+	std::string credential_key;
+	/** An address from set_address(), for the owning thread to pick up. */
+	std::mutex address_mutex;
+	std::string pending_hostname;
+	uint16_t pending_port;
+	std::atomic<bool> address_changed;
+	void apply_address();
+	/** Guards all_info and fetched, which the event thread also updates. */
+	mutable std::mutex info_mutex;
 	AuroraJson all_info;
-	void read_token_file();
-	void write_token_file();
+	/** When each field was last fetched; the epoch if never. */
+	std::chrono::steady_clock::time_point fetched[INFO_FIELD_COUNT];
+	std::chrono::milliseconds max_age;
+	bool is_stale(InfoField field) const;
+	void mark_fresh(InfoField field);
+	void mark_stale(InfoField field) { fetched[field] = std::chrono::steady_clock::time_point(); }
+	bool have_info() const;
+	template<typename T> T read_field(InfoField field, const T &value) {
+		refresh_if_stale(field);
+		std::lock_guard<std::mutex> lock(info_mutex);
+		return value;
+	}
+	std::mutex listener_mutex;
+	std::vector<event_listener_t> listeners;
+	std::unique_ptr<EventSubscription> events;
+	uint16_t touch_events_port;
+	void handle_event(const AuroraEvent &event);
+	bool apply_field(InfoField field, const std::string &response_body);
+	/** Request state kept across calls so the common case only changes the path. */
+	std::string api_base_token, api_base, request_path;
+	std::string current_method;
+	struct curl_slist *put_headers;
+	string_and_offset upload;
+	std::ostringstream async_response;
+	AuroraInfoParser info_parser;
+	AuroraJson parsed_info;
+	void use_parser(JsonPushParser &parser);
+	void set_method(const std::string &method);
+	void load_token() { token = credentials->get(credential_key); }
+	void save_token() { credentials->set(credential_key, token); }
+	void prepare_request(
+		const std::string &method,
+		const std::string &token,
+		const std::string &path,
+		const std::string *request_body,
+		std::ostringstream &response_body
+	);
+	void check_response(const std::ostringstream &response_body);
+	void rethrow_parse_error(JsonPushParser &parser);
 	void do_request(
 		const std::string &method,
 		const std::string &token,
@@ -98,13 +267,54 @@ private:
 		const std::string *request_body,
 		std::ostringstream &response_body
 	);
+	/** As above, leaving the response in async_response. */
+	void do_request(
+		RequestEngine &engine,
+		const std::string &method,
+		const std::string &token,
+		const std::string &path,
+		const std::string *request_body,
+		completion_t done
+	);
+	/** As above, parsing the response as it arrives. */
+	void do_request(
+		const std::string &method,
+		const std::string &token,
+		const std::string &path,
+		const std::string *request_body,
+		JsonPushParser &parser
+	);
+	void set_info();
+	/** Calls fn once there is a token, pairing first if need be, or done with the error. */
+	void with_token(RequestEngine &engine, std::function<void()> fn, completion_t done);
+	static std::string make_external_control_request(ProtocolVersion version);
+	IPStream *open_stream(ProtocolVersion version, const std::string &response_body);
 public:
-	static std::vector<Aurora *> get_instances() { return instances; }
+	static const char *NANOLEAF_MDNS_SERVICE_TYPE;
+	static std::vector<Aurora *> get_instances() {
+		std::lock_guard<std::mutex> lock(instances_mutex);
+		return instances;
+	}
 public:
-	Aurora(const std::string &hostname, unsigned short port = 16021) : curl(mycurlpp::Curl(hostname, port)) {
+	Aurora(const std::string &hostname, unsigned short port = 16021, const std::string &device_id = "") :
+		curl(hostname, port),
+		credentials(&CredentialStore::get_default()),
+		credential_key(device_id.empty() ? hostname : device_id),
+		pending_port(0),
+		address_changed(false),
+		max_age(DEFAULT_MAX_AGE), touch_events_port(0), put_headers(NULL) {
+		// Suppress "Expect: 100-continue", which costs a round trip per PUT
+		put_headers = curl_slist_append(put_headers, "Expect:");
+		curl.setopt(CURLOPT_READFUNCTION, stream_request);
+		std::lock_guard<std::mutex> lock(instances_mutex);
 		instances.push_back(this);
 	}
+	Aurora(const Aurora &) = delete;
+	Aurora &operator=(const Aurora &) = delete;
 	virtual ~Aurora() {
+		unsubscribe();
+		curl_slist_free_all(put_headers);
+		std::lock_guard<std::mutex> lock(instances_mutex);
 		for (auto it = instances.begin(); it != instances.end(); ++it) {
 			if (*it == this) {
 				instances.erase(it);
@@ -113,23 +323,131 @@ public:
 		}
 	}
 	static void discover(const std::string *wanted_id);
+	/**
+	 * Creates an Aurora at once for each device in the cache, then
+	 * revalidates them with a browse in the background, which moves any
+	 * whose address has changed. With nothing cached, browses first, as
+	 * above. The Auroras must outlive the revalidation; see
+	 * DiscoveryCache::wait().
+	 */
+	static void discover(const std::string *wanted_id, DiscoveryCache &cache);
+	/** The Aurora with the given credential key, or NULL. */
+	static Aurora *find(const std::string &credential_key);
+	/** Moves to a new address from the next request on. Safe from any thread. */
+	void set_address(const std::string &hostname, uint16_t port);
 	static size_t accumulate_response(const char *ptr, size_t size, size_t nmemb, void *userdata);
 	static size_t stream_request(char *ptr, size_t size, size_t nmemb, void *userdata);
 	void generate_token();
 	std::string get_auth_token();
-	unsigned int get_panel_count() const {
+	/** Whether a token is known, without pairing to get one. */
+	bool has_auth_token();
+	/** Keeps the token in store instead of the default one. */
+	void set_credentials(CredentialStore &store) {
+		credentials = &store;
+		token.clear();
+	}
+	const std::string &get_credential_key() const { return credential_key; }
+	unsigned int get_panel_count() {
+		refresh_if_stale(INFO_PANEL_LAYOUT);
+		std::lock_guard<std::mutex> lock(info_mutex);
 		return all_info.panel_layout.layout.positions.size();
 	}
-	const std::vector<PanelPosition> &get_panel_positions() const {
-		return all_info.panel_layout.layout.positions;
+	/** Copies, since a refresh or a layout event may replace them at any time. */
+	std::vector<PanelPosition> get_panel_positions() {
+		return read_field(INFO_PANEL_LAYOUT, all_info.panel_layout.layout.positions);
+	}
+	PanelLayout get_panel_layout() { return read_field(INFO_PANEL_LAYOUT, all_info.panel_layout); }
+	void get_info();
+	/**
+	 * Fetches one field from its sub-endpoint. The whole document is
+	 * fetched instead if nothing is cached yet, or if the panel count
+	 * has changed.
+	 */
+	void refresh(InfoField field);
+	void refresh(RequestEngine &engine, InfoField field, completion_t done);
+	/** Forces the next read of a field, or of all fields, to refresh it. */
+	void invalidate(InfoField field) {
+		std::lock_guard<std::mutex> lock(info_mutex);
+		mark_stale(field);
 	}
-	void get_info() {
-		std::ostringstream response_body;
-		do_request("GET", get_auth_token(), "/", NULL, response_body);
-		all_info = json::parse(response_body.str());
-		std::cerr << "Panel count: " << get_panel_count() << std::endl;
+	void invalidate();
+	/** Cached values older than this are refreshed when read. */
+	void set_max_age(std::chrono::milliseconds new_max_age) { max_age = new_max_age; }
+	bool is_on() { return read_field(INFO_ON, all_info.state.on); }
+	ClampedValue get_brightness() { return read_field(INFO_BRIGHTNESS, all_info.state.brightness); }
+	ClampedValue get_hue() { return read_field(INFO_HUE, all_info.state.hue); }
+	ClampedValue get_sat() { return read_field(INFO_SAT, all_info.state.sat); }
+	ClampedValue get_ct() { return read_field(INFO_CT, all_info.state.ct); }
+	std::string get_color_mode() { return read_field(INFO_COLOR_MODE, all_info.state.color_mode); }
+	std::string get_current_effect() { return read_field(INFO_CURRENT_EFFECT, all_info.effects.current); }
+	std::vector<std::string> get_effects_list() { return read_field(INFO_EFFECTS_LIST, all_info.effects.available); }
+	/**
+	 * Sends changes to the state in a single PUT /state, for example
+	 * {"brightness": {"value": 50}}, and updates the cache to match.
+	 */
+	void put_state(const json &changes);
+	void refresh_if_stale(InfoField field) {
+		bool stale;
+		{
+			std::lock_guard<std::mutex> lock(info_mutex);
+			stale = is_stale(field);
+		}
+		if (stale) {
+			refresh(field);
+		}
 	}
+	/**
+	 * Subscribes to the controller's event stream, which keeps the cached
+	 * state current without polling, and adds a listener if one is given.
+	 * Listeners are called on the event thread, after the cache has been
+	 * updated, and must not subscribe or unsubscribe.
+	 *
+	 * Layout events only mark the layout stale, so that the next read of
+	 * it refreshes it.
+	 *
+	 * A non-zero touch_events_port, such as a TouchListener's, has the
+	 * controller stream raw touches there; subscribing again with a
+	 * different port reopens the stream.
+	 */
+	void subscribe(event_listener_t listener = event_listener_t(), uint16_t touch_events_port = 0);
+	void unsubscribe();
+	const EventSubscription *get_subscription() const { return events.get(); }
+	IPStream &external_control(ProtocolVersion version);
 	IPStream &external_control();
+	/**
+	 * Sends a "write" command to PUT /effects, such as a custom effect
+	 * from AnimationTimeline::make_effect().
+	 */
+	void write_effect(const json &command);
+	/**
+	 * Asynchronous versions of the above, run by the engine. Only one may
+	 * be outstanding per Aurora at a time.
+	 */
+	void get_info(RequestEngine &engine, completion_t done);
+	void external_control(RequestEngine &engine, ProtocolVersion version, stream_completion_t done);
+	void external_control(RequestEngine &engine, stream_completion_t done);
+	void write_effect(RequestEngine &engine, const json &command, completion_t done);
+	/**
+	 * Pairs without blocking the engine's thread, retrying every
+	 * retry_interval until the controller's button has been held.
+	 */
+	void generate_token(RequestEngine &engine, completion_t done, std::chrono::milliseconds retry_interval = DEFAULT_PAIRING_RETRY);
+	/**
+	 * Makes a single pairing attempt, giving up after timeout if that is
+	 * non-zero. Fails with an HTTP status error until the button is held.
+	 */
+	void request_token(RequestEngine &engine, std::chrono::milliseconds timeout, completion_t done);
+	/**
+	 * Future-returning versions of the above. The futures become ready as
+	 * the engine runs, so get() them after run(), or from another thread
+	 * while the engine's own thread runs it.
+	 */
+	std::future<void> get_info_async(RequestEngine &engine);
+	std::future<void> refresh_async(RequestEngine &engine, InfoField field);
+	std::future<IPStream *> external_control_async(RequestEngine &engine, ProtocolVersion version);
+	std::future<IPStream *> external_control_async(RequestEngine &engine);
+	std::future<std::string> get_auth_token_async(RequestEngine &engine);
+	std::future<std::string> generate_token_async(RequestEngine &engine, std::chrono::milliseconds retry_interval = DEFAULT_PAIRING_RETRY);
 };
 
 void to_json(json &j, const ClampedValue &cv);
@@ -0,0 +1,138 @@
+#ifndef CANVAS_H
+#define CANVAS_H 1
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "aurora.h"
+#include "colour.h"
+#include "geometry.h"
+
+namespace mynanoleaf {
+
+/**
+ * The shape of a raw canvas frame: rows of pixels top to bottom, each
+ * with gamma-encoded red, green and blue in its first three bytes.
+ */
+class CanvasFormat {
+public:
+	unsigned int width, height;
+	/** 3 for packed RGB, 4 for RGBA or RGBX. */
+	unsigned int bytes_per_pixel;
+	/** From the start of one row to the next; zero if rows are packed. */
+	size_t stride;
+	CanvasFormat(unsigned int pwidth, unsigned int pheight, unsigned int pbytes_per_pixel = 3, size_t pstride = 0)
+	:
+		width(pwidth), height(pheight), bytes_per_pixel(pbytes_per_pixel), stride(pstride)
+	{}
+	size_t row_bytes() const { return stride ? stride : static_cast<size_t>(width) * bytes_per_pixel; }
+	size_t frame_size() const { return row_bytes() * height; }
+};
+
+/**
+ * Reduces a canvas to a colour per panel: the average of the pixels its
+ * triangle covers, each weighted by the fraction of it covered. The
+ * layout is turned by its global orientation, counter-clockwise as the
+ * panels' own orientations are, and scaled to fit the canvas, centred.
+ * The weights are held in compressed sparse row form, with the panels
+ * ordered by where their pixels start and each panel's pixels in the
+ * order they lie in memory, so that a reduction reads the weights once
+ * and the frame front to back.
+ */
+class CanvasSampler {
+public:
+	/** Sample points per pixel along each axis when measuring coverage. */
+	static const unsigned int SUBSAMPLES = 4;
+	/** The weights of each panel sum to one in this fixed point. */
+	static const unsigned int WEIGHT_BITS = 16;
+	class Tap {
+	public:
+		/** Of the pixel, in bytes from the start of the frame. */
+		uint32_t offset;
+		uint32_t weight;
+	};
+private:
+	uint64_t layout_hash;
+	int orientation;
+	CanvasFormat format;
+	// The taps of panel panel_order[k] are taps[tap_offsets[k]] up to taps[tap_offsets[k + 1]]
+	std::vector<uint32_t> panel_order;
+	std::vector<uint32_t> tap_offsets;
+	std::vector<Tap> taps;
+	void build(const LayoutGeometry &geometry);
+public:
+	CanvasSampler(const LayoutGeometry &geometry, int porientation, const CanvasFormat &pformat);
+	virtual ~CanvasSampler() {}
+	/**
+	 * The sampler for a layout and canvas format, shared with any other
+	 * caller asking for the same while it remains in use.
+	 */
+	static std::shared_ptr<const CanvasSampler> get(const PanelLayout &layout, const CanvasFormat &format);
+	uint64_t get_layout_hash() const { return layout_hash; }
+	const CanvasFormat &get_format() const { return format; }
+	size_t size() const { return tap_offsets.size() - 1; }
+	size_t get_tap_count() const { return taps.size(); }
+	/**
+	 * canvas must hold a whole frame in this sampler's format. Panels
+	 * are in the order of the layout's positions.
+	 */
+	void reduce(const uint8_t *canvas, RGBBuffer &out) const;
+};
+
+/**
+ * Raw canvas frames of a fixed size, one after another.
+ */
+class CanvasSource {
+public:
+	virtual ~CanvasSource() {}
+	/**
+	 * The next frame, valid until the next call, or NULL once there
+	 * are no more whole frames.
+	 */
+	virtual const uint8_t *next() = 0;
+	/**
+	 * Reads path, or standard input if it is "-": mapped in place if it
+	 * is a regular file, otherwise read a frame at a time.
+	 */
+	static std::unique_ptr<CanvasSource> open(const std::string &path, size_t frame_size);
+};
+
+/**
+ * Frames straight from a mapping of a file, so none is ever copied.
+ */
+class MappedCanvasSource : public CanvasSource {
+private:
+	const uint8_t *base;
+	size_t length;
+	size_t frame_size;
+	size_t position;
+public:
+	/** Does not take ownership of fd, which may be closed at once. */
+	MappedCanvasSource(int fd, size_t pframe_size);
+	virtual ~MappedCanvasSource();
+	virtual const uint8_t *next();
+	size_t get_frame_count() const { return length / frame_size; }
+	/** Starts again from the first frame, as when looping a clip. */
+	void rewind() { position = 0; }
+};
+
+/**
+ * Frames read from a pipe or socket straight into the one buffer that
+ * is handed out, so there is no copying beyond the kernel's own.
+ */
+class PipeCanvasSource : public CanvasSource {
+private:
+	int fd;
+	bool close_fd;
+	std::vector<uint8_t> buffer;
+public:
+	PipeCanvasSource(int pfd, size_t frame_size, bool pclose_fd = false);
+	virtual ~PipeCanvasSource();
+	virtual const uint8_t *next();
+};
+
+}
+
+#endif /* CANVAS_H */
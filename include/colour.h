@@ -0,0 +1,84 @@
+#ifndef COLOUR_H
+#define COLOUR_H 1
+
+#include <vector>
+#include <cstdint>
+
+#include "aurora.h"
+#include "streaming.h"
+
+namespace mynanoleaf {
+
+/**
+ * Per-panel colours in structure-of-arrays form. Hue is in degrees and
+ * may lie outside [0, 360); saturation and value are linear-light
+ * fractions in [0, 1].
+ */
+class HSVBuffer {
+public:
+	std::vector<float> h, s, v;
+	void resize(size_t n) {
+		h.resize(n);
+		s.resize(n);
+		v.resize(n);
+	}
+	size_t size() const { return h.size(); }
+};
+
+/**
+ * Per-panel gamma-encoded 8-bit colours in structure-of-arrays form.
+ */
+class RGBBuffer {
+public:
+	std::vector<uint8_t> r, g, b;
+	void resize(size_t n) {
+		r.resize(n);
+		g.resize(n);
+		b.resize(n);
+	}
+	size_t size() const { return r.size(); }
+};
+
+/**
+ * Converts HSV to RGB, scales by a global brightness and gamma-encodes
+ * through a lookup table built at compile time. The vector paths perform
+ * the same floating-point operations in the same order as the scalar
+ * one, so every implementation produces identical output.
+ */
+class ColourPipeline {
+public:
+	enum Implementation {
+		SCALAR,
+		SSE41,
+		AVX2
+	};
+	static const size_t GAMMA_LUT_SIZE = 4096;
+private:
+	Implementation implementation;
+public:
+	ColourPipeline();
+	ColourPipeline(Implementation pimplementation);
+	virtual ~ColourPipeline() {}
+	Implementation get_implementation() const { return implementation; }
+	static bool is_supported(Implementation impl);
+	static float brightness_fraction(const ClampedValue &brightness);
+	void convert(const HSVBuffer &in, float brightness, RGBBuffer &out) const;
+	void convert(const HSVBuffer &in, const State &state, RGBBuffer &out) const {
+		convert(in, brightness_fraction(state.brightness), out);
+	}
+};
+
+/**
+ * Builds one single-frame command per panel, reusing the storage of
+ * any commands already in the vector.
+ */
+void make_panel_commands(
+	const RGBBuffer &colours,
+	const std::vector<PanelPosition> &positions,
+	uint16_t transition_time,
+	std::vector<PanelCommand> &commands
+);
+
+}
+
+#endif /* COLOUR_H */
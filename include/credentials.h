@@ -0,0 +1,55 @@
+#ifndef CREDENTIALS_H
+#define CREDENTIALS_H 1
+
+#include <map>
+#include <shared_mutex>
+#include <string>
+
+namespace mynanoleaf {
+
+/**
+ * Auth tokens for any number of controllers, keyed by device ID, or by
+ * hostname where the ID is not known. The file is read once, when the
+ * store is created, and only rewritten when a token is added or
+ * changes, by writing a temporary file and renaming it over the old
+ * one, so a crash never leaves it half written. Safe to use from
+ * several threads at once.
+ *
+ * Each line of the file holds a key and a token. A line holding only a
+ * token, as in files written before devices had their own entries, is
+ * given to the first device asked for that has no entry of its own,
+ * and saved under its key, so that it never goes to more than one.
+ */
+class CredentialStore {
+private:
+	std::string path;
+	mutable std::shared_timed_mutex mutex;
+	std::map<std::string, std::string> tokens;
+	/** From a bare line, until a device claims it. */
+	std::string unclaimed_token;
+	uint64_t writes;
+	void load();
+	void save();
+public:
+	CredentialStore(const std::string &ppath);
+	CredentialStore(const CredentialStore &) = delete;
+	CredentialStore &operator=(const CredentialStore &) = delete;
+	/** The store in TOKEN_FILENAME in the working directory. */
+	static CredentialStore &get_default();
+	/**
+	 * Returns an empty string if there is no token for the key, unless
+	 * this is the first to claim a token from a bare line.
+	 */
+	std::string get(const std::string &key);
+	/** Writes the file only if the token differs from the stored one. */
+	void set(const std::string &key, const std::string &token);
+	const std::string &get_path() const { return path; }
+	uint64_t get_writes() const {
+		std::shared_lock<std::shared_timed_mutex> lock(mutex);
+		return writes;
+	}
+};
+
+}
+
+#endif /* CREDENTIALS_H */
@@ -1,34 +1,73 @@
 #ifndef DISCOVERY_H
 #define DISCOVERY_H 1
 
+#include <atomic>
+#include <cassert>
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <tuple>
 #include <avahi-client/client.h>
 #include <avahi-client/lookup.h>
 #include <avahi-common/simple-watch.h>
 #include <avahi-common/malloc.h>
 #include <avahi-common/error.h>
+#include <avahi-common/address.h>
+
+#include "mdns.h"
 
 class MDNSResponder {
 private:
     typedef bool (*host_callback_t)(const AvahiAddress &address, const std::string &hostname, uint16_t port, const std::string &id, void *userdata);
+	/** Given the id and hostname the device was reported with. */
+	typedef void (*remove_callback_t)(const std::string &id, const std::string &hostname, void *userdata);
     class Session {
     private:
     	MDNSResponder *responder;
         host_callback_t host_callback;
+        remove_callback_t remove_callback;
         void *callback_arg;
         const std::string service_type;
+		/** Browses until this is set, if given; otherwise until all are found. */
+		const std::atomic<bool> *stopping;
+		/**
+		 * What each instance of a service resolved to, since removals only
+		 * give its name. Avahi reports a service once per interface and
+		 * protocol it is seen on, and removes it the same way.
+		 */
+		class Instance {
+		public:
+			std::string id;
+			std::string hostname;
+		};
+		typedef std::tuple<AvahiIfIndex, AvahiProtocol, std::string> instance_key_t;
+		std::map<instance_key_t, Instance> instances;
     	AvahiSimplePoll *simple_poll;
     	AvahiClient *client;
-	private:
+		AvahiServiceBrowser *browser;
+		/** Gives up on any resolves still outstanding at this time; unused when watching. */
+		std::chrono::steady_clock::time_point deadline;
+		/** Set when the caller wants no more results, or on failure. */
+		bool done;
+		const char *error;
+		bool all_for_now;
 		/**
-		 * These are static so they can be accessed from the resolve callback,
-		 * potentially from multiple threads concurrently, so access to them
-		 * must be serialised using a mutex.
+		 * The context of each resolve in flight, so that they can all be
+		 * outstanding at once. When watching, a resolver is kept until its
+		 * service goes away, so that it reports any change of address.
 		 */
-        static host_callback_t shared_host_callback;
-        static void *shared_callback_arg;
-        static bool shared_continue_enumeration;
+		class Resolution {
+		public:
+			Session *session;
+			AvahiServiceResolver *resolver;
+			AvahiIfIndex interface;
+			AvahiProtocol protocol;
+			std::string name;
+		};
+		std::set<Resolution *> resolutions;
     private:
     	static void resolve_callback(
     	    AvahiServiceResolver *r,
@@ -45,6 +84,24 @@ private:
     	    AvahiLookupResultFlags flags,
 			void *userdata
 		);
+		void resolved(
+			Resolution *resolution,
+			AvahiServiceResolver *r,
+			AvahiResolverEvent event,
+			const char *name,
+			const char *type,
+			const char *domain,
+			const char *host_name,
+			const AvahiAddress *address,
+			uint16_t port,
+			AvahiStringList *txt,
+			AvahiLookupResultFlags flags
+		);
+		void free_resolution(Resolution *resolution) {
+			avahi_service_resolver_free(resolution->resolver);
+			resolutions.erase(resolution);
+			delete resolution;
+		}
 		void new_device(
 			AvahiIfIndex interface,
 			AvahiProtocol protocol,
@@ -70,10 +127,21 @@ private:
     	    assert(c);
     	    /* Called whenever the client or server state changes */
     	    if (state == AVAHI_CLIENT_FAILURE) {
-    	        const char *errmsg = avahi_strerror(avahi_client_errno(c));
-    	        avahi_simple_poll_quit(simple_poll);
-    	        throw errmsg;
+				// Exceptions cannot pass through Avahi, so discover() throws this
+				fail(avahi_strerror(avahi_client_errno(c)));
     	    }
+    	}
+		void fail(const char *errmsg) {
+			if (!error) {
+				error = errmsg;
+			}
+			done = true;
+		}
+		bool finished() const {
+			if (stopping) {
+				return done || *stopping;
+			}
+			return done || (all_for_now && resolutions.empty());
     	}
     public:
     	static void browse_callback(
@@ -90,8 +158,9 @@ private:
     		Session *tthis = static_cast<Session *>(userdata);
     		tthis->browse_callback(b, interface, protocol, event, name, type, domain, flags);
     	}
-    	void discover() {
-    	    AvahiServiceBrowser *sb = avahi_service_browser_new(
+		/** Throws if Avahi cannot browse at all, as when its daemon is not running. */
+		void browse() {
+    	    browser = avahi_service_browser_new(
     	    	client,
     			AVAHI_IF_UNSPEC,
     			AVAHI_PROTO_UNSPEC,
@@ -101,22 +170,58 @@ private:
     			Session::browse_callback,
     			this
     		);
-    	    if (!sb) {
+    	    if (!browser) {
     	        throw avahi_strerror(avahi_client_errno(client));
     	    }
+		}
+		void run() {
     	    /* Run the main loop */
-    	    avahi_simple_poll_loop(simple_poll);
+			while (!finished()) {
+				int sleep_ms = STOP_POLL_MS;
+				if (!stopping) {
+					auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+					if (remaining <= 0) {
+						std::cerr << "Discovery timed out with " << resolutions.size() << " services unresolved" << std::endl;
+						break;
+					}
+					sleep_ms = static_cast<int>(remaining);
+				}
+				if (avahi_simple_poll_iterate(simple_poll, sleep_ms) != 0) {
+					break;
+				}
+			}
+			avahi_service_browser_free(browser);
+			browser = NULL;
+			if (error) {
+				throw error;
+			}
     	}
+    	void discover() {
+			browse();
+			run();
+		}
         Session(
         	MDNSResponder *presponder,
 			host_callback_t phost_callback,
 			void *pcallback_arg,
-			const std::string &pservice_type
+			const std::string &pservice_type,
+			std::chrono::milliseconds timeout,
+			remove_callback_t premove_callback = NULL,
+			const std::atomic<bool> *pstopping = NULL
 		) :
 			responder(presponder),
 			host_callback(phost_callback),
+			remove_callback(premove_callback),
 			callback_arg(pcallback_arg),
-			service_type(pservice_type)
+			service_type(pservice_type),
+			stopping(pstopping),
+			simple_poll(NULL),
+			client(NULL),
+			browser(NULL),
+			deadline(std::chrono::steady_clock::now() + timeout),
+			done(false),
+			error(NULL),
+			all_for_now(false)
     	{
     	    /* Allocate main loop object */
     	    if (!(simple_poll = avahi_simple_poll_new())) {
@@ -126,18 +231,121 @@ private:
     		int error;
     	    client = avahi_client_new(poll, AVAHI_CLIENT_NO_FAIL, client_callback, this, &error);
     	    if (!client) {
+				avahi_simple_poll_free(simple_poll);
     	        throw avahi_strerror(error);
     	    }
         }
-        ~Session() {}
+        ~Session() {
+			// Frees any browser and resolvers still outstanding, without calling back
+			avahi_client_free(client);
+			avahi_simple_poll_free(simple_poll);
+			for (Resolution *resolution: resolutions) {
+				delete resolution;
+			}
+		}
     };
 private:
+	bool use_avahi;
+	std::string fallback_group;
+	uint16_t fallback_port;
+	std::string fallback_interface;
+	void query_directly(
+		const std::string &service_type,
+		host_callback_t callback,
+		void *callback_arg,
+		std::chrono::milliseconds timeout
+	) {
+		mynanoleaf::MDNSQuerier querier(fallback_group, fallback_port, fallback_interface);
+		querier.query(service_type, [callback, callback_arg](const mynanoleaf::MDNSQuerier::Service &service) {
+			AvahiAddress address;
+			if (!avahi_address_parse(service.address.c_str(), AVAHI_PROTO_UNSPEC, &address)) {
+				std::cerr << "Ignoring service '" << service.name << "' with bad address " << service.address << std::endl;
+				return true;
+			}
+			return callback(address, service.hostname, service.port, service.id, callback_arg);
+		}, timeout);
+	}
 public:
-	MDNSResponder() {
+	static const int STOP_POLL_MS = 100;
+	static const std::chrono::milliseconds DEFAULT_TIMEOUT;
+	/**
+	 * The numeric address for IPv4, which needs no further lookup, or
+	 * else the hostname.
+	 */
+	static std::string connectable_address(const AvahiAddress &address, const std::string &hostname) {
+		if (address.proto != AVAHI_PROTO_INET) {
+			return hostname;
+		}
+		char a[AVAHI_ADDRESS_STR_MAX];
+		avahi_address_snprint(a, sizeof(a), &address);
+		return a;
+	}
+	MDNSResponder() :
+		use_avahi(true),
+		fallback_group(MDNS_GROUP),
+		fallback_port(MDNS_PORT)
+	{
+	}
+	/**
+	 * Whether to browse through the Avahi daemon, where it is running;
+	 * otherwise discover() queries the network itself.
+	 */
+	void set_use_avahi(bool use) {
+		use_avahi = use;
+	}
+	/**
+	 * Where discover() sends its own queries, and from which interface,
+	 * such as a loopback responder standing in for controllers.
+	 */
+	void set_fallback(const std::string &group, uint16_t port, const std::string &interface_address = "") {
+		fallback_group = group;
+		fallback_port = port;
+		fallback_interface = interface_address;
 	}
 	virtual ~MDNSResponder() {}
-	void discover(const std::string &service_type, host_callback_t callback, void *callback_arg) {
-		Session session(this, callback, callback_arg, service_type);
+	/**
+	 * Reports each device as soon as it is resolved, until all those
+	 * present have been, the callback returns false, or timeout passes.
+	 * All are resolved at once, so this takes about one round trip
+	 * however many there are. Without an Avahi daemon to browse through,
+	 * this sends the queries itself.
+	 */
+	void discover(
+		const std::string &service_type,
+		host_callback_t callback,
+		void *callback_arg,
+		std::chrono::milliseconds timeout = DEFAULT_TIMEOUT
+	) {
+		if (use_avahi) {
+			std::unique_ptr<Session> session;
+			try {
+				session.reset(new Session(this, callback, callback_arg, service_type, timeout));
+				session->browse();
+			} catch (const char *errmsg) {
+				std::cerr << "Cannot browse through Avahi (" << errmsg << "), querying directly" << std::endl;
+				session.reset();
+			}
+			if (session) {
+				session->run();
+				return;
+			}
+		}
+		query_directly(service_type, callback, callback_arg, timeout);
+	}
+	/**
+	 * Browses until stopping is set, reporting devices as they appear,
+	 * change address and go away, rather than only those present now.
+	 * A device is reported gone once it has gone from every interface
+	 * and protocol it was seen on.
+	 */
+	void watch(
+		const std::string &service_type,
+		host_callback_t callback,
+		remove_callback_t remove_callback,
+		void *callback_arg,
+		const std::atomic<bool> &stopping
+	) {
+		Session session(this, callback, callback_arg, service_type, std::chrono::milliseconds(0), remove_callback, &stopping);
 		session.discover();
 	}
 };
@@ -0,0 +1,66 @@
+#ifndef DISCOVERYCACHE_H
+#define DISCOVERYCACHE_H 1
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define DISCOVERY_CACHE_FILENAME "discovery_cache.dat"
+
+namespace mynanoleaf {
+
+/**
+ * The controllers found by earlier discoveries, so that they can be used
+ * at once on startup while a browse revalidates them in the background.
+ * The file holds a line per device: its ID, address, port and layout
+ * hash. It is read once and rewritten whenever an entry changes. Safe to
+ * use from several threads at once.
+ */
+class DiscoveryCache {
+public:
+	class Entry {
+	public:
+		std::string id;
+		/** A numeric IPv4 address where known, otherwise the hostname. */
+		std::string address;
+		uint16_t port;
+		/** From LayoutGeometry::hash_layout(); zero if not yet known. */
+		uint64_t layout_hash;
+	};
+private:
+	std::string path;
+	mutable std::mutex mutex;
+	std::map<std::string, Entry> entries;
+	std::thread revalidator;
+	void load();
+	void save();
+public:
+	DiscoveryCache(const std::string &ppath = DISCOVERY_CACHE_FILENAME);
+	DiscoveryCache(const DiscoveryCache &) = delete;
+	DiscoveryCache &operator=(const DiscoveryCache &) = delete;
+	virtual ~DiscoveryCache() { wait(); }
+	std::vector<Entry> get_entries() const;
+	bool get(const std::string &id, Entry &entry) const;
+	/**
+	 * Records where a device was found, keeping any layout hash already
+	 * known for it. Returns true if its address or port changed.
+	 */
+	bool update(const std::string &id, const std::string &address, uint16_t port);
+	void set_layout_hash(const std::string &id, uint64_t layout_hash);
+	/** Runs browse on a thread of its own; only one at a time. */
+	void revalidate(std::function<void()> browse);
+	/** Waits for any revalidation to finish. */
+	void wait() {
+		if (revalidator.joinable()) {
+			revalidator.join();
+		}
+	}
+};
+
+}
+
+#endif /* DISCOVERYCACHE_H */
@@ -0,0 +1,133 @@
+#ifndef EVENTS_H
+#define EVENTS_H 1
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <nlohmann/json.hpp>
+
+#include "mycurlpp.h"
+
+namespace mynanoleaf {
+
+using json = nlohmann::json;
+
+/** The id of each kind of event in the controller's /events stream. */
+enum EventType {
+	EVENT_STATE = 1,
+	EVENT_LAYOUT = 2,
+	EVENT_EFFECTS = 3,
+	EVENT_TOUCH = 4
+};
+
+/** The attr of each kind of state event. */
+enum StateAttribute {
+	STATE_ON = 1,
+	STATE_BRIGHTNESS = 2,
+	STATE_HUE = 3,
+	STATE_SAT = 4,
+	STATE_CT = 5,
+	STATE_COLOR_MODE = 6
+};
+
+enum LayoutAttribute {
+	LAYOUT_LAYOUT = 1,
+	LAYOUT_GLOBAL_ORIENTATION = 2
+};
+
+enum EffectsAttribute {
+	EFFECTS_SELECT = 1
+};
+
+/**
+ * One change reported by the controller. Touch events carry a panel and
+ * gesture; all others an attribute and its new value.
+ */
+class AuroraEvent {
+public:
+	EventType type;
+	int attr;
+	json value;
+	int panel_id;
+	int gesture;
+	AuroraEvent() : type(EVENT_STATE), attr(0), panel_id(0), gesture(0) {}
+};
+
+/**
+ * An incremental parser for text/event-stream, fed in arbitrary chunks.
+ * Each event is dispatched with its id and its data lines joined by
+ * newlines once the blank line ending it arrives.
+ */
+class ServerSentEventParser {
+public:
+	typedef std::function<void(const std::string &id, const std::string &data)> handler_t;
+private:
+	handler_t handler;
+	std::string line;
+	std::string id;
+	std::string data;
+	bool have_data;
+	bool skip_lf;
+	void process_line();
+public:
+	ServerSentEventParser(handler_t phandler) : handler(phandler) { reset(); }
+	void reset();
+	void feed(const char *p, size_t n);
+};
+
+/**
+ * A long-lived subscription to a controller's /events stream, run on its
+ * own thread and connection. Each event is passed to the handler on that
+ * thread. When the stream drops or cannot be opened, it is reopened after
+ * a delay which doubles with each consecutive failure.
+ */
+class EventSubscription {
+public:
+	typedef std::function<void(const AuroraEvent &event)> handler_t;
+	static const std::chrono::milliseconds INITIAL_BACKOFF;
+	static const std::chrono::milliseconds MAX_BACKOFF;
+private:
+	mycurlpp::Curl curl;
+	CURLM *multi;
+	struct curl_slist *headers;
+	handler_t handler;
+	ServerSentEventParser parser;
+	std::atomic<bool> stopping;
+	std::atomic<uint64_t> connects;
+	std::atomic<uint64_t> events_received;
+	bool got_data;
+	std::mutex wait_mutex;
+	std::condition_variable wait_cv;
+	std::thread thread;
+	void run();
+	void stream_once();
+	void dispatch(const std::string &id, const std::string &data);
+	static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+public:
+	/**
+	 * Path is that of the /events endpoint, including the id query
+	 * naming the event types wanted. A non-zero touch_events_port asks
+	 * the controller to also send raw touch datagrams there.
+	 */
+	EventSubscription(
+		const std::string &hostname,
+		unsigned int port,
+		const std::string &path,
+		handler_t phandler,
+		uint16_t touch_events_port = 0
+	);
+	EventSubscription(const EventSubscription &) = delete;
+	EventSubscription &operator=(const EventSubscription &) = delete;
+	virtual ~EventSubscription();
+	uint64_t get_connects() const { return connects; }
+	uint64_t get_events_received() const { return events_received; }
+};
+
+}
+
+#endif /* EVENTS_H */
@@ -0,0 +1,152 @@
+#ifndef FRAMEQUEUE_H
+#define FRAMEQUEUE_H 1
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+
+#include "streaming.h"
+
+namespace mynanoleaf {
+
+/**
+ * Lock-free single-producer/single-consumer ring of N frame slots.
+ * Frame buffers are owned by the queue and recycled, so that a producer
+ * which reuses its buffer's capacity does not allocate in steady state.
+ * If the consumer falls behind, publishing overwrites the oldest pending
+ * frame rather than blocking the producer, and the consumer never
+ * receives frames out of order.
+ */
+template<typename T, size_t N> class FrameQueue {
+private:
+	struct Entry {
+		uint64_t seq;
+		T value;
+	};
+	static const size_t POOL_SIZE = N + 2;
+	Entry pool[POOL_SIZE];
+	std::atomic<Entry *> slots[N];
+	// Producer state
+	std::atomic<uint64_t> tail;
+	Entry *writing;
+	std::atomic<uint64_t> overwritten;
+	// Consumer state
+	uint64_t head;
+	Entry *reading;
+	// Entries handed back from the consumer to the producer
+	std::atomic<Entry *> recycled[POOL_SIZE];
+	std::atomic<uint64_t> recycled_head, recycled_tail;
+	void recycle(Entry *e) {
+		uint64_t t = recycled_tail.load(std::memory_order_relaxed);
+		assert(t - recycled_head.load(std::memory_order_acquire) < POOL_SIZE);
+		recycled[t % POOL_SIZE].store(e, std::memory_order_relaxed);
+		recycled_tail.store(t + 1, std::memory_order_release);
+	}
+	Entry *reuse() {
+		uint64_t h = recycled_head.load(std::memory_order_relaxed);
+		// Of the N + 2 entries, at most N are in slots and one is held by
+		// the consumer, so one must be waiting here.
+		assert(h != recycled_tail.load(std::memory_order_acquire));
+		Entry *e = recycled[h % POOL_SIZE].load(std::memory_order_relaxed);
+		recycled_head.store(h + 1, std::memory_order_release);
+		return e;
+	}
+public:
+	FrameQueue() : tail(0), overwritten(0), head(0), reading(NULL), recycled_head(0), recycled_tail(0) {
+		for (size_t i = 0; i < N; i++) {
+			slots[i].store(NULL, std::memory_order_relaxed);
+		}
+		writing = &pool[0];
+		for (size_t i = 1; i < POOL_SIZE; i++) {
+			recycle(&pool[i]);
+		}
+	}
+	virtual ~FrameQueue() {}
+	/**
+	 * Producer: the buffer to fill in before calling publish(). It holds
+	 * whatever frame last occupied it.
+	 */
+	T &back() { return writing->value; }
+	void publish() {
+		uint64_t seq = tail.load(std::memory_order_relaxed);
+		writing->seq = seq;
+		Entry *old = slots[seq % N].exchange(writing, std::memory_order_acq_rel);
+		if (old) {
+			overwritten.fetch_add(1, std::memory_order_relaxed);
+			writing = old;
+		} else {
+			writing = reuse();
+		}
+		tail.store(seq + 1, std::memory_order_release);
+	}
+	/**
+	 * Consumer: the oldest frame not yet consumed, or NULL if there is
+	 * none. The frame remains valid until the next call.
+	 */
+	const T *consume() {
+		if (reading) {
+			recycle(reading);
+			reading = NULL;
+		}
+		for (;;) {
+			uint64_t t = tail.load(std::memory_order_acquire);
+			if (head >= t) {
+				return NULL;
+			}
+			if (t - head > N) {
+				head = t - N;
+			}
+			Entry *e = slots[head % N].exchange(NULL, std::memory_order_acq_rel);
+			if (!e) {
+				head++;
+			} else if (e->seq < head) {
+				// Superseded by a newer frame already consumed from a lapped slot
+				overwritten.fetch_add(1, std::memory_order_relaxed);
+				recycle(e);
+			} else {
+				head = e->seq + 1;
+				reading = e;
+				return &e->value;
+			}
+		}
+	}
+	uint64_t get_published() const { return tail.load(std::memory_order_relaxed); }
+	uint64_t get_overwritten() const { return overwritten.load(std::memory_order_relaxed); }
+};
+
+/**
+ * Sends frames to an IPStream from a dedicated thread, so that the
+ * thread computing the effect never blocks in the network stack.
+ */
+class FrameSender {
+public:
+	static const size_t QUEUE_LENGTH = 4;
+private:
+	IPStream &stream;
+	FrameQueue<std::vector<PanelCommand>, QUEUE_LENGTH> queue;
+	int event_fd;
+	std::atomic<bool> stopping;
+	std::thread thread;
+	void notify();
+	void run();
+public:
+	FrameSender(IPStream &pstream);
+	virtual ~FrameSender();
+	/**
+	 * The commands for the next frame, to be filled in from scratch
+	 * before calling publish().
+	 */
+	std::vector<PanelCommand> &next_frame() { return queue.back(); }
+	void publish() {
+		queue.publish();
+		notify();
+	}
+	uint64_t get_published() const { return queue.get_published(); }
+	uint64_t get_overwritten() const { return queue.get_overwritten(); }
+};
+
+}
+
+#endif /* FRAMEQUEUE_H */
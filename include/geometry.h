@@ -0,0 +1,94 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H 1
+
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <cstdint>
+
+#include "aurora.h"
+
+namespace mynanoleaf {
+
+class Point {
+public:
+	double x, y;
+};
+
+class PanelGeometry {
+public:
+	int id;
+	Point centroid;
+	Point vertices[3];
+};
+
+/**
+ * Triangle geometry derived from a Layout: vertices and centroid of each
+ * panel, a compressed sparse row graph of panels sharing an edge, and a
+ * uniform grid over the centroids with cells one side length across.
+ * Panels are referred to by their index in the layout's positions.
+ */
+class LayoutGeometry {
+private:
+	uint64_t hash;
+	double side_length;
+	std::vector<PanelGeometry> panels;
+	std::unordered_map<int, uint32_t> index_by_id;
+	// Neighbours of panel i are adjacency[adjacency_offsets[i]] up to adjacency[adjacency_offsets[i + 1]]
+	std::vector<uint32_t> adjacency_offsets;
+	std::vector<uint32_t> adjacency;
+	// Panels whose centroid lies in cell c are cell_panels[cell_offsets[c]] up to cell_panels[cell_offsets[c + 1]]
+	Point grid_origin;
+	int grid_cols, grid_rows;
+	std::vector<uint32_t> cell_offsets;
+	std::vector<uint32_t> cell_panels;
+	void build_panels(const Layout &layout);
+	void build_grid();
+	void build_adjacency();
+	int cell_col(double x) const;
+	int cell_row(double y) const;
+	template<typename F> void for_each_in_cells(int col0, int row0, int col1, int row1, F f) const;
+public:
+	LayoutGeometry(const Layout &layout);
+	virtual ~LayoutGeometry() {}
+	/**
+	 * The geometry for a layout, shared with any other caller asking
+	 * for a layout with the same hash while it remains in use.
+	 */
+	static std::shared_ptr<const LayoutGeometry> get(const Layout &layout);
+	static uint64_t hash_layout(const Layout &layout);
+	uint64_t get_hash() const { return hash; }
+	double get_side_length() const { return side_length; }
+	size_t size() const { return panels.size(); }
+	const PanelGeometry &panel(size_t i) const { return panels[i]; }
+	const std::vector<PanelGeometry> &get_panels() const { return panels; }
+	/**
+	 * The index of the panel with the given ID, or -1.
+	 */
+	int index_of(int panel_id) const;
+	std::pair<const uint32_t *, const uint32_t *> neighbours(size_t i) const {
+		return std::make_pair(
+			adjacency.data() + adjacency_offsets[i],
+			adjacency.data() + adjacency_offsets[i + 1]
+		);
+	}
+	/**
+	 * Appends the panels whose centroid lies within radius of centre.
+	 */
+	void within_radius(const Point &centre, double radius, std::vector<uint32_t> &result) const;
+	/**
+	 * Appends each panel the ray crosses within max_distance, with the
+	 * distance at which the ray enters it, nearest first.
+	 */
+	void along_ray(
+		const Point &origin,
+		const Point &direction,
+		double max_distance,
+		std::vector<std::pair<double, uint32_t> > &result
+	) const;
+};
+
+}
+
+#endif /* GEOMETRY_H */
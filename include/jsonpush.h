@@ -0,0 +1,90 @@
+#ifndef JSONPUSH_H
+#define JSONPUSH_H 1
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace mynanoleaf {
+
+/**
+ * An incremental JSON tokenizer. Input is pushed in arbitrarily split
+ * chunks, as it arrives from the network, and each token is passed to
+ * the handler methods as soon as it is complete. Nothing is kept but
+ * the current token and the nesting of the enclosing containers.
+ *
+ * Syntax errors are thrown as std::string.
+ */
+class JsonPushParser {
+private:
+	enum LexState {
+		LEX_NONE,
+		LEX_STRING,
+		LEX_STRING_ESCAPE,
+		LEX_STRING_UNICODE,
+		LEX_NUMBER,
+		LEX_LITERAL
+	};
+	enum Expect {
+		EXPECT_VALUE,
+		EXPECT_FIRST_VALUE,
+		EXPECT_KEY,
+		EXPECT_FIRST_KEY,
+		EXPECT_COLON,
+		EXPECT_COMMA_OR_END,
+		EXPECT_NOTHING
+	};
+	LexState lex;
+	Expect expect;
+	std::vector<char> containers;
+	std::string token;
+	bool token_is_key;
+	unsigned int unicode_digits;
+	uint32_t unicode_value;
+	uint32_t high_surrogate;
+	const char *literal;
+	size_t literal_pos;
+	size_t offset;
+	std::exception_ptr error;
+	void syntax_error(const char *what);
+	void value_done() {
+		expect = containers.empty() ? EXPECT_NOTHING : EXPECT_COMMA_OR_END;
+	}
+	void start_value();
+	void finish_number();
+	void finish_unicode();
+	void flush_surrogate();
+	void append_utf8(uint32_t cp);
+	size_t feed_string(const char *p, const char *end);
+protected:
+	virtual void on_start_object() = 0;
+	virtual void on_end_object() = 0;
+	virtual void on_start_array() = 0;
+	virtual void on_end_array() = 0;
+	virtual void on_key(const std::string &key) = 0;
+	virtual void on_string(const std::string &value) = 0;
+	virtual void on_integer(long long value) = 0;
+	virtual void on_real(double value) { on_integer(static_cast<long long>(value)); }
+	virtual void on_bool(bool value) = 0;
+	virtual void on_null() {}
+public:
+	JsonPushParser() { reset(); }
+	virtual ~JsonPushParser() {}
+	void reset();
+	void feed(const char *p, size_t n);
+	/** Checks that exactly one complete document was fed. */
+	virtual void finish();
+	/**
+	 * A curl write callback feeding the parser given as userdata. A
+	 * syntax error aborts the transfer, and is rethrown by
+	 * rethrow_error() or finish().
+	 */
+	static size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+	void rethrow_error();
+};
+
+}
+
+#endif /* JSONPUSH_H */
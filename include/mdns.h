@@ -0,0 +1,152 @@
+#ifndef MDNS_H
+#define MDNS_H 1
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#define MDNS_GROUP "224.0.0.251"
+#define MDNS_PORT 5353
+
+namespace mynanoleaf {
+
+enum DNSType {
+	DNS_TYPE_A = 1,
+	DNS_TYPE_PTR = 12,
+	DNS_TYPE_TXT = 16,
+	DNS_TYPE_AAAA = 28,
+	DNS_TYPE_SRV = 33,
+	DNS_TYPE_ANY = 255
+};
+
+static const uint16_t DNS_CLASS_IN = 1;
+/** The top bit of an mDNS record's class, which is not part of it. */
+static const uint16_t MDNS_CLASS_MASK = 0x7fff;
+static const uint16_t DNS_FLAG_RESPONSE = 0x8000;
+static const uint16_t DNS_FLAG_AUTHORITATIVE = 0x0400;
+
+/**
+ * A resource record, with those fields its type uses filled in. Names
+ * are dotted, with any dots or backslashes within a label escaped by a
+ * backslash, and without the trailing dot.
+ */
+class DNSRecord {
+public:
+	std::string name;
+	uint16_t type;
+	uint32_t ttl;
+	/** The PTR target or SRV host. */
+	std::string target;
+	uint16_t port;
+	std::vector<std::string> txt;
+	/** The numeric A or AAAA address. */
+	std::string address;
+	DNSRecord() : type(0), ttl(0), port(0) {}
+	DNSRecord(const std::string &pname, uint16_t ptype, uint32_t pttl = 120) :
+		name(pname), type(ptype), ttl(pttl), port(0) {}
+	/** The value of key in a TXT record, or empty if it has none. */
+	std::string get_txt(const std::string &key) const;
+};
+
+class DNSQuestion {
+public:
+	std::string name;
+	uint16_t type;
+};
+
+/**
+ * Just enough of the DNS wire format for service discovery. Names are
+ * written uncompressed; compressed ones are followed when parsing.
+ */
+class DNSMessage {
+public:
+	uint16_t id;
+	uint16_t flags;
+	std::vector<DNSQuestion> questions;
+	/** The answer, authority and additional sections together. */
+	std::vector<DNSRecord> records;
+	DNSMessage() : id(0), flags(0) {}
+	/** Throws std::string if the message is malformed or truncated. */
+	void parse(const uint8_t *data, size_t size);
+	void encode(std::vector<uint8_t> &out) const;
+	/** Compares names as DNS does, ignoring ASCII case. */
+	static bool same_name(const std::string &a, const std::string &b);
+};
+
+/**
+ * Finds services without an mDNS daemon, as a one-shot legacy querier
+ * (RFC 6762 section 6.7): queries are sent to the multicast group from
+ * an ephemeral port, and responders answer that port directly, so the
+ * mDNS port need not be free. Answers are gathered until every instance
+ * named has its host, port, address and TXT record, asking again for any
+ * that are missing, and the query finishes once nothing new has arrived
+ * for QUIET_PERIOD, or timeout passes. The service query is repeated at
+ * growing intervals from FIRST_RETRY, in case a datagram was lost.
+ */
+class MDNSQuerier {
+public:
+	class Service {
+	public:
+		std::string name;
+		std::string hostname;
+		uint16_t port;
+		/** Numeric; IPv4 if the host has one. */
+		std::string address;
+		/** The id= key of the TXT record. */
+		std::string id;
+		Service() : port(0) {}
+	};
+	/** Returns false when no more services are wanted. */
+	typedef std::function<bool(const Service &service)> found_t;
+	static const std::chrono::milliseconds FIRST_RETRY;
+	static const std::chrono::milliseconds QUIET_PERIOD;
+private:
+	class Instance {
+	public:
+		bool has_srv;
+		bool has_txt;
+		bool reported;
+		Service service;
+		Instance() : has_srv(false), has_txt(false), reported(false) {}
+	};
+	std::string group;
+	uint16_t port;
+	std::string interface_address;
+	int fd;
+	uint16_t next_id;
+	uint64_t queries_sent;
+	uint64_t responses_received;
+	void send(const std::vector<DNSQuestion> &questions);
+	bool receive(
+		const std::string &service_name,
+		std::map<std::string, Instance> &instances,
+		std::map<std::string, std::string> &addresses
+	);
+public:
+	/**
+	 * interface_address picks the interface to send from, by its IPv4
+	 * address, such as 127.0.0.1 for responders on this host; otherwise
+	 * the system chooses.
+	 */
+	MDNSQuerier(
+		const std::string &pgroup = MDNS_GROUP,
+		uint16_t pport = MDNS_PORT,
+		const std::string &pinterface_address = ""
+	);
+	virtual ~MDNSQuerier();
+	/** service_type is as Avahi takes it, such as _nanoleafapi._tcp. */
+	void query(
+		const std::string &service_type,
+		found_t found,
+		std::chrono::milliseconds timeout
+	);
+	uint64_t get_queries_sent() const { return queries_sent; }
+	uint64_t get_responses_received() const { return responses_received; }
+};
+
+}
+
+#endif /* MDNS_H */
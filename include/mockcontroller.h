@@ -0,0 +1,152 @@
+#ifndef MOCKCONTROLLER_H
+#define MOCKCONTROLLER_H 1
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "mdns.h"
+#include "streaming.h"
+
+namespace mynanoleaf {
+
+using json = nlohmann::json;
+
+class ReceivedPacket {
+public:
+	std::chrono::steady_clock::time_point received;
+	ProtocolVersion version;
+	size_t size;
+	std::vector<PanelCommand> commands;
+};
+
+/**
+ * A stand-in for a controller, serving the REST API on the loopback
+ * interface from a canned controller-info document and decoding the
+ * extControl packets sent to it. Everything runs on one thread, which
+ * also invokes the packet callback.
+ */
+class MockController {
+public:
+	typedef std::function<void(const ReceivedPacket &packet)> packet_callback_t;
+private:
+	class Connection {
+	public:
+		std::string in;
+		std::string out;
+		bool close_after;
+		/** The event types subscribed to, if this is an /events stream. */
+		std::vector<int> event_types;
+		Connection() : close_after(false) {}
+	};
+	std::string token;
+	std::string stream_protocol;
+	mutable std::mutex info_mutex;
+	json info;
+	/** The last custom effect written. */
+	json custom_effect;
+	ProtocolVersion stream_version;
+	int http_fd;
+	uint16_t http_port;
+	int stream_fd;
+	uint16_t stream_port;
+	int stream_conn_fd;
+	int wake_fd;
+	std::map<int, Connection> connections;
+	std::mutex event_mutex;
+	std::vector<std::pair<int, std::string> > pending_events;
+	std::atomic<bool> dropping_events;
+	int touch_fd;
+	std::atomic<uint16_t> touch_events_port;
+	std::vector<uint8_t> touch_buf;
+	std::atomic<bool> pairing_open;
+	std::vector<uint8_t> stream_buf;
+	std::atomic<int> mdns_fd;
+	std::string mdns_id;
+	ReceivedPacket packet;
+	packet_callback_t packet_callback;
+	std::atomic<bool> stopping;
+	std::atomic<uint64_t> requests_served;
+	std::atomic<uint64_t> packets_received;
+	std::atomic<uint64_t> bytes_received;
+	std::thread thread;
+	void run();
+	void accept_http();
+	bool read_http(int fd, Connection &conn);
+	bool handle_request(Connection &conn);
+	void respond(
+		const std::string &method,
+		const std::string &path,
+		const std::string &body,
+		unsigned int &status,
+		std::string &response
+	);
+	void read_stream();
+	/** Moves the UDP stream socket to the fixed version 2 port, if it can. */
+	bool listen_v2_stream();
+	void answer_mdns();
+	void decode_stream();
+	void wake();
+	void send_events();
+	void queue_event(int type, const json &events);
+public:
+	MockController(
+		const std::string &info_path,
+		uint16_t phttp_port = 0,
+		const std::string &pstream_protocol = "udp"
+	);
+	virtual ~MockController();
+	uint16_t get_http_port() const { return http_port; }
+	uint16_t get_stream_port() const { return stream_port; }
+	const std::string &get_token() const { return token; }
+	/**
+	 * Must be set before any packets arrive.
+	 */
+	void set_packet_callback(packet_callback_t callback) { packet_callback = callback; }
+	json get_info() const {
+		std::lock_guard<std::mutex> lock(info_mutex);
+		return info;
+	}
+	json get_custom_effect() const {
+		std::lock_guard<std::mutex> lock(info_mutex);
+		return custom_effect;
+	}
+	/**
+	 * Sends an event to the /events subscribers, as the controller does
+	 * for touches. State and effect changes made through the API send
+	 * their own events.
+	 */
+	void push_event(int type, const json &events);
+	/**
+	 * Sends a touch datagram to the port given by the last /events
+	 * subscriber, returning false if none gave one.
+	 */
+	bool push_touch(const std::vector<TouchEvent> &touches);
+	/**
+	 * Whether POST /new hands out the token, as while the controller's
+	 * button is held; otherwise it gets 403 Forbidden. Open by default.
+	 */
+	void set_pairing_open(bool open) { pairing_open = open; }
+	/**
+	 * Answers mDNS queries for the controller's service on the loopback
+	 * interface, as the one with the given ID, on its HTTP port. Any
+	 * number of mocks may advertise on the same group and port.
+	 */
+	void advertise(const std::string &id, uint16_t port = MDNS_PORT, const std::string &group = MDNS_GROUP);
+	/** Closes all /events streams, as if the network had dropped. */
+	void drop_event_streams();
+	uint64_t get_requests_served() const { return requests_served; }
+	uint64_t get_packets_received() const { return packets_received; }
+	uint64_t get_bytes_received() const { return bytes_received; }
+};
+
+}
+
+#endif /* MOCKCONTROLLER_H */
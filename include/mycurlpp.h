@@ -3,11 +3,21 @@
 
 #include <iostream>
 #include <sstream>
+#include <cstring>
+#include <arpa/inet.h>
 #include <curl/curl.h>
 #include <curl/easy.h>
 
 namespace mycurlpp {
 
+/**
+ * One easy handle per server, reused for every request so that curl
+ * keeps the connection alive between them. The address the first
+ * request connects to is pinned, since resolving a .local name is an
+ * mDNS query. If a connection attempt fails, the pinned address is
+ * evicted from curl's DNS cache so that the next request looks the name
+ * up again; perform() retries at once with the fresh address.
+ */
 class Curl {
 private:
 	CURL *curl;
@@ -16,6 +26,74 @@ private:
 	bool use_ssl;
 	std::string path;
 	long last_response_code;
+	std::string url_prefix;
+	std::string url;
+	/** What CURLOPT_RESOLVE is set to: a pinned address, or an eviction. */
+	struct curl_slist *resolve_list;
+	bool pinned;
+	void init() {
+		if (!curl) {
+			throw "curl_easy_init failed";
+		}
+		update_url_prefix();
+		setopt(CURLOPT_TCP_KEEPALIVE, 1L);
+		setopt(CURLOPT_NOSIGNAL, 1L);
+	}
+	void update_url_prefix() {
+		url_prefix.assign(use_ssl ? "https://" : "http://");
+		url_prefix.append(hostname).append(":").append(std::to_string(port));
+	}
+	void set_resolve(const std::string &entry) {
+		clear_resolve();
+		resolve_list = curl_slist_append(NULL, entry.c_str());
+		if (!resolve_list) {
+			throw "curl_slist_append failed";
+		}
+		setopt(CURLOPT_RESOLVE, resolve_list);
+	}
+	void clear_resolve() {
+		if (resolve_list) {
+			setopt(CURLOPT_RESOLVE, static_cast<struct curl_slist *>(NULL));
+			curl_slist_free_all(resolve_list);
+			resolve_list = NULL;
+		}
+	}
+	/**
+	 * Evicts the pinned address. Clearing CURLOPT_RESOLVE would leave it
+	 * in curl's DNS cache, so this sets a "-host:port" entry instead,
+	 * which the next transfer applies as it starts.
+	 */
+	void unpin() {
+		if (pinned) {
+			pinned = false;
+			set_resolve("-" + hostname + ":" + std::to_string(port));
+		}
+	}
+	/**
+	 * Pins the address curl connected to for subsequent requests, so
+	 * that the first lookup is curl's own, which does not block a multi
+	 * handle. Numeric addresses need no pinning.
+	 */
+	void pin() {
+		struct in6_addr numeric;
+		if (
+			pinned ||
+			inet_pton(AF_INET, hostname.c_str(), &numeric) == 1 ||
+			inet_pton(AF_INET6, hostname.c_str(), &numeric) == 1
+		) {
+			return;
+		}
+		char *addr = NULL;
+		if (curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &addr) != CURLE_OK || !addr || !*addr) {
+			return;
+		}
+		bool v6 = (strchr(addr, ':') != NULL);
+		std::string entry(hostname);
+		entry.append(":").append(std::to_string(port)).append(":");
+		entry.append(v6 ? "[" : "").append(addr).append(v6 ? "]" : "");
+		set_resolve(entry);
+		pinned = true;
+	}
 public:
 	Curl(
 		const char *phostname = NULL,
@@ -25,12 +103,15 @@ public:
 		long plast_response_code = 0
 	) :
 		curl(curl_easy_init()),
-		hostname(phostname),
+		hostname(phostname ? phostname : ""),
 		port(pport),
 		use_ssl(puse_ssl),
 		path(ppath),
-		last_response_code(plast_response_code)
+		last_response_code(plast_response_code),
+		resolve_list(NULL),
+		pinned(false)
 	{
+		init();
 	}
 	Curl(
 		const std::string &phostname,
@@ -44,37 +125,49 @@ public:
 		port(pport),
 		use_ssl(puse_ssl),
 		path(ppath),
-		last_response_code(plast_response_code)
+		last_response_code(plast_response_code),
+		resolve_list(NULL),
+		pinned(false)
 	{
+		init();
 	}
+	Curl(const Curl &) = delete;
+	Curl &operator=(const Curl &) = delete;
 	virtual ~Curl() {
 		if (curl) {
 			curl_easy_cleanup(curl);
 		}
+		if (resolve_list) {
+			curl_slist_free_all(resolve_list);
+		}
 	}
-	void set_hostname(std::string &new_hostname) {
+	void set_hostname(const std::string &new_hostname) {
+		unpin();
 		hostname = new_hostname;
+		update_url_prefix();
 	}
 	void set_port(unsigned short new_port) {
+		unpin();
 		port = new_port;
+		update_url_prefix();
 	}
 	void set_ssl(bool new_ssl) {
 		use_ssl = new_ssl;
+		update_url_prefix();
 	}
 	void set_path(const std::string &new_path) {
 		path = new_path;
 	}
+	const std::string &get_hostname() const { return hostname; }
+	unsigned int get_port() const { return port; }
 	void make_url(
 		std::ostringstream &url
 	) {
 		url.clear();
-		url << "http" << (use_ssl ? "s" : "") << "://" << hostname <<
-				":" << port << path;
+		url << url_prefix << path;
 	}
 	std::string get_url(void) {
-		std::ostringstream url;
-		make_url(url);
-		return url.str();
+		return url_prefix + path;
 	}
 	operator CURL*(void) { return curl; }
 	operator const CURL*(void) { return curl; }
@@ -86,21 +179,62 @@ public:
 		}
 	}
 	unsigned int get_status(void) const { return static_cast<unsigned int>(last_response_code); }
-	unsigned int perform(void) {
-		std::ostringstream surl;
-		make_url(surl);
-		const std::string &url = surl.str();
+	/**
+	 * The status of the response to the last request, even if its
+	 * transfer was then aborted; zero if none was received.
+	 */
+	unsigned int get_response_code(void) {
+		long code = 0;
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+		return static_cast<unsigned int>(code);
+	}
+	std::string get_primary_ip(void) {
+		char *ip = NULL;
+		CURLcode res = curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip);
+		if (res != CURLE_OK) {
+			throw curl_easy_strerror(res);
+		}
+		return ip ? ip : "";
+	}
+	/**
+	 * Sets up the URL for a request, which may then be run either by
+	 * perform() or by a multi handle, and finally passed to finish().
+	 */
+	void prepare(void) {
+		url.assign(url_prefix).append(path);
+#ifndef NDEBUG
 		std::cerr << "Connecting to '" << url << "'" << std::endl;
+#endif /* ndef NDEBUG */
 		setopt(CURLOPT_URL, url.c_str());
-		CURLcode res;
-		res = curl_easy_perform(curl);
+	}
+	unsigned int finish(CURLcode res) {
+		if (!pinned) {
+			// Any eviction was applied as the transfer started
+			clear_resolve();
+		}
 		if (res == CURLE_OK) {
 			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &last_response_code);
+			pin();
 		} else {
+			if (res == CURLE_COULDNT_CONNECT) {
+				// The device may have a new address; look it up next time
+				unpin();
+			}
 			throw curl_easy_strerror(res);
 		}
 		return get_status();
 	}
+	unsigned int perform(void) {
+		prepare();
+		CURLcode res;
+		res = curl_easy_perform(curl);
+		if (res == CURLE_COULDNT_CONNECT && pinned) {
+			// The device may have a new address
+			unpin();
+			res = curl_easy_perform(curl);
+		}
+		return finish(res);
+	}
 };
 
 }
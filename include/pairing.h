@@ -0,0 +1,61 @@
+#ifndef PAIRING_H
+#define PAIRING_H 1
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+
+#include "aurora.h"
+#include "requestengine.h"
+
+namespace mynanoleaf {
+
+/**
+ * Pairs with many controllers at once. Each unpaired controller is asked
+ * for a token every interval until its button is held, so each finishes
+ * as soon as its pairing window opens, whatever the others are doing.
+ * Tokens are saved in the controllers' credential stores as they arrive.
+ *
+ * Everything runs on the engine, which the owner runs; the manager must
+ * outlive the pairings it starts.
+ */
+class PairingManager {
+public:
+	/** Called with a null pointer once paired, or with the last error on giving up. */
+	typedef std::function<void(Aurora &aurora, std::exception_ptr error)> paired_t;
+	static const std::chrono::milliseconds DEFAULT_INTERVAL;
+	static const std::chrono::milliseconds DEFAULT_ATTEMPT_TIMEOUT;
+private:
+	struct Pairing {
+		Aurora *aurora;
+		paired_t done;
+		std::chrono::steady_clock::time_point deadline;
+	};
+	RequestEngine &engine;
+	std::chrono::milliseconds interval;
+	std::chrono::milliseconds attempt_timeout;
+	std::chrono::milliseconds give_up_after;
+	size_t unpaired;
+	uint64_t attempts;
+	void attempt(std::shared_ptr<Pairing> pairing);
+	void finish(std::shared_ptr<Pairing> pairing, std::exception_ptr error);
+public:
+	/** A zero give_up_after keeps trying until paired. */
+	PairingManager(
+		RequestEngine &pengine,
+		std::chrono::milliseconds pinterval = DEFAULT_INTERVAL,
+		std::chrono::milliseconds pgive_up_after = std::chrono::milliseconds(0),
+		std::chrono::milliseconds pattempt_timeout = DEFAULT_ATTEMPT_TIMEOUT
+	);
+	PairingManager(const PairingManager &) = delete;
+	PairingManager &operator=(const PairingManager &) = delete;
+	/** Starts pairing, or calls done at once if there is already a token. */
+	void add(Aurora &aurora, paired_t done = paired_t());
+	size_t get_unpaired() const { return unpaired; }
+	uint64_t get_attempts() const { return attempts; }
+};
+
+}
+
+#endif /* PAIRING_H */
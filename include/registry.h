@@ -0,0 +1,83 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H 1
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "aurora.h"
+#include "discoverycache.h"
+
+namespace mynanoleaf {
+
+/**
+ * The controllers on the network, kept current by discovery running on
+ * a thread of its own for as long as the registry is started.
+ *
+ * The device list is never modified, only replaced, so readers such as
+ * render loops take a snapshot without locking and may keep it as long
+ * as they like; it holds the Auroras alive meanwhile. A device that goes
+ * away keeps its Aurora, marked not present, and gets it back with a
+ * higher generation when it returns, as after a reboot, so readers know
+ * to set it up again.
+ */
+class DeviceRegistry {
+public:
+	class Device {
+	public:
+		std::string id;
+		std::string address;
+		uint16_t port;
+		bool present;
+		/** How many times the device has appeared. */
+		unsigned int generation;
+		std::shared_ptr<Aurora> aurora;
+	};
+	typedef std::vector<Device> devices_t;
+	typedef std::shared_ptr<const devices_t> snapshot_t;
+	/** Called on the discovery thread after a device appears, moves or goes. */
+	typedef std::function<void(const Device &device)> listener_t;
+	static const std::chrono::milliseconds RETRY_INTERVAL;
+private:
+	DiscoveryCache *cache;
+	listener_t listener;
+	/** Only ever accessed through std::atomic_load and std::atomic_store. */
+	snapshot_t devices;
+	/** Serialises writers, which copy, change and publish the list. */
+	std::mutex write_mutex;
+	std::atomic<bool> stopping;
+	std::mutex stop_mutex;
+	std::condition_variable stop_cond;
+	std::thread thread;
+	void publish(const devices_t &next) {
+		std::atomic_store(&devices, snapshot_t(std::make_shared<const devices_t>(next)));
+	}
+	void run();
+public:
+	/**
+	 * Starts out with the devices in the cache, if given, assuming them
+	 * present, and keeps the cache up to date.
+	 */
+	DeviceRegistry(DiscoveryCache *pcache = NULL, listener_t plistener = listener_t());
+	DeviceRegistry(const DeviceRegistry &) = delete;
+	DeviceRegistry &operator=(const DeviceRegistry &) = delete;
+	virtual ~DeviceRegistry() { stop(); }
+	/** Starts the discovery thread; it retries while Avahi is unavailable. */
+	void start();
+	void stop();
+	snapshot_t snapshot() const { return std::atomic_load(&devices); }
+	/** Records a device found at an address; called by discovery. */
+	void add_or_update(const std::string &id, const std::string &address, uint16_t port);
+	/** Records that a device has gone away; called by discovery. */
+	void remove(const std::string &id);
+};
+
+}
+
+#endif /* REGISTRY_H */
@@ -0,0 +1,69 @@
+#ifndef RENDERLOOP_H
+#define RENDERLOOP_H 1
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "streaming.h"
+
+namespace mynanoleaf {
+
+class RenderStats {
+public:
+	uint64_t frames_rendered;
+	uint64_t frames_dropped;
+	uint64_t touches_received;
+	std::chrono::nanoseconds total_jitter;
+	std::chrono::nanoseconds max_jitter;
+	RenderStats() : frames_rendered(0), frames_dropped(0), touches_received(0), total_jitter(0), max_jitter(0) {}
+	std::chrono::nanoseconds mean_jitter() const {
+		return frames_rendered ? total_jitter / static_cast<std::chrono::nanoseconds::rep>(frames_rendered) : std::chrono::nanoseconds(0);
+	}
+	void report(std::ostream &os) const;
+};
+
+/**
+ * Drives an effect at a fixed frame rate from a monotonic timerfd.
+ * Ticks which elapse while an earlier frame is still being rendered or
+ * sent are coalesced: the effect is only asked for the most recent one,
+ * and the skipped ticks are counted as dropped.
+ */
+class RenderLoop {
+public:
+	/**
+	 * Fills in the commands for the given tick, which counts from zero at
+	 * the start of the loop and skips any dropped ticks. Returning false
+	 * ends the loop without sending.
+	 */
+	typedef std::function<bool(uint64_t tick, std::vector<PanelCommand> &commands)> effect_t;
+	/**
+	 * Called as soon as touches arrive, between frames, so that the next
+	 * frame can react to them.
+	 */
+	typedef std::function<void(const std::vector<TouchEvent> &touches)> touch_handler_t;
+private:
+	IPStream &stream;
+	std::chrono::nanoseconds period;
+	int timer_fd;
+	RenderStats stats;
+	std::vector<PanelCommand> commands;
+	TouchListener *touch_listener;
+	touch_handler_t touch_handler;
+	std::vector<TouchEvent> touches;
+public:
+	RenderLoop(IPStream &pstream, unsigned int frame_rate);
+	virtual ~RenderLoop();
+	/** Also waits for touches from the listener while running. */
+	void set_touch_listener(TouchListener *listener, touch_handler_t handler) {
+		touch_listener = listener;
+		touch_handler = handler;
+	}
+	void run(effect_t effect);
+	const RenderStats &get_stats() const { return stats; }
+};
+
+}
+
+#endif /* RENDERLOOP_H */
@@ -0,0 +1,62 @@
+#ifndef REQUESTENGINE_H
+#define REQUESTENGINE_H 1
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <utility>
+
+#include <curl/curl.h>
+
+namespace mynanoleaf {
+
+/**
+ * Runs transfers on many easy handles at once from a single thread,
+ * using the curl multi interface. At most max_concurrent transfers are
+ * in progress; the rest wait in submission order. Completions are
+ * called from run_once() on the calling thread, and may submit further
+ * requests. Timers let callers wait, for example before retrying,
+ * without blocking the other transfers.
+ *
+ * Each easy handle may only have one request submitted at a time.
+ */
+class RequestEngine {
+public:
+	typedef std::function<void(CURLcode result)> completion_t;
+	typedef std::function<void()> timer_callback_t;
+	static const size_t DEFAULT_MAX_CONCURRENT = 8;
+private:
+	CURLM *multi;
+	size_t max_concurrent;
+	std::deque<std::pair<CURL *, completion_t> > waiting;
+	std::unordered_map<CURL *, completion_t> active;
+	std::multimap<std::chrono::steady_clock::time_point, timer_callback_t> timers;
+	void start_waiting();
+	void collect();
+	void fire_timers();
+public:
+	RequestEngine(size_t pmax_concurrent = DEFAULT_MAX_CONCURRENT);
+	RequestEngine(const RequestEngine &) = delete;
+	RequestEngine &operator=(const RequestEngine &) = delete;
+	virtual ~RequestEngine();
+	void submit(CURL *handle, completion_t done);
+	/** Calls fn from run_once() once delay has passed. */
+	void add_timer(std::chrono::milliseconds delay, timer_callback_t fn);
+	/**
+	 * Waits up to timeout_ms for activity or the next timer, advances all
+	 * transfers and calls the completions of those which finished and the
+	 * timers which are due. Returns the number of requests and timers
+	 * still pending.
+	 */
+	size_t run_once(int timeout_ms = 1000);
+	/** Runs until no requests are pending. */
+	void run();
+	size_t get_pending() const { return waiting.size() + active.size() + timers.size(); }
+	size_t get_max_concurrent() const { return max_concurrent; }
+};
+
+}
+
+#endif /* REQUESTENGINE_H */
@@ -0,0 +1,57 @@
+#ifndef STATEWRITER_H
+#define STATEWRITER_H 1
+
+#include <chrono>
+
+#include "aurora.h"
+
+namespace mynanoleaf {
+
+/**
+ * Coalesces bursts of state changes, such as those from a slider, into
+ * as few PUT /state requests as possible. Each change replaces any
+ * pending one to the same field, and all pending changes go in one
+ * request.
+ *
+ * The first change after a quiet period is sent at once; later ones
+ * are held until window has passed since the previous request. Nothing
+ * runs in the background, so the owner must call poll() (get_timeout()
+ * says when) or commit(). Anything still pending is committed on
+ * destruction.
+ */
+class StateWriter {
+public:
+	static const std::chrono::milliseconds DEFAULT_WINDOW;
+private:
+	Aurora &aurora;
+	std::chrono::milliseconds window;
+	std::chrono::steady_clock::time_point last_sent;
+	json pending;
+	uint64_t changes;
+	uint64_t requests;
+	void set(const char *field, json value);
+public:
+	StateWriter(Aurora &paurora, std::chrono::milliseconds pwindow = DEFAULT_WINDOW);
+	StateWriter(const StateWriter &) = delete;
+	StateWriter &operator=(const StateWriter &) = delete;
+	virtual ~StateWriter();
+	void set_on(bool on);
+	/** Duration is the fade time in seconds. */
+	void set_brightness(int value, unsigned int duration = 0);
+	void set_hue(int value);
+	void set_sat(int value);
+	void set_ct(int value);
+	/** Sends any pending changes if the window has passed. Returns true if it sent. */
+	bool poll();
+	/** Sends any pending changes now. */
+	void commit();
+	bool is_pending() const { return !pending.empty(); }
+	/** How long until poll() will send, or -1 if nothing is pending. */
+	std::chrono::milliseconds get_timeout() const;
+	uint64_t get_changes() const { return changes; }
+	uint64_t get_requests() const { return requests; }
+};
+
+}
+
+#endif /* STATEWRITER_H */
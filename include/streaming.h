@@ -2,20 +2,251 @@
 #define STREAMING_H
 
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <cassert>
+#include <cstdint>
+#include <chrono>
 
 #include "aurora.h"
 
 namespace mynanoleaf {
 
+class IPStream;
+
+/**
+ * Versions of the extControl streaming wire format.
+ */
+enum ProtocolVersion : int {
+	PROTOCOL_V1 = 1,
+	PROTOCOL_V2 = 2
+};
+
+class Frame {
+private:
+	uint8_t r, g, b;
+	uint16_t t;
+public:
+	Frame(uint8_t pr, uint8_t pg, uint8_t pb, uint16_t pt)
+	:
+		r(pr), g(pg), b(pb), t(pt)
+	{}
+	virtual ~Frame() {}
+	uint8_t get_red() const { return r; }
+	uint8_t get_green() const { return g; }
+	uint8_t get_blue() const { return b; }
+	uint16_t get_transition_time() const { return t; }
+	bool same_colour(const Frame &other) const {
+		return r == other.r && g == other.g && b == other.b;
+	}
+	void write(IPStream &stream) const;
+};
+
+class PanelCommand {
+private:
+	uint16_t panel_id;
+	std::vector<Frame> frames;
+public:
+	PanelCommand(uint16_t ppanel_id) : panel_id(ppanel_id) {}
+	PanelCommand(uint16_t ppanel_id, const std::vector<Frame> &pframes) : panel_id(ppanel_id), frames(pframes) {}
+	virtual ~PanelCommand() {}
+	uint16_t get_panel_id() const { return panel_id; }
+	const std::vector<Frame> &get_frames() const { return frames; }
+	/**
+	 * Replaces this command with a single frame, reusing its storage.
+	 */
+	void assign(uint16_t ppanel_id, const Frame &frame) {
+		panel_id = ppanel_id;
+		frames.assign(1, frame);
+	}
+	void write(IPStream &stream) const;
+};
+
+/**
+ * The layout of one version of the wire format. Each specialisation is
+ * used by VersionedPacketEncoder, so the encoding loop is compiled once
+ * per version and never tests which version it is producing.
+ */
+template<ProtocolVersion V> struct WireFormat;
+
+/**
+ * Version 1: 8-bit panel count; per panel an 8-bit ID and frame count,
+ * then R, G, B, W and an 8-bit transition time per frame.
+ */
+template<> struct WireFormat<PROTOCOL_V1> {
+	static const size_t MAX_PANELS = 255;
+	static const size_t HEADER_SIZE = 1;
+	static const size_t FRAME_SIZE = 5;
+	/** A command without frames is sent with a frame count of zero. */
+	static bool encodes(const PanelCommand &c) {
+		return true;
+	}
+	static size_t panel_size(const PanelCommand &c) {
+		return 2 + c.get_frames().size() * FRAME_SIZE;
+	}
+	static uint8_t *put_header(uint8_t *p, size_t panel_count) {
+		if (panel_count > MAX_PANELS) {
+			throw std::string("Too many panels for version 1: ") + std::to_string(panel_count);
+		}
+		*p++ = static_cast<uint8_t>(panel_count);
+		return p;
+	}
+	static uint8_t *put_panel(uint8_t *p, const PanelCommand &c) {
+		const std::vector<Frame> &frames = c.get_frames();
+		if (c.get_panel_id() > 255 || frames.size() > 255) {
+			throw std::string("Panel ") + std::to_string(c.get_panel_id()) + " does not fit version 1";
+		}
+		*p++ = static_cast<uint8_t>(c.get_panel_id());
+		*p++ = static_cast<uint8_t>(frames.size());
+		for (auto &f: frames) {
+			if (f.get_transition_time() > 255) {
+				throw std::string("Transition time too long for version 1: ") + std::to_string(f.get_transition_time());
+			}
+			*p++ = f.get_red();
+			*p++ = f.get_green();
+			*p++ = f.get_blue();
+			*p++ = 0; // White; ignored
+			*p++ = static_cast<uint8_t>(f.get_transition_time());
+		}
+		return p;
+	}
+	static const uint8_t *get_header(const uint8_t *p, const uint8_t *end, size_t &panel_count) {
+		if (end - p < 1) {
+			return NULL;
+		}
+		panel_count = *p++;
+		return p;
+	}
+	static const uint8_t *get_panel(const uint8_t *p, const uint8_t *end, PanelCommand &c) {
+		if (end - p < 2) {
+			return NULL;
+		}
+		uint8_t panel_id = *p++;
+		uint8_t frame_count = *p++;
+		if (static_cast<size_t>(end - p) < frame_count * FRAME_SIZE) {
+			return NULL;
+		}
+		std::vector<Frame> frames;
+		frames.reserve(frame_count);
+		for (unsigned int i = 0; i < frame_count; i++, p += FRAME_SIZE) {
+			frames.push_back(Frame(p[0], p[1], p[2], p[4]));
+		}
+		c = PanelCommand(panel_id, frames);
+		return p;
+	}
+};
+
+/**
+ * Version 2: big-endian 16-bit panel count; per panel a 16-bit ID, R, G,
+ * B, W and a 16-bit transition time. There is no frame count; only the
+ * last frame of each command is sent.
+ */
+template<> struct WireFormat<PROTOCOL_V2> {
+	static const size_t MAX_PANELS = 65535;
+	static const size_t HEADER_SIZE = 2;
+	/** Only a command's last frame is sent, so one without frames is left out. */
+	static bool encodes(const PanelCommand &c) {
+		return !c.get_frames().empty();
+	}
+	static size_t panel_size(const PanelCommand &c) {
+		return 8;
+	}
+	static uint8_t *put_u16(uint8_t *p, uint16_t v) {
+		*p++ = static_cast<uint8_t>(v >> 8);
+		*p++ = static_cast<uint8_t>(v);
+		return p;
+	}
+	static uint8_t *put_header(uint8_t *p, size_t panel_count) {
+		if (panel_count > MAX_PANELS) {
+			throw std::string("Too many panels for version 2: ") + std::to_string(panel_count);
+		}
+		return put_u16(p, static_cast<uint16_t>(panel_count));
+	}
+	static uint8_t *put_panel(uint8_t *p, const PanelCommand &c) {
+		const Frame &f = c.get_frames().back();
+		p = put_u16(p, c.get_panel_id());
+		*p++ = f.get_red();
+		*p++ = f.get_green();
+		*p++ = f.get_blue();
+		*p++ = 0; // White; ignored
+		return put_u16(p, f.get_transition_time());
+	}
+	static uint16_t get_u16(const uint8_t *p) {
+		return static_cast<uint16_t>((p[0] << 8) | p[1]);
+	}
+	static const uint8_t *get_header(const uint8_t *p, const uint8_t *end, size_t &panel_count) {
+		if (end - p < 2) {
+			return NULL;
+		}
+		panel_count = get_u16(p);
+		return p + 2;
+	}
+	static const uint8_t *get_panel(const uint8_t *p, const uint8_t *end, PanelCommand &c) {
+		if (end - p < 8) {
+			return NULL;
+		}
+		c.assign(get_u16(p), Frame(p[2], p[3], p[4], get_u16(p + 6)));
+		return p + 8;
+	}
+};
+
+/**
+ * Serialises a complete set of panel commands into one contiguous buffer.
+ * The buffer is retained between calls, so once it has grown to fit the
+ * largest packet, encoding a frame performs no allocation.
+ */
+class PacketEncoder {
+protected:
+	std::vector<uint8_t> buf;
+public:
+	static const size_t DEFAULT_CAPACITY = 2048;
+	PacketEncoder(size_t capacity = DEFAULT_CAPACITY) {
+		buf.reserve(capacity);
+	}
+	virtual ~PacketEncoder() {}
+	virtual void encode(const std::vector<PanelCommand> &commands) = 0;
+	const uint8_t *data() const { return buf.data(); }
+	size_t size() const { return buf.size(); }
+	static PacketEncoder *create(ProtocolVersion version);
+};
+
+template<ProtocolVersion V> class VersionedPacketEncoder : public PacketEncoder {
+public:
+	VersionedPacketEncoder(size_t capacity = DEFAULT_CAPACITY) : PacketEncoder(capacity) {}
+	virtual ~VersionedPacketEncoder() {}
+	virtual void encode(const std::vector<PanelCommand> &commands) {
+		typedef WireFormat<V> Format;
+		size_t n = Format::HEADER_SIZE, panel_count = 0;
+		for (auto &c: commands) {
+			if (Format::encodes(c)) {
+				n += Format::panel_size(c);
+				panel_count++;
+			}
+		}
+		buf.resize(n);
+		uint8_t *p = Format::put_header(buf.data(), panel_count);
+		for (auto &c: commands) {
+			if (Format::encodes(c)) {
+				p = Format::put_panel(p, c);
+			}
+		}
+		assert(p == buf.data() + n);
+	}
+};
+
 class IPStream {
 private:
 	int fd;
+	std::unique_ptr<PacketEncoder> encoder;
+	uint64_t bytes_written;
 public:
 	IPStream(
 		const std::string &ipaddr,
 		uint16_t port,
 		int sock_type,
-		int sock_proto
+		int sock_proto,
+		ProtocolVersion version = PROTOCOL_V1
 	);
 	virtual ~IPStream();
 	virtual void write(uint8_t b) {
@@ -23,36 +254,60 @@ public:
 	}
 	virtual void write(const void *p, size_t n);
 	virtual void flush() {}
-	static IPStream *create(const std::string &proto, const std::string &ipaddr, uint16_t port);
+	/**
+	 * Writes a complete packet in a single system call, bypassing any
+	 * buffering done by subclasses.
+	 */
+	void send(const void *p, size_t n) {
+		flush();
+		IPStream::write(p, n);
+	}
+	void send(const std::vector<PanelCommand> &commands) {
+		encoder->encode(commands);
+		send(encoder->data(), encoder->size());
+	}
+	/** Bytes handed to the socket so far. */
+	uint64_t get_bytes_written() const { return bytes_written; }
+	static IPStream *create(
+		const std::string &proto,
+		const std::string &ipaddr,
+		uint16_t port,
+		ProtocolVersion version = PROTOCOL_V1
+	);
 };
 
 class UDPStream : public IPStream {
 public:
 	UDPStream(
 		const std::string &ipaddr,
-		uint16_t port
+		uint16_t port,
+		ProtocolVersion version = PROTOCOL_V1
 	);
 	virtual ~UDPStream() {}
 };
 
 class BufferedUDPStream : public UDPStream {
 private:
-	std::ostringstream buf;
+	std::vector<uint8_t> buf;
 public:
 	BufferedUDPStream(
 		const std::string &ipaddr,
-		uint16_t port
-	) : UDPStream(ipaddr, port) {
+		uint16_t port,
+		ProtocolVersion version = PROTOCOL_V1
+	) : UDPStream(ipaddr, port, version) {
 	}
 	virtual ~BufferedUDPStream() {
 		flush();
 	}
 	virtual void write(const void *p, size_t n) {
-		buf.write(static_cast<const char *>(p), n);
+		const uint8_t *pb = static_cast<const uint8_t *>(p);
+		buf.insert(buf.end(), pb, pb + n);
 	}
 	virtual void flush() {
-		UDPStream::write(buf.str().c_str(), buf.str().size());
-		buf.str("");
+		if (buf.size()) {
+			UDPStream::write(buf.data(), buf.size());
+			buf.clear();
+		}
 	}
 };
 
@@ -60,48 +315,134 @@ class TCPStream : public IPStream {
 public:
 	TCPStream(
 		const std::string &ipaddr,
-		uint16_t port
+		uint16_t port,
+		ProtocolVersion version = PROTOCOL_V1
 	);
 	virtual ~TCPStream() {}
 };
 
-class Frame {
-private:
-	uint8_t r, g, b, t;
+void write_panel_commands(IPStream &stream, const std::vector<PanelCommand> &commands);
+
+/**
+ * The inverse of write_panel_commands(): decodes one packet from the
+ * start of the buffer, returning the number of bytes it occupied, or
+ * zero if the buffer holds only part of a packet.
+ */
+size_t read_panel_commands(
+	const void *p,
+	size_t n,
+	ProtocolVersion version,
+	std::vector<PanelCommand> &commands
+);
+
+enum TouchType : uint8_t {
+	TOUCH_HOVER = 0,
+	TOUCH_DOWN = 1,
+	TOUCH_HOLD = 2,
+	TOUCH_UP = 3,
+	TOUCH_SWIPE = 4
+};
+
+/**
+ * One panel's entry in a touch datagram. The datagram starts with a big
+ * endian panel count; each entry is the panel ID, a byte holding the
+ * touch type in its upper and the strength in its lower four bits, and
+ * the ID of the panel swiped from, or NO_PANEL.
+ */
+class TouchEvent {
 public:
-	Frame(uint8_t pr, uint8_t pg, uint8_t pb, uint8_t pt)
-	:
-		r(pr), g(pg), b(pb), t(pt)
+	static const uint16_t NO_PANEL = 0xffff;
+	static const size_t HEADER_SIZE = 2;
+	static const size_t ENTRY_SIZE = 5;
+	uint16_t panel_id;
+	TouchType type;
+	uint8_t strength;
+	uint16_t swiped_from;
+	/** The panel's position in the listener's panel IDs, or -1 if absent. */
+	int panel_index;
+	std::chrono::steady_clock::time_point received;
+	TouchEvent(
+		uint16_t ppanel_id = NO_PANEL,
+		TouchType ptype = TOUCH_DOWN,
+		uint8_t pstrength = 0,
+		uint16_t pswiped_from = NO_PANEL
+	) :
+		panel_id(ppanel_id),
+		type(ptype),
+		strength(pstrength),
+		swiped_from(pswiped_from),
+		panel_index(-1)
 	{}
-	virtual ~Frame() {}
-	void write(IPStream &stream) const {
-		stream.write(r);
-		stream.write(g);
-		stream.write(b);
-		stream.write(0); // White; ignored
-		stream.write(t);
-	}
 };
 
-class PanelCommand {
+/**
+ * Appends the events in one touch datagram, returning false if it is
+ * malformed.
+ */
+bool read_touch_events(const void *p, size_t n, std::vector<TouchEvent> &events);
+void write_touch_events(const std::vector<TouchEvent> &events, std::vector<uint8_t> &buf);
+
+/**
+ * Receives the touch datagrams which a controller sends to the port
+ * named when subscribing to events. Only reads when asked, so that it
+ * can be polled from the thread driving the output.
+ */
+class TouchListener {
 private:
-	uint8_t panel_id;
-	std::vector<Frame> frames;
+	int fd;
+	uint16_t port;
+	std::unordered_map<uint16_t, int> panel_indices;
+	std::vector<uint8_t> buf;
+	uint64_t datagrams;
+	uint64_t malformed;
 public:
-	PanelCommand(uint8_t ppanel_id) : panel_id(ppanel_id) {}
-	PanelCommand(uint8_t ppanel_id, const std::vector<Frame> &pframes) : panel_id(ppanel_id), frames(pframes) {}
-	virtual ~PanelCommand() {}
-	void write(IPStream &stream) const {
-		stream.write(panel_id);
-		assert(frames.size() < 256);
-		stream.write(static_cast<uint8_t>(frames.size()));
-		for (auto &f: frames) {
-			f.write(stream);
-		}
-	}
+	/** Binds to the given port on all interfaces, or any free port if zero. */
+	TouchListener(uint16_t pport = 0);
+	TouchListener(const TouchListener &) = delete;
+	TouchListener &operator=(const TouchListener &) = delete;
+	virtual ~TouchListener();
+	int get_fd() const { return fd; }
+	uint16_t get_port() const { return port; }
+	/** Sets the IDs, such as PanelPosition::id, which panel_index refers to. */
+	void set_panel_ids(const std::vector<int> &ids);
+	/**
+	 * Replaces events with those in every datagram queued, without
+	 * blocking, and returns how many there are.
+	 */
+	size_t receive(std::vector<TouchEvent> &events);
+	uint64_t get_datagrams() const { return datagrams; }
+	uint64_t get_malformed() const { return malformed; }
 };
 
-void write_panel_commands(IPStream &stream, const std::vector<PanelCommand> &commands);
+/**
+ * Writes only those panels whose colour differs from the one last sent
+ * to them. Every refresh_interval frames all panels are sent regardless,
+ * to repair panels which missed an update in a lost datagram.
+ * Commands with more than one frame are always sent. A panel's colour
+ * is remembered only once the write carrying it has succeeded, so that
+ * after a failed write it is sent again.
+ */
+class DeltaWriter {
+private:
+	IPStream &stream;
+	unsigned int refresh_interval;
+	unsigned int frames_since_refresh;
+	std::unordered_map<uint16_t, Frame> last_sent;
+	std::vector<PanelCommand> changed;
+public:
+	DeltaWriter(IPStream &pstream, unsigned int prefresh_interval = 60)
+	:
+		stream(pstream),
+		refresh_interval(prefresh_interval),
+		frames_since_refresh(prefresh_interval)
+	{}
+	virtual ~DeltaWriter() {}
+	void write_panel_commands(const std::vector<PanelCommand> &commands);
+	/**
+	 * Forces the next frame to be sent in full.
+	 */
+	void invalidate() { frames_since_refresh = refresh_interval; }
+};
 
 }
 
@@ -0,0 +1,97 @@
+#include <sstream>
+#include <unordered_set>
+
+#include "animation.h"
+
+namespace mynanoleaf {
+
+const AnimationTimeline::Limits AnimationTimeline::DEFAULT_LIMITS = {
+	16384, // max_anim_data_bytes
+	255 // max_frames_per_panel, as in a version 1 stream
+};
+
+void AnimationTimeline::add(const PanelCommand &command) {
+	std::vector<Frame> &frames = panels[command.get_panel_id()];
+	frames.insert(frames.end(), command.get_frames().begin(), command.get_frames().end());
+}
+
+std::vector<Frame> AnimationTimeline::merge_holds(const std::vector<Frame> &frames) {
+	std::vector<Frame> merged;
+	bool all_same = true;
+	for (auto &f: frames) {
+		all_same = all_same && f.same_colour(frames.front());
+		// A frame the same colour as the one before holds it; consecutive holds add up
+		if (
+			merged.size() >= 2 &&
+			f.same_colour(merged.back()) &&
+			merged[merged.size() - 2].same_colour(merged.back()) &&
+			merged.back().get_transition_time() + f.get_transition_time() <= UINT16_MAX
+		) {
+			const Frame &last = merged.back();
+			merged.back() = Frame(last.get_red(), last.get_green(), last.get_blue(), last.get_transition_time() + f.get_transition_time());
+		} else {
+			merged.push_back(f);
+		}
+	}
+	if (all_same && merged.size() > 1) {
+		// Holds one colour throughout, even across the loop
+		merged.erase(merged.begin() + 1, merged.end());
+	}
+	return merged;
+}
+
+std::string AnimationTimeline::compile(const PanelLayout &layout, const Limits &limits) const {
+	std::unordered_set<int> known;
+	for (auto &p: layout.layout.positions) {
+		known.insert(p.id);
+	}
+	std::ostringstream out;
+	out << panels.size();
+	for (auto &p: panels) {
+		if (!known.count(p.first)) {
+			std::ostringstream msg;
+			msg << "Panel " << p.first << " is not in the layout";
+			throw msg.str();
+		}
+		std::vector<Frame> frames = merge_holds(p.second);
+		if (frames.empty() || frames.size() > limits.max_frames_per_panel) {
+			std::ostringstream msg;
+			msg << "Panel " << p.first << " has " << frames.size() << " frames; between 1 and " << limits.max_frames_per_panel << " are allowed";
+			throw msg.str();
+		}
+		out << ' ' << p.first << ' ' << frames.size();
+		for (auto &f: frames) {
+			out <<
+				' ' << static_cast<unsigned int>(f.get_red()) <<
+				' ' << static_cast<unsigned int>(f.get_green()) <<
+				' ' << static_cast<unsigned int>(f.get_blue()) <<
+				" 0 " << f.get_transition_time();
+		}
+	}
+	std::string anim_data = out.str();
+	if (anim_data.size() > limits.max_anim_data_bytes) {
+		std::ostringstream msg;
+		msg << "animData is " << anim_data.size() << " bytes; the limit is " << limits.max_anim_data_bytes;
+		throw msg.str();
+	}
+	return anim_data;
+}
+
+json AnimationTimeline::make_effect(
+	const std::string &name,
+	const PanelLayout &layout,
+	bool save,
+	bool loop,
+	const Limits &limits
+) const {
+	return json{
+		{"command", save ? "add" : "display"},
+		{"animName", name},
+		{"animType", "custom"},
+		{"animData", compile(layout, limits)},
+		{"loop", loop},
+		{"palette", json::array()}
+	};
+}
+
+}
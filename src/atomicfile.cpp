@@ -0,0 +1,47 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "atomicfile.h"
+
+namespace mynanoleaf {
+
+void replace_file(const std::string &path, const std::string &body, mode_t mode) {
+	std::string tmp_path = path + ".tmp";
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+	if (fd < 0) {
+		throw std::string("Cannot create ") + tmp_path + ": " + strerror(errno);
+	}
+	size_t off = 0;
+	while (off < body.size()) {
+		ssize_t n = write(fd, body.data() + off, body.size() - off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			int saved_errno = errno;
+			close(fd);
+			unlink(tmp_path.c_str());
+			throw std::string("Cannot write ") + tmp_path + ": " + strerror(saved_errno);
+		}
+		off += n;
+	}
+	int res = fsync(fd);
+	int saved_errno = errno;
+	if (close(fd) < 0 && res == 0) {
+		res = -1;
+		saved_errno = errno;
+	}
+	if (res == 0 && (res = rename(tmp_path.c_str(), path.c_str())) < 0) {
+		saved_errno = errno;
+	}
+	if (res < 0) {
+		unlink(tmp_path.c_str());
+		throw std::string("Cannot replace ") + path + ": " + strerror(saved_errno);
+	}
+}
+
+}
@@ -1,4 +1,4 @@
-#include <fstream>
+#include <sstream>
 #include <chrono>
 #include <thread>
 #include <algorithm>
@@ -10,24 +10,53 @@ namespace mynanoleaf {
 
 const char *Aurora::NANOLEAF_MDNS_SERVICE_TYPE = "_nanoleafapi._tcp";
 const char *Aurora::API_PREFIX = "/api/v1/";
+const uint16_t Aurora::EXT_CONTROL_V2_PORT = 60222;
+const std::chrono::milliseconds Aurora::DEFAULT_MAX_AGE(1000);
+const std::chrono::milliseconds Aurora::DEFAULT_PAIRING_RETRY(5000);
+std::mutex Aurora::instances_mutex;
 std::vector<Aurora *> Aurora::instances;
 
 struct callback_args {
 	const std::string *wanted_id;
+	DiscoveryCache *cache;
+	/** False when revalidating cached devices, which already exist. */
+	bool create;
 };
 
+static void found_device(struct callback_args *args, const AvahiAddress &address, const std::string &host, uint16_t port, const std::string &id) {
+	if (!args->cache) {
+		new Aurora(host, port, id);
+		return;
+	}
+	// Cache the numeric address, which needs no lookup on the next start
+	std::string where = MDNSResponder::connectable_address(address, host);
+	std::string key = id.empty() ? host : id;
+	bool changed = args->cache->update(key, where, port);
+	if (args->create) {
+		new Aurora(where, port, key);
+	} else if (changed) {
+		Aurora *aurora = Aurora::find(key);
+		if (aurora) {
+			std::cerr << "Device ID '" << key << "' has moved to " << where << ":" << port << std::endl;
+			aurora->set_address(where, port);
+		} else {
+			std::cerr << "Cached new device ID '" << key << "' for next time" << std::endl;
+		}
+	}
+}
+
 static bool aurora_callback(const AvahiAddress &address, const std::string &host, uint16_t port, const std::string &id, void *userdata) {
 	struct callback_args *args = static_cast<struct callback_args *>(userdata);
 	bool ret;
 	if (args->wanted_id == NULL || 0 == args->wanted_id->length()) {
 		// Attempt to connect to all discovered devices
 		std::cerr << "Discovered device ID '" << id << "'" << std::endl;
-		new Aurora(host, port);
+		found_device(args, address, host, port, id);
 		ret = true; // Continue enumeration
 	} else if (id == *(args->wanted_id)) {
 		// Found the sole device ID we're after
 		std::cerr << "Discovered configured device ID '" << id << "'" << std::endl;
-		new Aurora(host, port);
+		found_device(args, address, host, port, id);
 		ret = false; // Stop enumeration
 	} else {
 		// Not the sole device ID we're after
@@ -41,21 +70,63 @@ void Aurora::discover(const std::string *wanted_id) {
 	MDNSResponder mdns;
 	struct callback_args args;
 	args.wanted_id = wanted_id;
+	args.cache = NULL;
+	args.create = true;
 	mdns.discover(NANOLEAF_MDNS_SERVICE_TYPE, aurora_callback, &args);
 }
 
-void Aurora::read_token_file() {
-	std::ifstream fs;
-	fs.open(TOKEN_FILENAME);
-	fs >> token;
-	fs.close();
+void Aurora::discover(const std::string *wanted_id, DiscoveryCache &cache) {
+	std::string wanted = wanted_id ? *wanted_id : "";
+	unsigned int cached = 0;
+	for (auto &entry: cache.get_entries()) {
+		if (wanted.empty() || entry.id == wanted) {
+			std::cerr << "Using cached device ID '" << entry.id << "' at " << entry.address << ":" << entry.port << std::endl;
+			new Aurora(entry.address, entry.port, entry.id);
+			cached++;
+		}
+	}
+	struct callback_args args;
+	args.wanted_id = wanted_id;
+	args.cache = &cache;
+	args.create = true;
+	if (!cached) {
+		// Nothing to start with, so wait for the browse
+		MDNSResponder mdns;
+		mdns.discover(NANOLEAF_MDNS_SERVICE_TYPE, aurora_callback, &args);
+		return;
+	}
+	cache.revalidate([wanted, &cache]() {
+		struct callback_args args;
+		args.wanted_id = &wanted;
+		args.cache = &cache;
+		args.create = false;
+		MDNSResponder mdns;
+		mdns.discover(NANOLEAF_MDNS_SERVICE_TYPE, aurora_callback, &args);
+	});
+}
+
+Aurora *Aurora::find(const std::string &credential_key) {
+	std::lock_guard<std::mutex> lock(instances_mutex);
+	for (Aurora *aurora: instances) {
+		if (aurora->credential_key == credential_key) {
+			return aurora;
+		}
+	}
+	return NULL;
 }
 
-void Aurora::write_token_file() {
-	std::ofstream fs;
-	fs.open(TOKEN_FILENAME);
-	fs << token;
-	fs.close();
+void Aurora::set_address(const std::string &hostname, uint16_t port) {
+	std::lock_guard<std::mutex> lock(address_mutex);
+	pending_hostname = hostname;
+	pending_port = port;
+	address_changed = true;
+}
+
+void Aurora::apply_address() {
+	std::lock_guard<std::mutex> lock(address_mutex);
+	curl.set_hostname(pending_hostname);
+	curl.set_port(pending_port);
+	address_changed = false;
 }
 
 size_t Aurora::accumulate_response(const char *ptr, size_t size, size_t nmemb, void *userdata) {
@@ -64,11 +135,6 @@ size_t Aurora::accumulate_response(const char *ptr, size_t size, size_t nmemb, v
 	return size * nmemb;
 }
 
-struct string_and_offset {
-	std::string str;
-	size_t off;
-};
-
 size_t Aurora::stream_request(char *ptr, size_t size, size_t nmemb, void *userdata) {
 	string_and_offset *request_body = static_cast<string_and_offset *>(userdata);
 	size_t n = std::min(size * nmemb, request_body->str.size() - request_body->off);
@@ -85,84 +151,157 @@ void Aurora::generate_token() {
 			std::cerr << "Authorisation successful" << std::endl;
 			json j = json::parse(response_body.str());
 			token = j["auth_token"];
-			write_token_file();
+			save_token();
+			return;
 		} catch (const std::string &errmsg) {
 			std::cerr << errmsg << std::endl;
 			std::cerr << "Authorisation failed; waiting before retry. Did you push and hold the controller button?" << std::endl;
-			using namespace std::chrono_literals;
-			std::this_thread::sleep_for(5s);
+			std::this_thread::sleep_for(DEFAULT_PAIRING_RETRY);
 		}
 	}
 }
 
 std::string Aurora::get_auth_token() {
 	if (0 == token.length()) {
-		read_token_file();
+		load_token();
 	}
 	if (0 == token.length()) {
 		generate_token();
 	}
-	if (0 != token.length()) {
-		write_token_file();
-	}
 	return token;
 }
 
-void Aurora::do_request(
-	const std::string &method,
-	const std::string &token,
-	const std::string &path,
-	const std::string *request_body,
-	std::ostringstream &response_body
-) {
-	std::ostringstream full_path;
+void Aurora::request_token(RequestEngine &engine, std::chrono::milliseconds timeout, completion_t done) {
+	curl.setopt(CURLOPT_TIMEOUT_MS, static_cast<long>(timeout.count()));
+	do_request(engine, "POST", "new", "/", NULL, [this, done](std::exception_ptr error) {
+		curl.setopt(CURLOPT_TIMEOUT_MS, 0L);
+		if (!error) {
+			try {
+				json j = json::parse(async_response.str());
+				token = j["auth_token"];
+				save_token();
+				std::cerr << "Authorisation successful" << std::endl;
+			} catch (...) {
+				error = std::current_exception();
+			}
+		}
+		done(error);
+	});
+}
+
+void Aurora::generate_token(RequestEngine &engine, completion_t done, std::chrono::milliseconds retry_interval) {
+	request_token(engine, std::chrono::milliseconds(0), [this, &engine, done, retry_interval](std::exception_ptr error) {
+		if (!error) {
+			done(error);
+			return;
+		}
+		try {
+			std::rethrow_exception(error);
+		} catch (const std::string &errmsg) {
+			std::cerr << errmsg << std::endl;
+			std::cerr << "Authorisation failed; waiting before retry. Did you push and hold the controller button?" << std::endl;
+		} catch (char const * const errmsg) {
+			// From curl, as when the controller is still starting up
+			std::cerr << errmsg << std::endl;
+			std::cerr << "Cannot reach the controller; waiting before retry" << std::endl;
+		} catch (...) {
+			done(std::current_exception());
+			return;
+		}
+		engine.add_timer(retry_interval, [this, &engine, done, retry_interval]() {
+			generate_token(engine, done, retry_interval);
+		});
+	});
+}
+
+bool Aurora::has_auth_token() {
 	if (0 == token.length()) {
-		throw std::string("No auth token");
+		load_token();
+	}
+	return 0 != token.length();
+}
+
+void Aurora::with_token(RequestEngine &engine, std::function<void()> fn, completion_t done) {
+	if (has_auth_token()) {
+		fn();
+		return;
+	}
+	generate_token(engine, [fn, done](std::exception_ptr error) {
+		if (error) {
+			done(error);
+		} else {
+			fn();
+		}
+	});
+}
+
+void Aurora::set_method(const std::string &method) {
+	if (method == current_method) {
+		return;
 	}
-	full_path << API_PREFIX << token << path;
-	curl.set_path(full_path.str());
-	string_and_offset so;
-	// Zap custom headers
-	curl.setopt(CURLOPT_HTTPHEADER, NULL);
-	struct curl_slist *headers = NULL;
-	std::ostringstream content_length;
 	if (method == "GET") {
+		curl.setopt(CURLOPT_HTTPHEADER, static_cast<struct curl_slist *>(NULL));
 		curl.setopt(CURLOPT_HTTPGET, 1L);
-		// Request body ignored
 	} else if (method == "POST") {
-		curl.setopt(CURLOPT_POSTFIELDSIZE, (NULL == request_body) ? 0L : request_body->size());
-		curl.setopt(CURLOPT_POSTFIELDS, (NULL == request_body) ? "" : *request_body);
+		curl.setopt(CURLOPT_HTTPHEADER, static_cast<struct curl_slist *>(NULL));
+		curl.setopt(CURLOPT_UPLOAD, 0L);
+		curl.setopt(CURLOPT_POST, 1L);
 	} else if (method == "PUT") {
+		curl.setopt(CURLOPT_HTTPHEADER, put_headers);
 		curl.setopt(CURLOPT_UPLOAD, 1L);
-		so.off = 0;
-		so.str = (NULL == request_body) ? "" : *request_body;
-		curl.setopt(CURLOPT_READDATA, &so);
-		curl.setopt(CURLOPT_READFUNCTION, stream_request);
-		// Prevent use of HTTP chunked transfer encoding
-		content_length << "Content-Length: " << ((NULL == request_body) ? 0 : request_body->size());
-		headers = curl_slist_append(headers, content_length.str().c_str());
-		headers = curl_slist_append(headers, "Transfer-Encoding: identity");
-		headers = curl_slist_append(headers, "Expect:");
 	} else {
 		std::ostringstream msg;
 		msg << "Unrecognised HTTP method '" << method << "'";
 		throw msg.str();
 	}
-	response_body.clear();
-	if (headers) {
-		curl.setopt(CURLOPT_HTTPHEADER, headers);
+	current_method = method;
+}
+
+void Aurora::prepare_request(
+	const std::string &method,
+	const std::string &token,
+	const std::string &path,
+	const std::string *request_body,
+	std::ostringstream &response_body
+) {
+	if (0 == token.length()) {
+		throw std::string("No auth token");
 	}
-	curl.setopt(CURLOPT_WRITEDATA, &response_body);
+	if (address_changed) {
+		apply_address();
+	}
+	if (token != api_base_token) {
+		api_base_token = token;
+		api_base.assign(API_PREFIX).append(token);
+	}
+	request_path.assign(api_base).append(path);
+	curl.set_path(request_path);
+	set_method(method);
+	// Keep a copy of the body, which has to outlive an asynchronous request
+	upload.off = 0;
+	upload.str = (NULL == request_body) ? "" : *request_body;
+	if (method == "POST") {
+		curl.setopt(CURLOPT_POSTFIELDSIZE, static_cast<long>(upload.str.size()));
+		curl.setopt(CURLOPT_POSTFIELDS, upload.str.c_str());
+	} else if (method == "PUT") {
+		curl.setopt(CURLOPT_READDATA, &upload);
+		// A known size prevents use of HTTP chunked transfer encoding
+		curl.setopt(CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(upload.str.size()));
+	}
+	response_body.str("");
+	response_body.clear();
 	curl.setopt(CURLOPT_WRITEFUNCTION, accumulate_response);
-	curl.setopt(CURLOPT_VERBOSE, 1L);
+	curl.setopt(CURLOPT_WRITEDATA, &response_body);
 #ifndef NDEBUG
-	std::cerr << "Request: " << method << " " << full_path.str() << std::endl;
-	if (request_body && request_body->size()) {
-		std::cerr << "Request body:" << std::endl << *request_body << std::endl;
+	std::cerr << "Request: " << method << " " << request_path << std::endl;
+	if (upload.str.size()) {
+		std::cerr << "Request body:" << std::endl << upload.str << std::endl;
 	}
 #endif /* ndef NDEBUG */
-	curl.perform();
-	if (200 == curl.get_status()) {
+}
+
+void Aurora::check_response(const std::ostringstream &response_body) {
+	if (200 == curl.get_status() || 204 == curl.get_status()) {
 #ifndef NDEBUG
 		std::cerr << "Successful response: " << response_body.str() << std::endl;
 #endif /* ndef NDEBUG */
@@ -179,21 +318,405 @@ void Aurora::do_request(
 	}
 }
 
-IPStream &Aurora::external_control() {
-	std::string ipaddr;
-	uint16_t port;
-	std::string proto;
+/**
+ * Called when a transfer into a parser was aborted. A parse error is
+ * reported rather than the abort, unless the request failed, in which
+ * case the body was most likely not JSON and the status says more.
+ */
+void Aurora::rethrow_parse_error(JsonPushParser &parser) {
+	unsigned int status = curl.get_response_code();
+	if (status && 200 != status && 204 != status) {
+		std::ostringstream msg;
+		msg << "Unexpected HTTP status: " << status << std::endl;
+		throw msg.str();
+	}
+	parser.rethrow_error();
+}
+
+void Aurora::do_request(
+	const std::string &method,
+	const std::string &token,
+	const std::string &path,
+	const std::string *request_body,
+	std::ostringstream &response_body
+) {
+	prepare_request(method, token, path, request_body, response_body);
+	curl.perform();
+	check_response(response_body);
+}
+
+void Aurora::use_parser(JsonPushParser &parser) {
+	curl.setopt(CURLOPT_WRITEFUNCTION, JsonPushParser::write_callback);
+	curl.setopt(CURLOPT_WRITEDATA, &parser);
+}
+
+void Aurora::do_request(
+	const std::string &method,
+	const std::string &token,
+	const std::string &path,
+	const std::string *request_body,
+	JsonPushParser &parser
+) {
+	std::ostringstream response_body;
+	prepare_request(method, token, path, request_body, response_body);
+	use_parser(parser);
+	try {
+		curl.perform();
+	} catch (...) {
+		rethrow_parse_error(parser);
+		throw;
+	}
+	check_response(response_body);
+	parser.finish();
+}
+
+void Aurora::do_request(
+	RequestEngine &engine,
+	const std::string &method,
+	const std::string &token,
+	const std::string &path,
+	const std::string *request_body,
+	completion_t done
+) {
+	try {
+		prepare_request(method, token, path, request_body, async_response);
+		curl.prepare();
+		engine.submit(curl, [this, done](CURLcode res) {
+			try {
+				curl.finish(res);
+				check_response(async_response);
+			} catch (...) {
+				done(std::current_exception());
+				return;
+			}
+			done(nullptr);
+		});
+	} catch (...) {
+		done(std::current_exception());
+	}
+}
+
+void Aurora::set_info() {
+	std::lock_guard<std::mutex> lock(info_mutex);
+	std::swap(all_info, parsed_info);
+	for (int field = 0; field < INFO_FIELD_COUNT; field++) {
+		mark_fresh(static_cast<InfoField>(field));
+	}
+	std::cerr << "Panel count: " << all_info.panel_layout.layout.positions.size() << std::endl;
+}
+
+void Aurora::get_info() {
+	info_parser.begin(parsed_info);
+	do_request("GET", get_auth_token(), "/", NULL, info_parser);
+	set_info();
+}
+
+void Aurora::get_info(RequestEngine &engine, completion_t done) {
+	with_token(engine, [this, &engine, done]() {
+		try {
+			info_parser.begin(parsed_info);
+			prepare_request("GET", token, "/", NULL, async_response);
+			use_parser(info_parser);
+			curl.prepare();
+			engine.submit(curl, [this, done](CURLcode res) {
+				try {
+					if (res != CURLE_OK) {
+						rethrow_parse_error(info_parser);
+					}
+					curl.finish(res);
+					check_response(async_response);
+					info_parser.finish();
+					set_info();
+				} catch (...) {
+					done(std::current_exception());
+					return;
+				}
+				done(nullptr);
+			});
+		} catch (...) {
+			done(std::current_exception());
+		}
+	}, done);
+}
+
+struct info_endpoint {
+	const char *path;
+	/** Returns false if the whole document needs fetching instead. */
+	bool (*apply)(const json &j, AuroraJson &aj);
+};
+
+static const info_endpoint info_endpoints[INFO_FIELD_COUNT] = {
+	{"/state/on", [](const json &j, AuroraJson &aj) {
+		aj.state.on = j.at("value").get<bool>();
+		return true;
+	}},
+	{"/state/brightness", [](const json &j, AuroraJson &aj) {
+		aj.state.brightness = j.get<ClampedValue>();
+		return true;
+	}},
+	{"/state/hue", [](const json &j, AuroraJson &aj) {
+		aj.state.hue = j.get<ClampedValue>();
+		return true;
+	}},
+	{"/state/sat", [](const json &j, AuroraJson &aj) {
+		aj.state.sat = j.get<ClampedValue>();
+		return true;
+	}},
+	{"/state/ct", [](const json &j, AuroraJson &aj) {
+		aj.state.ct = j.get<ClampedValue>();
+		return true;
+	}},
+	{"/state/colorMode", [](const json &j, AuroraJson &aj) {
+		aj.state.color_mode = j.get<std::string>();
+		return true;
+	}},
+	{"/effects/select", [](const json &j, AuroraJson &aj) {
+		aj.effects.current = j.get<std::string>();
+		return true;
+	}},
+	{"/effects/effectsList", [](const json &j, AuroraJson &aj) {
+		aj.effects.available = j.get<std::vector<std::string> >();
+		return true;
+	}},
+	{"/panelLayout", [](const json &j, AuroraJson &aj) {
+		PanelLayout pl = j.get<PanelLayout>();
+		if (pl.layout.positions.size() != aj.panel_layout.layout.positions.size()) {
+			// Panels were added or removed; anything else may have changed too
+			return false;
+		}
+		aj.panel_layout = pl;
+		return true;
+	}}
+};
+
+bool Aurora::is_stale(InfoField field) const {
+	return
+		fetched[field] == std::chrono::steady_clock::time_point() ||
+		std::chrono::steady_clock::now() - fetched[field] > max_age;
+}
+
+void Aurora::mark_fresh(InfoField field) {
+	fetched[field] = std::chrono::steady_clock::now();
+}
+
+void Aurora::invalidate() {
+	std::lock_guard<std::mutex> lock(info_mutex);
+	for (int field = 0; field < INFO_FIELD_COUNT; field++) {
+		mark_stale(static_cast<InfoField>(field));
+	}
+}
+
+bool Aurora::apply_field(InfoField field, const std::string &response_body) {
+	json j = json::parse(response_body);
+	std::lock_guard<std::mutex> lock(info_mutex);
+	if (!info_endpoints[field].apply(j, all_info)) {
+		return false;
+	}
+	mark_fresh(field);
+	return true;
+}
+
+/**
+ * Only a full fetch sets the fields with no sub-endpoint of their own,
+ * so until one has succeeded every refresh is a full one.
+ */
+static bool have_full_info(const std::chrono::steady_clock::time_point *fetched) {
+	return std::any_of(fetched, fetched + INFO_FIELD_COUNT, [](const std::chrono::steady_clock::time_point &t) {
+		return t != std::chrono::steady_clock::time_point();
+	});
+}
+
+bool Aurora::have_info() const {
+	std::lock_guard<std::mutex> lock(info_mutex);
+	return have_full_info(fetched);
+}
+
+void Aurora::refresh(InfoField field) {
+	if (!have_info()) {
+		get_info();
+		return;
+	}
+	std::ostringstream response_body;
+	do_request("GET", get_auth_token(), info_endpoints[field].path, NULL, response_body);
+	if (!apply_field(field, response_body.str())) {
+		get_info();
+	}
+}
+
+void Aurora::refresh(RequestEngine &engine, InfoField field, completion_t done) {
+	if (!have_info()) {
+		get_info(engine, done);
+		return;
+	}
+	with_token(engine, [this, &engine, field, done]() {
+		do_request(engine, "GET", token, info_endpoints[field].path, NULL, [this, &engine, field, done](std::exception_ptr error) {
+			if (!error) {
+				try {
+					if (!apply_field(field, async_response.str())) {
+						get_info(engine, done);
+						return;
+					}
+				} catch (...) {
+					error = std::current_exception();
+				}
+			}
+			done(error);
+		});
+	}, done);
+}
+
+static const struct clamped_state_field {
+	const char *key;
+	InfoField field;
+	StateAttribute attr;
+	ClampedValue State::*value;
+} clamped_state_fields[] = {
+	{"brightness", INFO_BRIGHTNESS, STATE_BRIGHTNESS, &State::brightness},
+	{"hue", INFO_HUE, STATE_HUE, &State::hue},
+	{"sat", INFO_SAT, STATE_SAT, &State::sat},
+	{"ct", INFO_CT, STATE_CT, &State::ct}
+};
+
+void Aurora::put_state(const json &changes) {
+	std::string request_body = changes.dump();
+	std::ostringstream response_body;
+	do_request("PUT", get_auth_token(), "/state", &request_body, response_body);
+	std::lock_guard<std::mutex> lock(info_mutex);
+	if (!have_full_info(fetched)) {
+		// Nothing cached to update
+		return;
+	}
+	if (changes.contains("on")) {
+		all_info.state.on = changes["on"].at("value").get<bool>();
+		mark_fresh(INFO_ON);
+	}
+	for (auto &c: clamped_state_fields) {
+		if (changes.contains(c.key)) {
+			(all_info.state.*c.value).value = changes[c.key].at("value").get<int>();
+			mark_fresh(c.field);
+			if (c.field != INFO_BRIGHTNESS) {
+				// The controller switches to a solid colour
+				mark_stale(INFO_COLOR_MODE);
+				mark_stale(INFO_CURRENT_EFFECT);
+			}
+		}
+	}
+}
+
+void Aurora::subscribe(event_listener_t listener, uint16_t ptouch_events_port) {
+	if (listener) {
+		std::lock_guard<std::mutex> lock(listener_mutex);
+		listeners.push_back(listener);
+	}
+	if (events && ptouch_events_port && ptouch_events_port != touch_events_port) {
+		events.reset();
+	}
+	if (!events) {
+		if (ptouch_events_port) {
+			touch_events_port = ptouch_events_port;
+		}
+		std::string path(API_PREFIX);
+		path.append(get_auth_token()).append("/events?id=1,2,3,4");
+		events.reset(new EventSubscription(
+			curl.get_hostname(),
+			curl.get_port(),
+			path,
+			[this](const AuroraEvent &event) { handle_event(event); },
+			touch_events_port
+		));
+	}
+}
+
+void Aurora::unsubscribe() {
+	// Stops the event thread before the listeners go
+	events.reset();
+	std::lock_guard<std::mutex> lock(listener_mutex);
+	listeners.clear();
+}
+
+void Aurora::handle_event(const AuroraEvent &event) {
+	{
+		std::lock_guard<std::mutex> lock(info_mutex);
+		if (have_full_info(fetched)) {
+			switch (event.type) {
+			case EVENT_STATE:
+				if (event.attr == STATE_ON) {
+					all_info.state.on = event.value.get<bool>();
+					mark_fresh(INFO_ON);
+				} else if (event.attr == STATE_COLOR_MODE) {
+					all_info.state.color_mode = event.value.get<std::string>();
+					mark_fresh(INFO_COLOR_MODE);
+				}
+				for (auto &c: clamped_state_fields) {
+					if (event.attr == c.attr) {
+						(all_info.state.*c.value).value = event.value.get<int>();
+						mark_fresh(c.field);
+					}
+				}
+				break;
+			case EVENT_LAYOUT:
+				mark_stale(INFO_PANEL_LAYOUT);
+				break;
+			case EVENT_EFFECTS:
+				if (event.attr == EFFECTS_SELECT) {
+					all_info.effects.current = event.value.get<std::string>();
+					mark_fresh(INFO_CURRENT_EFFECT);
+				} else {
+					mark_stale(INFO_EFFECTS_LIST);
+				}
+				break;
+			case EVENT_TOUCH:
+				break;
+			}
+		}
+	}
+	std::lock_guard<std::mutex> lock(listener_mutex);
+	for (auto &listener: listeners) {
+		listener(event);
+	}
+}
+
+std::string Aurora::make_external_control_request(ProtocolVersion version) {
 	json request = json{
 		{"write",
 			{
 				{"command", "display"},
-				// {"version", "1.0"},
+				{"extControlVersion", (version == PROTOCOL_V2) ? "v2" : "v1"},
 				{"animType", "extControl"}
 				// {"loop", "no"}
 			}
 		}
 	};
-	std::string request_body = request.dump();
+	return request.dump();
+}
+
+IPStream *Aurora::open_stream(ProtocolVersion version, const std::string &response_body) {
+	std::string ipaddr;
+	uint16_t port;
+	std::string proto;
+	json resp;
+	if (response_body.size()) {
+		resp = json::parse(response_body);
+	}
+	if (resp.count("streamControlIpAddr")) {
+		// Only version 1 says where to stream, so that is what was granted, whatever was asked
+		ipaddr = resp["streamControlIpAddr"];
+		port = resp["streamControlPort"];
+		proto = resp["streamControlProtocol"];
+		version = PROTOCOL_V1;
+	} else if (version == PROTOCOL_V2) {
+		// Version 2 replies with no content; frames go to a fixed UDP port on the controller itself.
+		ipaddr = curl.get_primary_ip();
+		port = EXT_CONTROL_V2_PORT;
+		proto = "udp";
+	} else {
+		throw std::string("No stream control address in extControl response");
+	}
+	return IPStream::create(proto, ipaddr, port, version);
+}
+
+IPStream &Aurora::external_control(ProtocolVersion version) {
+	std::string request_body = make_external_control_request(version);
 	std::ostringstream response_body;
 	do_request(
 		"PUT",
@@ -202,12 +725,143 @@ IPStream &Aurora::external_control() {
 		&request_body,
 		response_body
 	);
-	json resp = json::parse(response_body.str());
-	ipaddr = resp["streamControlIpAddr"];
-	port = resp["streamControlPort"];
-	proto = resp["streamControlProtocol"];
-	IPStream *s = IPStream::create(proto, ipaddr, port);
-	return *s;
+	return *open_stream(version, response_body.str());
+}
+
+IPStream &Aurora::external_control() {
+	try {
+		return external_control(PROTOCOL_V2);
+	} catch (const std::string &errmsg) {
+		std::cerr << "extControl v2 unavailable (" << errmsg << "); falling back to v1" << std::endl;
+	} catch (char const * const errmsg) {
+		std::cerr << "extControl v2 unavailable (" << errmsg << "); falling back to v1" << std::endl;
+	}
+	return external_control(PROTOCOL_V1);
+}
+
+void Aurora::external_control(RequestEngine &engine, ProtocolVersion version, stream_completion_t done) {
+	with_token(engine, [this, &engine, version, done]() {
+		std::string request_body = make_external_control_request(version);
+		do_request(engine, "PUT", token, "/effects", &request_body, [this, version, done](std::exception_ptr error) {
+			IPStream *s = NULL;
+			if (!error) {
+				try {
+					s = open_stream(version, async_response.str());
+				} catch (...) {
+					error = std::current_exception();
+				}
+			}
+			done(s, error);
+		});
+	}, [done](std::exception_ptr error) {
+		done(NULL, error);
+	});
+}
+
+void Aurora::external_control(RequestEngine &engine, stream_completion_t done) {
+	external_control(engine, PROTOCOL_V2, [this, &engine, done](IPStream *s, std::exception_ptr error) {
+		if (!error) {
+			done(s, error);
+			return;
+		}
+		try {
+			std::rethrow_exception(error);
+		} catch (const std::string &errmsg) {
+			std::cerr << "extControl v2 unavailable (" << errmsg << "); falling back to v1" << std::endl;
+		} catch (char const * const errmsg) {
+			std::cerr << "extControl v2 unavailable (" << errmsg << "); falling back to v1" << std::endl;
+		} catch (...) {
+			done(NULL, std::current_exception());
+			return;
+		}
+		external_control(engine, PROTOCOL_V1, done);
+	});
+}
+
+void Aurora::write_effect(const json &command) {
+	std::string request_body = json{{"write", command}}.dump();
+	std::ostringstream response_body;
+	do_request("PUT", get_auth_token(), "/effects", &request_body, response_body);
+	// The current effect changes, and "add" also changes the list
+	invalidate(INFO_CURRENT_EFFECT);
+	invalidate(INFO_EFFECTS_LIST);
+}
+
+void Aurora::write_effect(RequestEngine &engine, const json &command, completion_t done) {
+	std::string request_body = json{{"write", command}}.dump();
+	with_token(engine, [this, &engine, request_body, done]() {
+		do_request(engine, "PUT", token, "/effects", &request_body, [this, done](std::exception_ptr error) {
+			invalidate(INFO_CURRENT_EFFECT);
+			invalidate(INFO_EFFECTS_LIST);
+			done(error);
+		});
+	}, done);
+}
+
+static Aurora::completion_t fulfil(std::shared_ptr<std::promise<void> > promise) {
+	return [promise](std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+		} else {
+			promise->set_value();
+		}
+	};
+}
+
+static Aurora::stream_completion_t fulfil(std::shared_ptr<std::promise<IPStream *> > promise) {
+	return [promise](IPStream *s, std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+		} else {
+			promise->set_value(s);
+		}
+	};
+}
+
+std::future<void> Aurora::get_info_async(RequestEngine &engine) {
+	auto promise = std::make_shared<std::promise<void> >();
+	get_info(engine, fulfil(promise));
+	return promise->get_future();
+}
+
+std::future<void> Aurora::refresh_async(RequestEngine &engine, InfoField field) {
+	auto promise = std::make_shared<std::promise<void> >();
+	refresh(engine, field, fulfil(promise));
+	return promise->get_future();
+}
+
+std::future<IPStream *> Aurora::external_control_async(RequestEngine &engine, ProtocolVersion version) {
+	auto promise = std::make_shared<std::promise<IPStream *> >();
+	external_control(engine, version, fulfil(promise));
+	return promise->get_future();
+}
+
+std::future<IPStream *> Aurora::external_control_async(RequestEngine &engine) {
+	auto promise = std::make_shared<std::promise<IPStream *> >();
+	external_control(engine, fulfil(promise));
+	return promise->get_future();
+}
+
+std::future<std::string> Aurora::get_auth_token_async(RequestEngine &engine) {
+	auto promise = std::make_shared<std::promise<std::string> >();
+	with_token(engine, [this, promise]() {
+		promise->set_value(token);
+	}, [promise](std::exception_ptr error) {
+		promise->set_exception(error);
+	});
+	return promise->get_future();
+}
+
+std::future<std::string> Aurora::generate_token_async(RequestEngine &engine, std::chrono::milliseconds retry_interval) {
+	auto promise = std::make_shared<std::promise<std::string> >();
+	generate_token(engine, [this, promise](std::exception_ptr error) {
+		if (error) {
+			promise->set_exception(error);
+		} else {
+			promise->set_value(token);
+		}
+	}, retry_interval);
+	return promise->get_future();
 }
 
 void to_json(json &j, const ClampedValue &cv) {
@@ -284,6 +938,7 @@ void to_json(json &j, const State &s) {
 			"value", s.on
 		}},
 		{"brightness", s.brightness},
+		{"hue", s.hue},
 		{"sat", s.sat},
 		{"ct", s.ct},
 		{"colorMode", s.color_mode}
@@ -293,6 +948,7 @@ void to_json(json &j, const State &s) {
 void from_json(const json &j, State &s) {
 	s.on = j.at("on").at("value").get<bool>();
 	s.brightness = j.at("brightness").get<ClampedValue>();
+	s.hue = j.at("hue").get<ClampedValue>();
 	s.sat = j.at("sat").get<ClampedValue>();
 	s.ct = j.at("ct").get<ClampedValue>();
 	s.color_mode = j.at("colorMode").get<std::string>();
@@ -348,4 +1004,324 @@ void from_json(const json &j, AuroraJson &aj) {
 	aj.rhythm = j.at("rhythm").get<Rhythm>();
 }
 
+/** What from_json() requires of each object, by context. */
+const std::vector<AuroraInfoParser::Member> AuroraInfoParser::required_members[CTX_COUNT] = {
+	// CTX_IGNORE
+	{},
+	// CTX_ROOT
+	{
+		{"name", TYPE_STRING}, {"serialNo", TYPE_STRING}, {"manufacturer", TYPE_STRING},
+		{"firmwareVersion", TYPE_STRING}, {"model", TYPE_STRING}, {"state", TYPE_OBJECT},
+		{"effects", TYPE_OBJECT}, {"panelLayout", TYPE_OBJECT}, {"rhythm", TYPE_OBJECT}
+	},
+	// CTX_STATE
+	{
+		{"on", TYPE_OBJECT}, {"brightness", TYPE_OBJECT}, {"hue", TYPE_OBJECT},
+		{"sat", TYPE_OBJECT}, {"ct", TYPE_OBJECT}, {"colorMode", TYPE_STRING}
+	},
+	// CTX_ON
+	{{"value", TYPE_BOOL}},
+	// CTX_CLAMPED
+	{{"value", TYPE_INTEGER}, {"max", TYPE_INTEGER}, {"min", TYPE_INTEGER}},
+	// CTX_EFFECTS
+	{{"select", TYPE_STRING}, {"effectsList", TYPE_ARRAY}},
+	// CTX_EFFECTS_LIST
+	{},
+	// CTX_PANEL_LAYOUT
+	{{"layout", TYPE_OBJECT}, {"globalOrientation", TYPE_OBJECT}},
+	// CTX_LAYOUT
+	{{"numPanels", TYPE_INTEGER}, {"sideLength", TYPE_INTEGER}, {"positionData", TYPE_ARRAY}},
+	// CTX_POSITION_DATA
+	{},
+	// CTX_POSITION
+	{{"panelId", TYPE_INTEGER}, {"x", TYPE_INTEGER}, {"y", TYPE_INTEGER}, {"o", TYPE_INTEGER}},
+	// CTX_RHYTHM
+	{
+		{"rhythmConnected", TYPE_BOOL}, {"rhythmActive", TYPE_BOOL}, {"rhythmId", TYPE_INTEGER},
+		{"hardwareVersion", TYPE_STRING}, {"firmwareVersion", TYPE_STRING},
+		{"auxAvailable", TYPE_BOOL}, {"rhythmMode", TYPE_INTEGER}, {"rhythmPos", TYPE_OBJECT}
+	},
+	// CTX_POSITION_OF_RHYTHM
+	{{"x", TYPE_INTEGER}, {"y", TYPE_INTEGER}, {"o", TYPE_INTEGER}}
+};
+
+void AuroraInfoParser::check_member(ValueType type) {
+	if (stack.empty()) {
+		if (type != TYPE_OBJECT) {
+			throw std::string("Controller info is not an object");
+		}
+		return;
+	}
+	Frame &top = stack.back();
+	if (
+		(top.ctx == CTX_EFFECTS_LIST && type != TYPE_STRING) ||
+		(top.ctx == CTX_POSITION_DATA && type != TYPE_OBJECT)
+	) {
+		throw std::string("Unexpected element type in controller info");
+	}
+	const std::vector<Member> &members = required_members[top.ctx];
+	for (size_t i = 0; i < members.size(); i++) {
+		if (key == members[i].key) {
+			if (type != members[i].type) {
+				throw std::string("Unexpected type for '") + key + "' in controller info";
+			}
+			top.seen |= 1U << i;
+			return;
+		}
+	}
+}
+
+void AuroraInfoParser::begin(AuroraJson &target) {
+	reset();
+	info = &target;
+	stack.clear();
+	key.clear();
+	num_panels = -1;
+}
+
+void AuroraInfoParser::on_start_object() {
+	check_member(TYPE_OBJECT);
+	if (stack.empty()) {
+		push(CTX_ROOT, info);
+		return;
+	}
+	const Frame &top = stack.back();
+	switch (top.ctx) {
+	case CTX_ROOT:
+		if (key == "state") {
+			push(CTX_STATE, &info->state);
+		} else if (key == "effects") {
+			push(CTX_EFFECTS, &info->effects);
+		} else if (key == "panelLayout") {
+			push(CTX_PANEL_LAYOUT, &info->panel_layout);
+		} else if (key == "rhythm") {
+			push(CTX_RHYTHM, &info->rhythm);
+		} else {
+			push(CTX_IGNORE, NULL);
+		}
+		break;
+	case CTX_STATE: {
+		State *state = static_cast<State *>(top.target);
+		if (key == "on") {
+			push(CTX_ON, state);
+		} else if (key == "brightness") {
+			push(CTX_CLAMPED, &state->brightness);
+		} else if (key == "hue") {
+			push(CTX_CLAMPED, &state->hue);
+		} else if (key == "sat") {
+			push(CTX_CLAMPED, &state->sat);
+		} else if (key == "ct") {
+			push(CTX_CLAMPED, &state->ct);
+		} else {
+			push(CTX_IGNORE, NULL);
+		}
+		break;
+	}
+	case CTX_PANEL_LAYOUT: {
+		PanelLayout *pl = static_cast<PanelLayout *>(top.target);
+		if (key == "layout") {
+			num_panels = -1;
+			push(CTX_LAYOUT, &pl->layout);
+		} else if (key == "globalOrientation") {
+			push(CTX_CLAMPED, static_cast<ClampedValue *>(&pl->orientation));
+		} else {
+			push(CTX_IGNORE, NULL);
+		}
+		break;
+	}
+	case CTX_POSITION_DATA: {
+		Frame &array = stack.back();
+		std::vector<PanelPosition> *positions = static_cast<std::vector<PanelPosition> *>(array.target);
+		if (array.count == positions->size()) {
+			positions->emplace_back();
+		}
+		push(CTX_POSITION, &(*positions)[array.count++]);
+		break;
+	}
+	case CTX_RHYTHM:
+		if (key == "rhythmPos") {
+			push(CTX_POSITION_OF_RHYTHM, &static_cast<Rhythm *>(top.target)->pos);
+		} else {
+			push(CTX_IGNORE, NULL);
+		}
+		break;
+	default:
+		push(CTX_IGNORE, NULL);
+		break;
+	}
+}
+
+void AuroraInfoParser::on_end_object() {
+	Frame f = stack.back();
+	stack.pop_back();
+	const std::vector<Member> &members = required_members[f.ctx];
+	for (size_t i = 0; i < members.size(); i++) {
+		if (!(f.seen & (1U << i))) {
+			throw std::string("Missing '") + members[i].key + "' in controller info";
+		}
+	}
+	if (f.ctx == CTX_LAYOUT) {
+		Layout *l = static_cast<Layout *>(f.target);
+		// The controller is counted in numPanels, but does not have an explicit panelPosition.
+		if (num_panels != static_cast<long long>(l->positions.size() + 1)) {
+			std::ostringstream msg;
+			msg << "Got numPanels==" << num_panels << ", but " << l->positions.size() << " positionData elements";
+			throw msg.str();
+		}
+	}
+}
+
+void AuroraInfoParser::on_start_array() {
+	check_member(TYPE_ARRAY);
+	const Frame &top = stack.back();
+	// The arrays' existing elements are overwritten, and trimmed at the end
+	if (top.ctx == CTX_EFFECTS && key == "effectsList") {
+		push(CTX_EFFECTS_LIST, &static_cast<Effects *>(top.target)->available);
+	} else if (top.ctx == CTX_LAYOUT && key == "positionData") {
+		push(CTX_POSITION_DATA, &static_cast<Layout *>(top.target)->positions);
+	} else {
+		push(CTX_IGNORE, NULL);
+	}
+}
+
+void AuroraInfoParser::on_end_array() {
+	Frame f = stack.back();
+	stack.pop_back();
+	if (f.ctx == CTX_EFFECTS_LIST) {
+		static_cast<std::vector<std::string> *>(f.target)->resize(f.count);
+	} else if (f.ctx == CTX_POSITION_DATA) {
+		static_cast<std::vector<PanelPosition> *>(f.target)->resize(f.count);
+	}
+}
+
+void AuroraInfoParser::on_string(const std::string &value) {
+	check_member(TYPE_STRING);
+	const Frame &top = stack.back();
+	switch (top.ctx) {
+	case CTX_ROOT:
+		if (key == "name") {
+			info->name = value;
+		} else if (key == "serialNo") {
+			info->serial_number = value;
+		} else if (key == "manufacturer") {
+			info->manufacturer = value;
+		} else if (key == "firmwareVersion") {
+			info->firmware_version = value;
+		} else if (key == "model") {
+			info->model = value;
+		}
+		break;
+	case CTX_STATE:
+		if (key == "colorMode") {
+			static_cast<State *>(top.target)->color_mode = value;
+		}
+		break;
+	case CTX_EFFECTS:
+		if (key == "select") {
+			static_cast<Effects *>(top.target)->current = value;
+		}
+		break;
+	case CTX_EFFECTS_LIST: {
+		Frame &array = stack.back();
+		std::vector<std::string> *available = static_cast<std::vector<std::string> *>(array.target);
+		if (array.count == available->size()) {
+			available->push_back(value);
+		} else {
+			(*available)[array.count] = value;
+		}
+		array.count++;
+		break;
+	}
+	case CTX_RHYTHM: {
+		Rhythm *r = static_cast<Rhythm *>(top.target);
+		if (key == "hardwareVersion") {
+			r->hardware_version = value;
+		} else if (key == "firmwareVersion") {
+			r->firmware_version = value;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void AuroraInfoParser::on_integer(long long value) {
+	check_member(TYPE_INTEGER);
+	const Frame &top = stack.back();
+	int v = static_cast<int>(value);
+	switch (top.ctx) {
+	case CTX_CLAMPED: {
+		ClampedValue *cv = static_cast<ClampedValue *>(top.target);
+		if (key == "value") {
+			cv->value = v;
+		} else if (key == "max") {
+			cv->max = v;
+		} else if (key == "min") {
+			cv->min = v;
+		}
+		break;
+	}
+	case CTX_POSITION: {
+		PanelPosition *pp = static_cast<PanelPosition *>(top.target);
+		if (key == "panelId") {
+			pp->id = v;
+		} else if (key == "x") {
+			pp->x = v;
+		} else if (key == "y") {
+			pp->y = v;
+		} else if (key == "o") {
+			pp->o = v;
+		}
+		break;
+	}
+	case CTX_POSITION_OF_RHYTHM: {
+		Position *p = static_cast<Position *>(top.target);
+		if (key == "x") {
+			p->x = v;
+		} else if (key == "y") {
+			p->y = v;
+		} else if (key == "o") {
+			p->o = v;
+		}
+		break;
+	}
+	case CTX_LAYOUT:
+		if (key == "numPanels") {
+			num_panels = value;
+		} else if (key == "sideLength") {
+			static_cast<Layout *>(top.target)->side_length = v;
+		}
+		break;
+	case CTX_RHYTHM: {
+		Rhythm *r = static_cast<Rhythm *>(top.target);
+		if (key == "rhythmId") {
+			r->id = v;
+		} else if (key == "rhythmMode") {
+			r->mode = v;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void AuroraInfoParser::on_bool(bool value) {
+	check_member(TYPE_BOOL);
+	const Frame &top = stack.back();
+	if (top.ctx == CTX_ON && key == "value") {
+		static_cast<State *>(top.target)->on = value;
+	} else if (top.ctx == CTX_RHYTHM) {
+		Rhythm *r = static_cast<Rhythm *>(top.target);
+		if (key == "rhythmConnected") {
+			r->connected = value;
+		} else if (key == "rhythmActive") {
+			r->active = value;
+		} else if (key == "auxAvailable") {
+			r->aux = value;
+		}
+	}
+}
+
 }
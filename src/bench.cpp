@@ -0,0 +1,1048 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <iostream>
+#include <thread>
+
+#include "aurora.h"
+#include "credentials.h"
+#include "streaming.h"
+#include "colour.h"
+#include "mockcontroller.h"
+#include "requestengine.h"
+#include "statewriter.h"
+#include "pairing.h"
+#include "animation.h"
+#include "canvas.h"
+#include "registry.h"
+#include "discovery.h"
+#include "renderloop.h"
+#include "framequeue.h"
+
+namespace {
+
+using namespace mynanoleaf;
+
+/**
+ * The stream and per-byte encoding used before PacketEncoder existed,
+ * kept here so the two paths can be compared.
+ */
+class OStringStreamUDPStream : public UDPStream {
+private:
+	std::ostringstream buf;
+public:
+	OStringStreamUDPStream(
+		const std::string &ipaddr,
+		uint16_t port
+	) : UDPStream(ipaddr, port) {
+	}
+	virtual ~OStringStreamUDPStream() {}
+	virtual void write(const void *p, size_t n) {
+		buf.write(static_cast<const char *>(p), n);
+	}
+	virtual void flush() {
+		UDPStream::write(buf.str().c_str(), buf.str().size());
+		buf.str("");
+	}
+};
+
+void legacy_write_panel_commands(IPStream &stream, const std::vector<PanelCommand> &commands) {
+	stream.write(static_cast<uint8_t>(commands.size()));
+	for (auto &c: commands) {
+		c.write(stream);
+	}
+	stream.flush();
+}
+
+/**
+ * A bound UDP socket on the loopback interface which is never read;
+ * the kernel discards datagrams once its receive buffer is full.
+ */
+class UDPSink {
+private:
+	int fd;
+	uint16_t port;
+public:
+	UDPSink() {
+		fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (fd < 0) {
+			throw std::string(strerror(errno));
+		}
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = 0;
+		if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+			throw std::string(strerror(errno));
+		}
+		socklen_t len = sizeof(addr);
+		if (getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+			throw std::string(strerror(errno));
+		}
+		port = ntohs(addr.sin_port);
+	}
+	virtual ~UDPSink() {
+		close(fd);
+	}
+	uint16_t get_port() const { return port; }
+};
+
+std::vector<PanelCommand> make_commands(unsigned int panel_count) {
+	std::vector<PanelCommand> commands;
+	for (unsigned int i = 0; i < panel_count; i++) {
+		std::vector<Frame> frames;
+		frames.push_back(Frame(i, i * 3, i * 7, 1));
+		commands.push_back(PanelCommand(i, frames));
+	}
+	return commands;
+}
+class Options {
+public:
+	unsigned int iterations;
+	unsigned int repetitions;
+	std::string filter;
+	std::string info_path;
+	Options() : iterations(10000), repetitions(5), info_path("example-responses/controller-info.json") {}
+	bool wanted(const std::string &name) const {
+		return filter.empty() || name.find(filter) != std::string::npos;
+	}
+};
+
+/**
+ * Prints one JSON object per line, so that results can be collected and
+ * compared between releases.
+ */
+void emit(const std::string &name, json result) {
+	result["benchmark"] = name;
+	std::cout << result.dump() << std::endl;
+}
+
+/**
+ * Times repetitions batches of iterations calls, after one untimed batch
+ * to warm caches, and summarises the per-call times.
+ */
+template<typename F> json measure(const Options &opts, unsigned int iterations, F f) {
+	for (unsigned int i = 0; i < iterations; i++) {
+		f();
+	}
+	std::vector<double> ns_per_op;
+	for (unsigned int r = 0; r < opts.repetitions; r++) {
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < iterations; i++) {
+			f();
+		}
+		std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+		ns_per_op.push_back(elapsed.count() / iterations);
+	}
+	std::sort(ns_per_op.begin(), ns_per_op.end());
+	double median = ns_per_op[ns_per_op.size() / 2];
+	return json{
+		{"iterations", iterations},
+		{"repetitions", opts.repetitions},
+		{"ns_per_op_min", ns_per_op.front()},
+		{"ns_per_op_median", median},
+		{"ops_per_sec", 1e9 / median}
+	};
+}
+
+void bench_encode(const Options &opts, unsigned int panel_count) {
+	UDPSink sink;
+	const std::vector<PanelCommand> commands = make_commands(panel_count);
+	if (panel_count <= WireFormat<PROTOCOL_V1>::MAX_PANELS) {
+		OStringStreamUDPStream legacy("127.0.0.1", sink.get_port());
+		json r = measure(opts, opts.iterations, [&]() {
+			legacy_write_panel_commands(legacy, commands);
+		});
+		r["panels"] = panel_count;
+		r["protocol"] = "v1-legacy";
+		emit("write_panel_commands", r);
+		UDPStream packed("127.0.0.1", sink.get_port(), PROTOCOL_V1);
+		r = measure(opts, opts.iterations, [&]() {
+			write_panel_commands(packed, commands);
+		});
+		r["panels"] = panel_count;
+		r["protocol"] = "v1";
+		emit("write_panel_commands", r);
+	}
+	UDPStream packed_v2("127.0.0.1", sink.get_port(), PROTOCOL_V2);
+	json r = measure(opts, opts.iterations, [&]() {
+		write_panel_commands(packed_v2, commands);
+	});
+	r["panels"] = panel_count;
+	r["protocol"] = "v2";
+	emit("write_panel_commands", r);
+}
+
+/**
+ * Streams frames in which only changed_count of the panels change colour,
+ * in full and through a DeltaWriter, to show the bytes each sends.
+ */
+void bench_delta(const Options &opts, unsigned int panel_count, unsigned int changed_count) {
+	UDPSink sink;
+	std::vector<PanelCommand> commands = make_commands(panel_count);
+	unsigned int frame = 0;
+	auto next_frame = [&]() {
+		frame++;
+		for (unsigned int k = 0; k < changed_count; k++) {
+			unsigned int i = (frame * changed_count + k) % panel_count;
+			commands[i].assign(i, Frame(frame, i, 255 - frame, 1));
+		}
+	};
+	UDPStream full_stream("127.0.0.1", sink.get_port(), PROTOCOL_V2);
+	json r = measure(opts, opts.iterations, [&]() {
+		next_frame();
+		write_panel_commands(full_stream, commands);
+	});
+	uint64_t frames = static_cast<uint64_t>(opts.iterations) * (opts.repetitions + 1);
+	r["panels"] = panel_count;
+	r["changed"] = changed_count;
+	r["writer"] = "full";
+	r["bytes_per_frame"] = static_cast<double>(full_stream.get_bytes_written()) / frames;
+	emit("delta_writer", r);
+	UDPStream delta_stream("127.0.0.1", sink.get_port(), PROTOCOL_V2);
+	DeltaWriter delta(delta_stream);
+	r = measure(opts, opts.iterations, [&]() {
+		next_frame();
+		delta.write_panel_commands(commands);
+	});
+	r["panels"] = panel_count;
+	r["changed"] = changed_count;
+	r["writer"] = "delta";
+	r["bytes_per_frame"] = static_cast<double>(delta_stream.get_bytes_written()) / frames;
+	emit("delta_writer", r);
+}
+
+void bench_colour(const Options &opts, unsigned int panel_count) {
+	HSVBuffer in;
+	in.resize(panel_count);
+	for (unsigned int i = 0; i < panel_count; i++) {
+		in.h[i] = (i * 37) % 360;
+		in.s[i] = (i % 10) / 10.0f;
+		in.v[i] = (i % 7) / 7.0f;
+	}
+	// Out-of-range input must come out the same from every implementation
+	const float odd[] = { NAN, -NAN, INFINITY, -INFINITY, -1.0f, -360.0f, 1.5f, 720.0f, 1e30f };
+	const size_t odd_count = sizeof(odd) / sizeof(odd[0]);
+	for (unsigned int i = 0; i < panel_count && i < odd_count * odd_count; i++) {
+		float x = odd[i % odd_count], y = odd[i / odd_count];
+		switch (i % 3) {
+		case 0: in.h[i] = x; in.s[i] = y; break;
+		case 1: in.s[i] = x; in.v[i] = y; break;
+		default: in.v[i] = x; in.h[i] = y; break;
+		}
+	}
+	RGBBuffer out, expected;
+	ColourPipeline(ColourPipeline::SCALAR).convert(in, 0.8f, expected);
+	static const char *names[] = { "scalar", "sse4.1", "avx2" };
+	for (int impl = ColourPipeline::SCALAR; impl <= ColourPipeline::AVX2; impl++) {
+		if (!ColourPipeline::is_supported(static_cast<ColourPipeline::Implementation>(impl))) {
+			continue;
+		}
+		ColourPipeline pipeline(static_cast<ColourPipeline::Implementation>(impl));
+		pipeline.convert(in, 0.8f, out);
+		if (memcmp(out.r.data(), expected.r.data(), panel_count) ||
+				memcmp(out.g.data(), expected.g.data(), panel_count) ||
+				memcmp(out.b.data(), expected.b.data(), panel_count)) {
+			throw std::string(names[impl]) + " conversion differs from scalar";
+		}
+		json r = measure(opts, opts.iterations, [&]() {
+			pipeline.convert(in, 0.8f, out);
+		});
+		r["panels"] = panel_count;
+		r["implementation"] = names[impl];
+		emit("colour_convert", r);
+	}
+}
+
+std::string read_file(const std::string &path) {
+	std::ifstream fs(path);
+	if (!fs) {
+		throw std::string("Cannot open ") + path;
+	}
+	std::ostringstream ss;
+	ss << fs.rdbuf();
+	return ss.str();
+}
+
+void bench_from_json(const Options &opts) {
+	const std::string body = read_file(opts.info_path);
+	const json doc = json::parse(body);
+	AuroraJson aj;
+	json r = measure(opts, opts.iterations, [&]() {
+		aj = doc.get<AuroraJson>();
+	});
+	r["bytes"] = body.size();
+	emit("from_json", r);
+	r = measure(opts, opts.iterations, [&]() {
+		aj = json::parse(body).get<AuroraJson>();
+	});
+	r["bytes"] = body.size();
+	emit("parse_and_from_json", r);
+	// Fed in chunks, as curl delivers a response
+	AuroraInfoParser parser;
+	const size_t chunk = 1024;
+	r = measure(opts, opts.iterations, [&]() {
+		parser.begin(aj);
+		for (size_t off = 0; off < body.size(); off += chunk) {
+			parser.feed(body.data() + off, std::min(chunk, body.size() - off));
+		}
+		parser.finish();
+	});
+	r["bytes"] = body.size();
+	emit("push_parse", r);
+	if (json(aj) != json(doc.get<AuroraJson>())) {
+		throw std::string("Push parser and from_json disagree on ") + opts.info_path;
+	}
+	// Both must reject a document missing a member, or with one mistyped
+	json missing = doc, mistyped = doc;
+	missing["state"].erase("ct");
+	mistyped["state"]["hue"]["value"] = nullptr;
+	for (const json *bad: {&missing, &mistyped}) {
+		const std::string text = bad->dump();
+		parser.begin(aj);
+		bool rejected = false;
+		try {
+			parser.feed(text.data(), text.size());
+			parser.finish();
+		} catch (const std::string &errmsg) {
+			rejected = true;
+		}
+		if (!rejected) {
+			throw std::string("Push parser accepted an invalid controller info document");
+		}
+	}
+}
+
+/**
+ * The loopback benchmarks keep the mock's token in a store of their own
+ * in a scratch directory, rather than touching any real one.
+ */
+class ScratchCredentials {
+private:
+	std::string path;
+	std::string token;
+	std::unique_ptr<CredentialStore> store;
+public:
+	ScratchCredentials(const std::string &ptoken) : token(ptoken) {
+		char tmpl[] = "/tmp/nanoleaf_bench.XXXXXX";
+		if (!mkdtemp(tmpl)) {
+			throw std::string(strerror(errno));
+		}
+		path = tmpl;
+		store.reset(new CredentialStore(path + "/" + TOKEN_FILENAME));
+	}
+	virtual ~ScratchCredentials() {
+		unlink(store->get_path().c_str());
+		if (rmdir(path.c_str()) < 0) {
+			std::cerr << "Cannot remove " << path << ": " << strerror(errno) << std::endl;
+		}
+	}
+	/** With no token, the Aurora starts unpaired. */
+	void adopt(Aurora &aurora) {
+		if (!token.empty()) {
+			store->set(aurora.get_credential_key(), token);
+		}
+		aurora.set_credentials(*store);
+	}
+};
+
+void bench_get_info(const Options &opts) {
+	MockController mock(opts.info_path);
+	ScratchCredentials scratch(mock.get_token());
+	Aurora aurora("127.0.0.1", mock.get_http_port());
+	scratch.adopt(aurora);
+	json r = measure(opts, std::max(opts.iterations / 100, 10U), [&]() {
+		aurora.get_info();
+	});
+	emit("get_info", r);
+}
+
+/**
+ * Refreshes a single cached field from its sub-endpoint, for comparison
+ * with get_info.
+ */
+void bench_refresh(const Options &opts) {
+	MockController mock(opts.info_path);
+	ScratchCredentials scratch(mock.get_token());
+	Aurora aurora("127.0.0.1", mock.get_http_port());
+	scratch.adopt(aurora);
+	aurora.get_info();
+	json r = measure(opts, std::max(opts.iterations / 100, 10U), [&]() {
+		aurora.refresh(INFO_BRIGHTNESS);
+	});
+	r["field"] = "brightness";
+	emit("refresh", r);
+}
+
+/**
+ * Drags brightness through a burst of updates, as a slider would, and
+ * counts how many requests the writer actually sent.
+ */
+void bench_state_writer(const Options &opts) {
+	MockController mock(opts.info_path);
+	ScratchCredentials scratch(mock.get_token());
+	Aurora aurora("127.0.0.1", mock.get_http_port());
+	scratch.adopt(aurora);
+	const unsigned int updates = std::min(opts.iterations, 1000U);
+	StateWriter writer(aurora, std::chrono::milliseconds(20));
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < updates; i++) {
+		// One update every millisecond
+		std::this_thread::sleep_until(start + std::chrono::milliseconds(i));
+		writer.set_brightness(i % 101);
+	}
+	writer.commit();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	json r = {
+		{"updates", writer.get_changes()},
+		{"requests", writer.get_requests()},
+		{"final_brightness", mock.get_info()["state"]["brightness"]["value"]},
+		{"seconds", elapsed.count()}
+	};
+	emit("state_writer", r);
+}
+
+/**
+ * Times how long a touch takes to reach a listener through the /events
+ * stream, measured from when the mock controller sends it.
+ */
+void bench_events(const Options &opts) {
+	MockController mock(opts.info_path);
+	ScratchCredentials scratch(mock.get_token());
+	Aurora aurora("127.0.0.1", mock.get_http_port());
+	scratch.adopt(aurora);
+	aurora.get_info();
+	const unsigned int touches = std::min(opts.iterations, 1000U);
+	std::vector<std::chrono::steady_clock::time_point> sent(touches);
+	std::vector<double> latency_us;
+	std::mutex latency_mutex;
+	latency_us.reserve(touches);
+	aurora.subscribe([&](const AuroraEvent &event) {
+		if (event.type == EVENT_TOUCH && event.panel_id >= 0 && static_cast<unsigned int>(event.panel_id) < touches) {
+			std::lock_guard<std::mutex> lock(latency_mutex);
+			latency_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent[event.panel_id]).count());
+		}
+	});
+	// Let the subscription connect
+	while (aurora.get_subscription()->get_connects() == 0 || mock.get_requests_served() < 2) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	for (unsigned int i = 0; i < touches; i++) {
+		{
+			std::lock_guard<std::mutex> lock(latency_mutex);
+			sent[i] = std::chrono::steady_clock::now();
+		}
+		mock.push_event(EVENT_TOUCH, json::array({{{"panelId", i}, {"gesture", 0}}}));
+		std::this_thread::sleep_for(std::chrono::microseconds(500));
+	}
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	aurora.unsubscribe();
+	std::sort(latency_us.begin(), latency_us.end());
+	json r = {
+		{"events_sent", touches},
+		{"events_received", latency_us.size()}
+	};
+	if (latency_us.size()) {
+		r["latency_us_p50"] = latency_us[latency_us.size() / 2];
+		r["latency_us_p99"] = latency_us[latency_us.size() * 99 / 100];
+		r["latency_us_max"] = latency_us.back();
+	}
+	emit("events", r);
+}
+
+static json percentiles(std::vector<double> &v, const std::string &prefix) {
+	json r = json::object();
+	std::sort(v.begin(), v.end());
+	if (v.size()) {
+		r[prefix + "_p50"] = v[v.size() / 2];
+		r[prefix + "_p99"] = v[v.size() * 99 / 100];
+		r[prefix + "_max"] = v.back();
+	}
+	return r;
+}
+
+/**
+ * Sends touches to a render loop running at 60 fps, and times how long
+ * each takes to reach the touch handler, and then to be rendered in a
+ * frame. Each touch's panel ID is its sequence number.
+ */
+void bench_touch(const Options &opts) {
+	MockController mock(opts.info_path);
+	ScratchCredentials scratch(mock.get_token());
+	Aurora aurora("127.0.0.1", mock.get_http_port());
+	scratch.adopt(aurora);
+	aurora.get_info();
+	const unsigned int frame_rate = 60;
+	const unsigned int touches = std::min(opts.iterations / 100, 200U);
+	std::vector<std::chrono::steady_clock::time_point> sent(touches);
+	std::vector<double> handler_us, frame_us;
+	std::vector<unsigned int> unrendered;
+	std::mutex sent_mutex;
+	TouchListener touch;
+	aurora.subscribe(Aurora::event_listener_t(), touch.get_port());
+	while (!mock.push_touch(std::vector<TouchEvent>())) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	// Discard the empty datagram sent while waiting
+	std::vector<TouchEvent> discard;
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	touch.receive(discard);
+	IPStream *stream = &aurora.external_control(PROTOCOL_V2);
+	RenderLoop loop(*stream, frame_rate);
+	loop.set_touch_listener(&touch, [&](const std::vector<TouchEvent> &events) {
+		std::lock_guard<std::mutex> lock(sent_mutex);
+		for (auto &e: events) {
+			if (e.panel_id < touches) {
+				handler_us.push_back(std::chrono::duration<double, std::micro>(e.received - sent[e.panel_id]).count());
+				unrendered.push_back(e.panel_id);
+			}
+		}
+	});
+	std::thread toucher([&]() {
+		for (unsigned int i = 0; i < touches; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(7));
+			std::lock_guard<std::mutex> lock(sent_mutex);
+			sent[i] = std::chrono::steady_clock::now();
+			mock.push_touch(std::vector<TouchEvent>(1, TouchEvent(i)));
+		}
+	});
+	std::vector<PanelCommand> frame = make_commands(10);
+	unsigned int idle_ticks = 0;
+	loop.run([&](uint64_t, std::vector<PanelCommand> &commands) {
+		std::lock_guard<std::mutex> lock(sent_mutex);
+		auto now = std::chrono::steady_clock::now();
+		for (unsigned int seq: unrendered) {
+			frame_us.push_back(std::chrono::duration<double, std::micro>(now - sent[seq]).count());
+		}
+		unrendered.clear();
+		commands = frame;
+		idle_ticks = (frame_us.size() < touches) ? 0 : idle_ticks + 1;
+		return idle_ticks < 2;
+	});
+	toucher.join();
+	aurora.unsubscribe();
+	delete stream;
+	json r = {
+		{"frame_rate", frame_rate},
+		{"touches_sent", touches},
+		{"touches_received", loop.get_stats().touches_received}
+	};
+	r.update(percentiles(handler_us, "handler_us"));
+	r.update(percentiles(frame_us, "frame_us"));
+	emit("touch", r);
+}
+
+/**
+ * Fetches the state of several controllers at once through the request
+ * engine; ns_per_op is per round over all of them.
+ */
+void bench_get_info_concurrent(const Options &opts, unsigned int controller_count) {
+	std::vector<std::unique_ptr<MockController> > mocks;
+	std::vector<std::unique_ptr<Aurora> > auroras;
+	for (unsigned int i = 0; i < controller_count; i++) {
+		mocks.push_back(std::unique_ptr<MockController>(new MockController(opts.info_path)));
+	}
+	ScratchCredentials scratch(mocks[0]->get_token());
+	for (auto &mock: mocks) {
+		auroras.push_back(std::unique_ptr<Aurora>(new Aurora("127.0.0.1", mock->get_http_port())));
+		scratch.adopt(*auroras.back());
+	}
+	RequestEngine engine;
+	json r = measure(opts, std::max(opts.iterations / 100, 10U), [&]() {
+		for (auto &aurora: auroras) {
+			aurora->get_info(engine, [](std::exception_ptr error) {
+				if (error) {
+					std::rethrow_exception(error);
+				}
+			});
+		}
+		engine.run();
+	});
+	r["controllers"] = controller_count;
+	emit("get_info_concurrent", r);
+}
+
+/**
+ * Pairs with several controllers whose buttons are held one after
+ * another, and times how long each took to pair once its button was.
+ */
+void bench_pairing(const Options &opts, unsigned int controller_count) {
+	const std::chrono::milliseconds interval(20), stagger(100);
+	std::vector<std::unique_ptr<MockController> > mocks;
+	std::vector<std::unique_ptr<Aurora> > auroras;
+	ScratchCredentials scratch("");
+	for (unsigned int i = 0; i < controller_count; i++) {
+		mocks.push_back(std::unique_ptr<MockController>(new MockController(opts.info_path)));
+		mocks.back()->set_pairing_open(false);
+		// Keyed by ID, as after discovery, since the hostnames are all the same
+		std::ostringstream id;
+		id << "bench" << i;
+		auroras.push_back(std::unique_ptr<Aurora>(new Aurora("127.0.0.1", mocks.back()->get_http_port(), id.str())));
+		scratch.adopt(*auroras.back());
+	}
+	RequestEngine engine;
+	PairingManager pairing(engine, interval);
+	std::vector<std::chrono::steady_clock::time_point> opened(controller_count), paired(controller_count);
+	auto start = std::chrono::steady_clock::now();
+	std::thread presser([&]() {
+		for (unsigned int i = 0; i < controller_count; i++) {
+			std::this_thread::sleep_until(start + stagger * (i + 1));
+			opened[i] = std::chrono::steady_clock::now();
+			mocks[i]->set_pairing_open(true);
+		}
+	});
+	for (unsigned int i = 0; i < controller_count; i++) {
+		pairing.add(*auroras[i], [&paired, i](Aurora &, std::exception_ptr error) {
+			if (error) {
+				std::rethrow_exception(error);
+			}
+			paired[i] = std::chrono::steady_clock::now();
+		});
+	}
+	engine.run();
+	presser.join();
+	std::vector<double> lag_ms;
+	for (unsigned int i = 0; i < controller_count; i++) {
+		lag_ms.push_back(std::chrono::duration<double, std::milli>(paired[i] - opened[i]).count());
+	}
+	json r = {
+		{"controllers", controller_count},
+		{"interval_ms", interval.count()},
+		{"attempts", pairing.get_attempts()},
+		{"last_opened_ms", std::chrono::duration<double, std::milli>(opened.back() - start).count()},
+		{"total_ms", std::chrono::duration<double, std::milli>(*std::max_element(paired.begin(), paired.end()) - start).count()}
+	};
+	r.update(percentiles(lag_ms, "lag_ms"));
+	emit("pairing", r);
+}
+
+/**
+ * Compiles a looping animation, a colour cycle of frame_count keyframes
+ * per panel with each colour held for three more, into animData, then
+ * uploads one for the mock's own panels.
+ */
+void bench_anim_compile(const Options &opts, unsigned int panel_count, unsigned int frame_count) {
+	PanelLayout layout;
+	AnimationTimeline timeline;
+	for (unsigned int i = 0; i < panel_count; i++) {
+		PanelPosition p;
+		p.id = i + 1;
+		layout.layout.positions.push_back(p);
+		for (unsigned int f = 0; f < frame_count; f++) {
+			uint8_t level = static_cast<uint8_t>((i + f / 4) * 255 / frame_count);
+			timeline.add(p.id, Frame(level, 255 - level, 128, 5));
+		}
+	}
+	std::string anim_data;
+	json r = measure(opts, opts.iterations, [&]() {
+		anim_data = timeline.compile(layout);
+	});
+	r["panels"] = panel_count;
+	r["frames_per_panel"] = frame_count;
+	r["anim_data_bytes"] = anim_data.size();
+
+	MockController mock(opts.info_path);
+	ScratchCredentials scratch(mock.get_token());
+	Aurora aurora("127.0.0.1", mock.get_http_port());
+	scratch.adopt(aurora);
+	aurora.get_info();
+	AnimationTimeline own;
+	for (auto &p: aurora.get_panel_positions()) {
+		for (unsigned int f = 0; f < frame_count; f++) {
+			own.add(p.id, Frame(f * 255 / frame_count, 0, 0, 5));
+		}
+	}
+	auto start = std::chrono::steady_clock::now();
+	own.upload(aurora, "bench");
+	r["upload_ms"] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	r["uploaded"] = mock.get_custom_effect().value("animName", "") == "bench";
+	emit("anim_compile", r);
+}
+
+/**
+ * Iterates registry snapshots on several reader threads, as render loops
+ * would, while a writer keeps moving devices between addresses;
+ * ns_per_op is per snapshot taken and walked.
+ */
+void bench_registry(const Options &opts, unsigned int device_count, unsigned int reader_count) {
+	DeviceRegistry registry;
+	for (unsigned int i = 0; i < device_count; i++) {
+		registry.add_or_update("bench" + std::to_string(i), "127.0.0.1", 16021);
+	}
+	std::atomic<bool> done(false);
+	std::atomic<uint64_t> updates(0);
+	std::thread writer([&]() {
+		for (unsigned int n = 0; !done; n++) {
+			registry.add_or_update("bench" + std::to_string(n % device_count), "127.0.0.1", 16022 + (n / device_count) % 2);
+			updates++;
+		}
+	});
+	std::atomic<uint64_t> present(0);
+	auto walk = [&]() {
+		DeviceRegistry::snapshot_t snapshot = registry.snapshot();
+		unsigned int n = 0;
+		for (auto &device: *snapshot) {
+			n += device.present;
+		}
+		present += n;
+	};
+	std::vector<std::thread> readers;
+	for (unsigned int i = 1; i < reader_count; i++) {
+		readers.push_back(std::thread([&]() {
+			measure(opts, opts.iterations, walk);
+		}));
+	}
+	json r = measure(opts, opts.iterations, walk);
+	for (auto &reader: readers) {
+		reader.join();
+	}
+	done = true;
+	writer.join();
+	r["devices"] = device_count;
+	r["readers"] = reader_count;
+	r["updates"] = updates.load();
+	emit("registry", r);
+}
+
+/**
+ * Reduces a canvas frame to colours for rows of panels, as when playing
+ * video on them, and times building the sampler it uses.
+ */
+void bench_canvas(const Options &opts, unsigned int panel_count, unsigned int width, unsigned int height) {
+	PanelLayout layout;
+	layout.layout.side_length = 150;
+	layout.orientation.value = 30;
+	// Strips of ten, alternately pointing up and down
+	for (unsigned int i = 0; i < panel_count; i++) {
+		PanelPosition p;
+		p.id = i + 1;
+		p.x = (i % 10) * 75;
+		p.y = (i / 10) * 130 + ((i % 2) ? 43 : 0);
+		p.o = (i % 2) ? 60 : 0;
+		layout.layout.positions.push_back(p);
+	}
+	CanvasFormat format(width, height);
+	std::vector<uint8_t> frame(format.frame_size());
+	for (size_t i = 0; i < frame.size(); i++) {
+		frame[i] = static_cast<uint8_t>(i * 7);
+	}
+	std::shared_ptr<const CanvasSampler> sampler = CanvasSampler::get(layout, format);
+	RGBBuffer colours;
+	json r = measure(opts, opts.iterations, [&]() {
+		sampler->reduce(frame.data(), colours);
+	});
+	auto start = std::chrono::steady_clock::now();
+	CanvasSampler built(*LayoutGeometry::get(layout.layout), layout.orientation.value, format);
+	r["build_ms"] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	r["panels"] = panel_count;
+	r["width"] = width;
+	r["height"] = height;
+	r["taps"] = sampler->get_tap_count();
+	emit("canvas_reduce", r);
+}
+
+class MDNSBenchResult {
+public:
+	unsigned int wanted;
+	std::set<std::string> ids;
+};
+
+bool mdns_bench_found(const AvahiAddress &address, const std::string &hostname, uint16_t port, const std::string &id, void *userdata) {
+	MDNSBenchResult *result = static_cast<MDNSBenchResult *>(userdata);
+	result->ids.insert(id);
+	return result->ids.size() < result->wanted;
+}
+
+/**
+ * Discovers several mocks answering mDNS on the loopback interface
+ * without Avahi, and times how long until all of them had been found.
+ */
+void bench_mdns(const Options &opts, unsigned int controller_count) {
+	const uint16_t port = 25353;
+	std::vector<std::unique_ptr<MockController> > mocks;
+	for (unsigned int i = 0; i < controller_count; i++) {
+		mocks.push_back(std::unique_ptr<MockController>(new MockController(opts.info_path)));
+		mocks.back()->advertise("00:00:00:00:00:" + std::to_string(10 + i), port);
+	}
+	MDNSResponder mdns;
+	mdns.set_use_avahi(false);
+	mdns.set_fallback(MDNS_GROUP, port, "127.0.0.1");
+	std::vector<double> ms;
+	unsigned int found = 0;
+	for (unsigned int r = 0; r < opts.repetitions; r++) {
+		MDNSBenchResult result;
+		result.wanted = controller_count;
+		auto start = std::chrono::steady_clock::now();
+		mdns.discover(Aurora::NANOLEAF_MDNS_SERVICE_TYPE, mdns_bench_found, &result);
+		ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		found = result.ids.size();
+	}
+	json r = {
+		{"controllers", controller_count},
+		{"found", found},
+		{"repetitions", opts.repetitions}
+	};
+	r.update(percentiles(ms, "ms"));
+	emit("mdns_discover", r);
+}
+
+/**
+ * Streams frames to the mock's receiver at a fixed rate, well above
+ * what a real controller accepts. Each frame carries its sequence number
+ * in the first panel's colour, so that the receiver can match it to its
+ * send time.
+ */
+void bench_stream(const Options &opts, unsigned int panel_count, ProtocolVersion version) {
+	MockController mock(opts.info_path);
+	ScratchCredentials scratch(mock.get_token());
+	Aurora aurora("127.0.0.1", mock.get_http_port());
+	scratch.adopt(aurora);
+	const unsigned int frame_rate = 2000;
+	unsigned int frames = std::min(opts.iterations, frame_rate);
+	std::vector<std::chrono::steady_clock::time_point> sent(frames);
+	std::vector<double> latency_us;
+	std::mutex latency_mutex;
+	latency_us.reserve(frames);
+	mock.set_packet_callback([&](const ReceivedPacket &packet) {
+		if (packet.commands.empty() || packet.commands[0].get_frames().empty()) {
+			return;
+		}
+		const Frame &f = packet.commands[0].get_frames().back();
+		unsigned int seq = (f.get_red() << 16) | (f.get_green() << 8) | f.get_blue();
+		if (seq < frames) {
+			std::lock_guard<std::mutex> lock(latency_mutex);
+			latency_us.push_back(std::chrono::duration<double, std::micro>(packet.received - sent[seq]).count());
+		}
+	});
+	IPStream *stream = &aurora.external_control(version);
+	std::vector<PanelCommand> commands = make_commands(panel_count);
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int seq = 0; seq < frames; seq++) {
+		std::this_thread::sleep_until(start + seq * std::chrono::nanoseconds(std::chrono::seconds(1)) / frame_rate);
+		commands[0].assign(0, Frame(seq >> 16, seq >> 8, seq, 0));
+		sent[seq] = std::chrono::steady_clock::now();
+		write_panel_commands(*stream, commands);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	// Let the receiver catch up
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	delete stream;
+	std::lock_guard<std::mutex> lock(latency_mutex);
+	std::sort(latency_us.begin(), latency_us.end());
+	json r = {
+		{"panels", panel_count},
+		{"protocol", (version == PROTOCOL_V2) ? "v2" : "v1"},
+		{"frames_sent", frames},
+		{"frames_received", latency_us.size()},
+		{"frames_per_sec", frames / elapsed.count()}
+	};
+	if (latency_us.size()) {
+		r["latency_us_p50"] = latency_us[latency_us.size() / 2];
+		r["latency_us_p99"] = latency_us[latency_us.size() * 99 / 100];
+		r["latency_us_max"] = latency_us.back();
+	}
+	emit("stream", r);
+}
+
+/**
+ * Publishes frames faster than a deliberately slow consumer takes them,
+ * checking that every frame arrives whole and in order, and that each
+ * published is either received or counted as overwritten; then times
+ * publishing through a FrameSender to a socket.
+ */
+void bench_frame_queue(const Options &opts, unsigned int panel_count, std::chrono::nanoseconds consume_cost) {
+	typedef FrameQueue<std::vector<uint64_t>, FrameSender::QUEUE_LENGTH> queue_t;
+	std::unique_ptr<queue_t> queue(new queue_t);
+	std::atomic<bool> producing(true);
+	uint64_t received = 0, out_of_order = 0, torn = 0;
+	std::thread consumer([&]() {
+		uint64_t last = 0;
+		for (;;) {
+			bool finished = !producing.load(std::memory_order_acquire);
+			const std::vector<uint64_t> *frame = queue->consume();
+			if (!frame) {
+				if (finished) {
+					return;
+				}
+				continue;
+			}
+			uint64_t seq = frame->front();
+			if (std::count(frame->begin(), frame->end(), seq) != static_cast<long>(frame->size())) {
+				torn++;
+			}
+			if (received && seq <= last) {
+				out_of_order++;
+			}
+			last = seq;
+			received++;
+			auto until = std::chrono::steady_clock::now() + consume_cost;
+			while (std::chrono::steady_clock::now() < until) {
+			}
+		}
+	});
+	uint64_t seq = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < opts.iterations * opts.repetitions; i++) {
+		queue->back().assign(panel_count, ++seq);
+		queue->publish();
+	}
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	producing.store(false, std::memory_order_release);
+	consumer.join();
+	uint64_t published = queue->get_published(), overwritten = queue->get_overwritten();
+	if (torn || out_of_order || received + overwritten != published) {
+		throw std::string("Frame queue lost track of frames");
+	}
+	emit("frame_queue", json{
+		{"panels", panel_count},
+		{"consume_ns", consume_cost.count()},
+		{"ns_per_publish", elapsed.count() / published},
+		{"published", published},
+		{"received", received},
+		{"overwritten", overwritten}
+	});
+
+	UDPSink sink;
+	UDPStream stream("127.0.0.1", sink.get_port(), PROTOCOL_V2);
+	const std::vector<PanelCommand> commands = make_commands(panel_count);
+	uint64_t sender_published, sender_overwritten;
+	json r;
+	{
+		FrameSender sender(stream);
+		r = measure(opts, opts.iterations, [&]() {
+			sender.next_frame() = commands;
+			sender.publish();
+		});
+		sender_published = sender.get_published();
+		sender_overwritten = sender.get_overwritten();
+	}
+	r["panels"] = panel_count;
+	r["published"] = sender_published;
+	r["overwritten"] = sender_overwritten;
+	emit("frame_sender", r);
+}
+
+}
+
+static void usage(const char *argv0) {
+	std::cerr << "Usage: " << argv0 << " [-n iterations] [-r repetitions] [-i controller-info.json] [filter]" << std::endl;
+}
+
+int
+main(int argc, char *argv[])
+{
+	Options opts;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:r:i:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			opts.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			opts.repetitions = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			opts.info_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc) {
+		opts.filter = argv[optind];
+	}
+	if (opts.iterations == 0 || opts.repetitions == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	CURLcode res = curl_global_init(CURL_GLOBAL_ALL);
+	if (res != CURLE_OK) {
+		std::cerr << "curl_global_init: " << curl_easy_strerror(res) << std::endl;
+		return EXIT_FAILURE;
+	}
+	int ret = EXIT_SUCCESS;
+	try {
+		if (opts.wanted("write_panel_commands")) {
+			bench_encode(opts, 10);
+			bench_encode(opts, 100);
+			bench_encode(opts, 1000);
+		}
+		if (opts.wanted("delta_writer")) {
+			bench_delta(opts, 100, 10);
+		}
+		if (opts.wanted("colour_convert")) {
+			bench_colour(opts, 1000);
+		}
+		if (opts.wanted("from_json") || opts.wanted("push_parse")) {
+			bench_from_json(opts);
+		}
+		if (opts.wanted("get_info")) {
+			bench_get_info(opts);
+		}
+		if (opts.wanted("refresh")) {
+			bench_refresh(opts);
+		}
+		if (opts.wanted("events")) {
+			bench_events(opts);
+		}
+		if (opts.wanted("touch")) {
+			bench_touch(opts);
+		}
+		if (opts.wanted("state_writer")) {
+			bench_state_writer(opts);
+		}
+		if (opts.wanted("get_info_concurrent")) {
+			bench_get_info_concurrent(opts, 8);
+		}
+		if (opts.wanted("canvas_reduce")) {
+			bench_canvas(opts, 30, 320, 180);
+			bench_canvas(opts, 30, 1920, 1080);
+		}
+		if (opts.wanted("anim_compile")) {
+			bench_anim_compile(opts, 30, 40);
+		}
+		if (opts.wanted("registry")) {
+			bench_registry(opts, 30, 4);
+		}
+		if (opts.wanted("mdns_discover")) {
+			bench_mdns(opts, 8);
+		}
+		if (opts.wanted("pairing")) {
+			bench_pairing(opts, 8);
+		}
+		if (opts.wanted("frame_queue") || opts.wanted("frame_sender")) {
+			bench_frame_queue(opts, 100, std::chrono::microseconds(2));
+		}
+		if (opts.wanted("stream")) {
+			bench_stream(opts, 100, PROTOCOL_V1);
+			bench_stream(opts, 100, PROTOCOL_V2);
+		}
+	} catch (char const * const str) {
+		std::cerr << "Benchmark failed: " << str << std::endl;
+		ret = EXIT_FAILURE;
+	} catch (const std::string &sstr) {
+		std::cerr << "Benchmark failed: " << sstr << std::endl;
+		ret = EXIT_FAILURE;
+	}
+	curl_global_cleanup();
+	return ret;
+}
@@ -0,0 +1,314 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#include "canvas.h"
+
+namespace mynanoleaf {
+
+CanvasSampler::CanvasSampler(const LayoutGeometry &geometry, int porientation, const CanvasFormat &pformat)
+:
+	layout_hash(geometry.get_hash()),
+	orientation(porientation),
+	format(pformat)
+{
+	if (
+		format.width == 0 || format.height == 0 || format.bytes_per_pixel < 3 ||
+		format.row_bytes() < static_cast<size_t>(format.width) * format.bytes_per_pixel
+	) {
+		throw std::string("Bad canvas format");
+	}
+	if (format.frame_size() > UINT32_MAX) {
+		throw std::string("Canvas too large");
+	}
+	build(geometry);
+}
+
+std::shared_ptr<const CanvasSampler> CanvasSampler::get(const PanelLayout &layout, const CanvasFormat &format) {
+	typedef std::tuple<uint64_t, int, unsigned int, unsigned int, unsigned int, size_t> key_t;
+	static std::mutex cache_mutex;
+	static std::map<key_t, std::weak_ptr<const CanvasSampler> > cache;
+	key_t key(
+		LayoutGeometry::hash_layout(layout.layout), layout.orientation.value,
+		format.width, format.height, format.bytes_per_pixel, format.row_bytes()
+	);
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	std::shared_ptr<const CanvasSampler> ret = cache[key].lock();
+	if (!ret) {
+		ret = std::make_shared<const CanvasSampler>(*LayoutGeometry::get(layout.layout), layout.orientation.value, format);
+		cache[key] = ret;
+	}
+	return ret;
+}
+
+/**
+ * Which side of the edge from a to b p lies, scaled by twice the area
+ * of the triangle they make.
+ */
+static double edge_side(const Point &a, const Point &b, double px, double py) {
+	return (b.x - a.x) * (py - a.y) - (b.y - a.y) * (px - a.x);
+}
+
+static bool inside(const Point v[3], double winding, double px, double py) {
+	return
+		winding * edge_side(v[0], v[1], px, py) >= 0 &&
+		winding * edge_side(v[1], v[2], px, py) >= 0 &&
+		winding * edge_side(v[2], v[0], px, py) >= 0;
+}
+
+void CanvasSampler::build(const LayoutGeometry &geometry) {
+	const double a = orientation * M_PI / 180.0, cos_a = std::cos(a), sin_a = std::sin(a);
+	size_t n = geometry.size();
+	std::vector<Point> vertices(3 * n);
+	double min_x = 0, min_y = 0, max_x = 0, max_y = 0;
+	for (size_t i = 0; i < n; i++) {
+		for (int k = 0; k < 3; k++) {
+			const Point &p = geometry.panel(i).vertices[k];
+			Point &q = vertices[3 * i + k];
+			q.x = p.x * cos_a - p.y * sin_a;
+			q.y = p.x * sin_a + p.y * cos_a;
+			if (i == 0 && k == 0) {
+				min_x = max_x = q.x;
+				min_y = max_y = q.y;
+			}
+			min_x = std::min(min_x, q.x);
+			min_y = std::min(min_y, q.y);
+			max_x = std::max(max_x, q.x);
+			max_y = std::max(max_y, q.y);
+		}
+	}
+	double scale = std::min(format.width / (max_x - min_x), format.height / (max_y - min_y));
+	double pad_x = (format.width - (max_x - min_x) * scale) / 2;
+	double pad_y = (format.height - (max_y - min_y) * scale) / 2;
+	for (auto &v: vertices) {
+		// Canvas rows run downwards
+		v.x = (v.x - min_x) * scale + pad_x;
+		v.y = (max_y - v.y) * scale + pad_y;
+	}
+
+	const size_t row_bytes = format.row_bytes();
+	const uint32_t full = SUBSAMPLES * SUBSAMPLES;
+	std::vector<std::pair<uint32_t, uint32_t> > covered;
+	std::vector<std::vector<Tap> > panel_taps(n);
+	for (size_t i = 0; i < n; i++) {
+		const Point *v = &vertices[3 * i];
+		double winding = (edge_side(v[0], v[1], v[2].x, v[2].y) < 0) ? -1 : 1;
+		int col0 = std::max(0, static_cast<int>(std::floor(std::min({v[0].x, v[1].x, v[2].x}))));
+		int row0 = std::max(0, static_cast<int>(std::floor(std::min({v[0].y, v[1].y, v[2].y}))));
+		int col1 = std::min(static_cast<int>(format.width) - 1, static_cast<int>(std::floor(std::max({v[0].x, v[1].x, v[2].x}))));
+		int row1 = std::min(static_cast<int>(format.height) - 1, static_cast<int>(std::floor(std::max({v[0].y, v[1].y, v[2].y}))));
+		covered.clear();
+		uint64_t total = 0;
+		for (int row = row0; row <= row1; row++) {
+			for (int col = col0; col <= col1; col++) {
+				uint32_t count = 0;
+				if (
+					inside(v, winding, col, row) && inside(v, winding, col + 1, row) &&
+					inside(v, winding, col, row + 1) && inside(v, winding, col + 1, row + 1)
+				) {
+					// The triangle is convex, so it holds the whole pixel
+					count = full;
+				} else {
+					for (unsigned int sy = 0; sy < SUBSAMPLES; sy++) {
+						for (unsigned int sx = 0; sx < SUBSAMPLES; sx++) {
+							count += inside(v, winding, col + (sx + 0.5) / SUBSAMPLES, row + (sy + 0.5) / SUBSAMPLES);
+						}
+					}
+				}
+				if (count) {
+					covered.push_back(std::make_pair(row * row_bytes + col * format.bytes_per_pixel, count));
+					total += count;
+				}
+			}
+		}
+		if (!total) {
+			// Smaller than the sample spacing: take the pixel under its centre
+			int col = std::min(static_cast<int>(format.width) - 1, std::max(0, static_cast<int>((v[0].x + v[1].x + v[2].x) / 3)));
+			int row = std::min(static_cast<int>(format.height) - 1, std::max(0, static_cast<int>((v[0].y + v[1].y + v[2].y) / 3)));
+			covered.push_back(std::make_pair(row * row_bytes + col * format.bytes_per_pixel, 1));
+			total = 1;
+		}
+		// Rounded down, with what that loses given to the largest, so they sum to exactly one
+		std::vector<Tap> &pt = panel_taps[i];
+		uint32_t sum = 0;
+		size_t largest = 0;
+		for (auto &c: covered) {
+			Tap tap;
+			tap.offset = c.first;
+			tap.weight = static_cast<uint32_t>((static_cast<uint64_t>(c.second) << WEIGHT_BITS) / total);
+			sum += tap.weight;
+			if (pt.empty() || tap.weight > pt[largest].weight) {
+				largest = pt.size();
+			}
+			pt.push_back(tap);
+		}
+		pt[largest].weight += (1U << WEIGHT_BITS) - sum;
+	}
+	// Panels by where they start in the frame, so that it is read front to back
+	panel_order.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		panel_order[i] = i;
+	}
+	std::sort(panel_order.begin(), panel_order.end(), [&panel_taps](uint32_t x, uint32_t y) {
+		return panel_taps[x].front().offset < panel_taps[y].front().offset;
+	});
+	tap_offsets.assign(1, 0);
+	taps.clear();
+	for (uint32_t i: panel_order) {
+		taps.insert(taps.end(), panel_taps[i].begin(), panel_taps[i].end());
+		tap_offsets.push_back(taps.size());
+	}
+}
+
+void CanvasSampler::reduce(const uint8_t *canvas, RGBBuffer &out) const {
+	assert(canvas);
+	const size_t n = size();
+	const uint32_t half = 1U << (WEIGHT_BITS - 1);
+	out.resize(n);
+	const Tap *tap = taps.data();
+	for (size_t k = 0; k < n; k++) {
+		// At most 255 << WEIGHT_BITS, since the weights sum to one
+		uint32_t r = 0, g = 0, b = 0;
+		for (const Tap *end = taps.data() + tap_offsets[k + 1]; tap < end; tap++) {
+			const uint8_t *p = canvas + tap->offset;
+			r += tap->weight * p[0];
+			g += tap->weight * p[1];
+			b += tap->weight * p[2];
+		}
+		uint32_t i = panel_order[k];
+		out.r[i] = (r + half) >> WEIGHT_BITS;
+		out.g[i] = (g + half) >> WEIGHT_BITS;
+		out.b[i] = (b + half) >> WEIGHT_BITS;
+	}
+}
+
+std::unique_ptr<CanvasSource> CanvasSource::open(const std::string &path, size_t frame_size) {
+	if (frame_size == 0) {
+		throw std::string("Bad canvas frame size");
+	}
+	bool is_stdin = (path == "-");
+	int fd = is_stdin ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw std::string("Cannot open ") + path + ": " + strerror(errno);
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		std::string errmsg(strerror(errno));
+		if (!is_stdin) {
+			close(fd);
+		}
+		throw errmsg;
+	}
+	if (!S_ISREG(st.st_mode)) {
+		return std::unique_ptr<CanvasSource>(new PipeCanvasSource(fd, frame_size, !is_stdin));
+	}
+	std::unique_ptr<CanvasSource> source;
+	try {
+		source.reset(new MappedCanvasSource(fd, frame_size));
+	} catch (...) {
+		if (!is_stdin) {
+			close(fd);
+		}
+		throw;
+	}
+	// The mapping outlives the descriptor
+	if (!is_stdin) {
+		close(fd);
+	}
+	return source;
+}
+
+MappedCanvasSource::MappedCanvasSource(int fd, size_t pframe_size)
+:
+	base(NULL),
+	length(0),
+	frame_size(pframe_size),
+	position(0)
+{
+	if (frame_size == 0) {
+		throw std::string("Bad canvas frame size");
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		throw std::string(strerror(errno));
+	}
+	length = st.st_size;
+	if (length == 0) {
+		return;
+	}
+	void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		throw std::string("mmap: ") + strerror(errno);
+	}
+	base = static_cast<const uint8_t *>(p);
+	// Frames are read once, in order
+	madvise(p, length, MADV_SEQUENTIAL);
+}
+
+MappedCanvasSource::~MappedCanvasSource() {
+	if (base) {
+		munmap(const_cast<uint8_t *>(base), length);
+	}
+}
+
+const uint8_t *MappedCanvasSource::next() {
+	if (length - position < frame_size) {
+		return NULL;
+	}
+	const uint8_t *frame = base + position;
+	position += frame_size;
+	return frame;
+}
+
+PipeCanvasSource::PipeCanvasSource(int pfd, size_t frame_size, bool pclose_fd)
+:
+	fd(pfd),
+	close_fd(pclose_fd),
+	buffer(frame_size)
+{
+	if (frame_size == 0) {
+		throw std::string("Bad canvas frame size");
+	}
+}
+
+PipeCanvasSource::~PipeCanvasSource() {
+	if (close_fd) {
+		close(fd);
+	}
+}
+
+const uint8_t *PipeCanvasSource::next() {
+	size_t got = 0;
+	while (got < buffer.size()) {
+		ssize_t n = read(fd, buffer.data() + got, buffer.size() - got);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::string("Canvas read: ") + strerror(errno);
+		}
+		if (n == 0) {
+			if (got) {
+				std::cerr << "Ignoring " << got << " bytes of a partial canvas frame" << std::endl;
+			}
+			return NULL;
+		}
+		got += n;
+	}
+	return buffer.data();
+}
+
+}
@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif /* x86 */
+
+#include "colour.h"
+
+namespace mynanoleaf {
+
+namespace {
+
+/*
+ * Minimal constexpr maths, good to double precision over the range the
+ * gamma table needs, since <cmath> is not usable in constant expressions.
+ */
+constexpr double LN2 = 0.6931471805599453;
+
+constexpr double const_log(double x) {
+	int k = 0;
+	while (x < 1.0) {
+		x *= 2.0;
+		k--;
+	}
+	while (x >= 2.0) {
+		x /= 2.0;
+		k++;
+	}
+	// ln(x) = 2 atanh((x - 1) / (x + 1)), with |y| <= 1/3
+	double y = (x - 1.0) / (x + 1.0);
+	double y2 = y * y;
+	double term = y;
+	double sum = 0.0;
+	for (int n = 1; n < 40; n += 2) {
+		sum += term / n;
+		term *= y2;
+	}
+	return 2.0 * sum + k * LN2;
+}
+
+constexpr double const_exp(double x) {
+	int k = static_cast<int>(x / LN2);
+	double r = x - k * LN2;
+	double term = 1.0;
+	double sum = 1.0;
+	for (int n = 1; n < 30; n++) {
+		term *= r / n;
+		sum += term;
+	}
+	for (; k > 0; k--) {
+		sum *= 2.0;
+	}
+	for (; k < 0; k++) {
+		sum /= 2.0;
+	}
+	return sum;
+}
+
+/**
+ * The sRGB transfer function, from linear light to encoded value.
+ */
+constexpr double srgb_encode(double linear) {
+	return (linear <= 0.0031308) ?
+		12.92 * linear :
+		1.055 * const_exp(const_log(linear) / 2.4) - 0.055;
+}
+
+struct GammaTable {
+	uint8_t v[ColourPipeline::GAMMA_LUT_SIZE];
+};
+
+constexpr GammaTable make_gamma_table() {
+	GammaTable t{};
+	for (size_t i = 0; i < ColourPipeline::GAMMA_LUT_SIZE; i++) {
+		double encoded = srgb_encode(static_cast<double>(i) / (ColourPipeline::GAMMA_LUT_SIZE - 1));
+		t.v[i] = static_cast<uint8_t>(encoded * 255.0 + 0.5);
+	}
+	return t;
+}
+
+constexpr GammaTable gamma_table = make_gamma_table();
+
+static_assert(gamma_table.v[0] == 0, "gamma table must map black to black");
+static_assert(gamma_table.v[ColourPipeline::GAMMA_LUT_SIZE - 1] == 255, "gamma table must map white to white");
+
+const float LUT_SCALE = static_cast<float>(ColourPipeline::GAMMA_LUT_SIZE - 1);
+
+/*
+ * As minps and maxps do, these return b if either is NaN, so that the
+ * scalar path gives what the SIMD paths do for any input.
+ */
+inline float simd_min(float a, float b) { return (a < b) ? a : b; }
+inline float simd_max(float a, float b) { return (a > b) ? a : b; }
+
+/*
+ * Channel n of an HSV colour is v - v s clamp(min(k, 4 - k), 0, 1),
+ * where k = (n + h / 60) mod 6 and n is 5, 3 and 1 for red, green and
+ * blue. The result is scaled by brightness, clamped and looked up in
+ * the gamma table.
+ */
+inline uint8_t scalar_channel(float n, float h6, float s, float v) {
+	float k = n + h6;
+	k = k - 6.0f * std::floor(k * (1.0f / 6.0f));
+	float ramp = simd_min(simd_min(k, 4.0f - k), 1.0f);
+	ramp = simd_max(ramp, 0.0f);
+	float c = v - v * s * ramp;
+	// A NaN here goes to zero before it can reach the conversion to int
+	c = simd_min(simd_max(c, 0.0f), 1.0f);
+	return gamma_table.v[static_cast<int>(c * LUT_SCALE + 0.5f)];
+}
+
+void convert_scalar(
+	const float *h, const float *s, const float *v, float brightness,
+	uint8_t *r, uint8_t *g, uint8_t *b,
+	size_t begin, size_t end
+) {
+	for (size_t i = begin; i < end; i++) {
+		float h6 = h[i] * (1.0f / 60.0f);
+		float bv = v[i] * brightness;
+		r[i] = scalar_channel(5.0f, h6, s[i], bv);
+		g[i] = scalar_channel(3.0f, h6, s[i], bv);
+		b[i] = scalar_channel(1.0f, h6, s[i], bv);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse4.1")))
+inline __m128i sse_channel(__m128 n, __m128 h6, __m128 s, __m128 v) {
+	const __m128 six = _mm_set1_ps(6.0f);
+	const __m128 sixth = _mm_set1_ps(1.0f / 6.0f);
+	const __m128 four = _mm_set1_ps(4.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	__m128 k = _mm_add_ps(n, h6);
+	k = _mm_sub_ps(k, _mm_mul_ps(six, _mm_floor_ps(_mm_mul_ps(k, sixth))));
+	__m128 ramp = _mm_min_ps(_mm_min_ps(k, _mm_sub_ps(four, k)), one);
+	ramp = _mm_max_ps(ramp, zero);
+	__m128 c = _mm_sub_ps(v, _mm_mul_ps(_mm_mul_ps(v, s), ramp));
+	c = _mm_min_ps(_mm_max_ps(c, zero), one);
+	return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(LUT_SCALE)), _mm_set1_ps(0.5f)));
+}
+
+__attribute__((target("sse4.1")))
+size_t convert_sse41(
+	const float *h, const float *s, const float *v, float brightness,
+	uint8_t *r, uint8_t *g, uint8_t *b,
+	size_t n
+) {
+	alignas(16) int32_t idx[3][4];
+	const __m128 bright = _mm_set1_ps(brightness);
+	const __m128 inv60 = _mm_set1_ps(1.0f / 60.0f);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 h6 = _mm_mul_ps(_mm_loadu_ps(h + i), inv60);
+		__m128 sv = _mm_loadu_ps(s + i);
+		__m128 bv = _mm_mul_ps(_mm_loadu_ps(v + i), bright);
+		_mm_store_si128(reinterpret_cast<__m128i *>(idx[0]), sse_channel(_mm_set1_ps(5.0f), h6, sv, bv));
+		_mm_store_si128(reinterpret_cast<__m128i *>(idx[1]), sse_channel(_mm_set1_ps(3.0f), h6, sv, bv));
+		_mm_store_si128(reinterpret_cast<__m128i *>(idx[2]), sse_channel(_mm_set1_ps(1.0f), h6, sv, bv));
+		for (size_t j = 0; j < 4; j++) {
+			r[i + j] = gamma_table.v[idx[0][j]];
+			g[i + j] = gamma_table.v[idx[1][j]];
+			b[i + j] = gamma_table.v[idx[2][j]];
+		}
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+inline __m256i avx2_channel(__m256 n, __m256 h6, __m256 s, __m256 v) {
+	const __m256 six = _mm256_set1_ps(6.0f);
+	const __m256 sixth = _mm256_set1_ps(1.0f / 6.0f);
+	const __m256 four = _mm256_set1_ps(4.0f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	__m256 k = _mm256_add_ps(n, h6);
+	k = _mm256_sub_ps(k, _mm256_mul_ps(six, _mm256_floor_ps(_mm256_mul_ps(k, sixth))));
+	__m256 ramp = _mm256_min_ps(_mm256_min_ps(k, _mm256_sub_ps(four, k)), one);
+	ramp = _mm256_max_ps(ramp, zero);
+	__m256 c = _mm256_sub_ps(v, _mm256_mul_ps(_mm256_mul_ps(v, s), ramp));
+	c = _mm256_min_ps(_mm256_max_ps(c, zero), one);
+	return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(c, _mm256_set1_ps(LUT_SCALE)), _mm256_set1_ps(0.5f)));
+}
+
+__attribute__((target("avx2")))
+size_t convert_avx2(
+	const float *h, const float *s, const float *v, float brightness,
+	uint8_t *r, uint8_t *g, uint8_t *b,
+	size_t n
+) {
+	alignas(32) int32_t idx[3][8];
+	const __m256 bright = _mm256_set1_ps(brightness);
+	const __m256 inv60 = _mm256_set1_ps(1.0f / 60.0f);
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 h6 = _mm256_mul_ps(_mm256_loadu_ps(h + i), inv60);
+		__m256 sv = _mm256_loadu_ps(s + i);
+		__m256 bv = _mm256_mul_ps(_mm256_loadu_ps(v + i), bright);
+		_mm256_store_si256(reinterpret_cast<__m256i *>(idx[0]), avx2_channel(_mm256_set1_ps(5.0f), h6, sv, bv));
+		_mm256_store_si256(reinterpret_cast<__m256i *>(idx[1]), avx2_channel(_mm256_set1_ps(3.0f), h6, sv, bv));
+		_mm256_store_si256(reinterpret_cast<__m256i *>(idx[2]), avx2_channel(_mm256_set1_ps(1.0f), h6, sv, bv));
+		for (size_t j = 0; j < 8; j++) {
+			r[i + j] = gamma_table.v[idx[0][j]];
+			g[i + j] = gamma_table.v[idx[1][j]];
+			b[i + j] = gamma_table.v[idx[2][j]];
+		}
+	}
+	return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+}
+
+bool ColourPipeline::is_supported(Implementation impl) {
+	switch (impl) {
+	case SCALAR:
+		return true;
+#ifdef HAVE_X86_SIMD
+	case SSE41:
+		return __builtin_cpu_supports("sse4.1");
+	case AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif /* HAVE_X86_SIMD */
+	default:
+		return false;
+	}
+}
+
+ColourPipeline::ColourPipeline() {
+	if (is_supported(AVX2)) {
+		implementation = AVX2;
+	} else if (is_supported(SSE41)) {
+		implementation = SSE41;
+	} else {
+		implementation = SCALAR;
+	}
+}
+
+ColourPipeline::ColourPipeline(Implementation pimplementation) : implementation(pimplementation) {
+	if (!is_supported(implementation)) {
+		throw std::string("Colour pipeline implementation not supported on this CPU");
+	}
+}
+
+float ColourPipeline::brightness_fraction(const ClampedValue &brightness) {
+	if (brightness.max <= brightness.min) {
+		return 1.0f;
+	}
+	float f = static_cast<float>(brightness.value - brightness.min) / (brightness.max - brightness.min);
+	return std::min(std::max(f, 0.0f), 1.0f);
+}
+
+void ColourPipeline::convert(const HSVBuffer &in, float brightness, RGBBuffer &out) const {
+	size_t n = in.size();
+	assert(in.s.size() == n && in.v.size() == n);
+	out.resize(n);
+	size_t done = 0;
+	switch (implementation) {
+#ifdef HAVE_X86_SIMD
+	case AVX2:
+		done = convert_avx2(
+			in.h.data(), in.s.data(), in.v.data(), brightness,
+			out.r.data(), out.g.data(), out.b.data(), n
+		);
+		break;
+	case SSE41:
+		done = convert_sse41(
+			in.h.data(), in.s.data(), in.v.data(), brightness,
+			out.r.data(), out.g.data(), out.b.data(), n
+		);
+		break;
+#endif /* HAVE_X86_SIMD */
+	default:
+		break;
+	}
+	// Whatever the vector path left over
+	convert_scalar(
+		in.h.data(), in.s.data(), in.v.data(), brightness,
+		out.r.data(), out.g.data(), out.b.data(), done, n
+	);
+}
+
+void make_panel_commands(
+	const RGBBuffer &colours,
+	const std::vector<PanelPosition> &positions,
+	uint16_t transition_time,
+	std::vector<PanelCommand> &commands
+) {
+	size_t n = std::min(colours.size(), positions.size());
+	if (commands.size() > n) {
+		commands.erase(commands.begin() + n, commands.end());
+	}
+	for (size_t i = 0; i < n; i++) {
+		Frame f(colours.r[i], colours.g[i], colours.b[i], transition_time);
+		if (i < commands.size()) {
+			commands[i].assign(positions[i].id, f);
+		} else {
+			commands.push_back(PanelCommand(positions[i].id, std::vector<Frame>(1, f)));
+		}
+	}
+}
+
+}
@@ -0,0 +1,105 @@
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+#include "aurora.h"
+#include "atomicfile.h"
+#include "credentials.h"
+
+namespace mynanoleaf {
+
+CredentialStore::CredentialStore(const std::string &ppath) : path(ppath), writes(0) {
+	load();
+}
+
+CredentialStore &CredentialStore::get_default() {
+	static CredentialStore store(TOKEN_FILENAME);
+	return store;
+}
+
+void CredentialStore::load() {
+	std::ifstream fs(path);
+	std::string line;
+	while (std::getline(fs, line)) {
+		std::istringstream words(line);
+		std::string key, token;
+		if (!(words >> key)) {
+			continue;
+		}
+		if (words >> token) {
+			tokens[key] = token;
+		} else {
+			unclaimed_token = key;
+		}
+	}
+}
+
+std::string CredentialStore::get(const std::string &key) {
+	{
+		std::shared_lock<std::shared_timed_mutex> lock(mutex);
+		auto it = tokens.find(key);
+		if (it != tokens.end()) {
+			return it->second;
+		}
+		if (unclaimed_token.empty()) {
+			return std::string();
+		}
+	}
+	std::unique_lock<std::shared_timed_mutex> lock(mutex);
+	// Another thread may have claimed it, or set this key, in the meantime
+	auto it = tokens.find(key);
+	if (it != tokens.end() || unclaimed_token.empty()) {
+		return it == tokens.end() ? std::string() : it->second;
+	}
+	std::string token;
+	token.swap(unclaimed_token);
+	tokens[key] = token;
+	try {
+		save();
+	} catch (const std::string &errmsg) {
+		// Still only this device's in memory; the next save records it
+		std::cerr << "Cannot save credentials: " << errmsg << std::endl;
+	}
+	return token;
+}
+
+void CredentialStore::set(const std::string &key, const std::string &token) {
+	std::unique_lock<std::shared_timed_mutex> lock(mutex);
+	auto it = tokens.find(key);
+	if (it != tokens.end() && it->second == token) {
+		return;
+	}
+	std::string old_token;
+	bool existed = it != tokens.end();
+	if (existed) {
+		old_token = it->second;
+	}
+	tokens[key] = token;
+	// Still holding the lock, so that concurrent saves land in order
+	try {
+		save();
+	} catch (...) {
+		if (existed) {
+			tokens[key] = old_token;
+		} else {
+			tokens.erase(key);
+		}
+		throw;
+	}
+}
+
+void CredentialStore::save() {
+	std::ostringstream contents;
+	if (!unclaimed_token.empty()) {
+		contents << unclaimed_token << std::endl;
+	}
+	for (auto &t: tokens) {
+		contents << t.first << ' ' << t.second << std::endl;
+	}
+	// Tokens grant control of the device, so keep them private
+	replace_file(path, contents.str(), 0600);
+	writes++;
+}
+
+}
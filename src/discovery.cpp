@@ -1,8 +1,6 @@
 #include "discovery.h"
 
-MDNSResponder::host_callback_t MDNSResponder::Session::shared_host_callback = NULL;
-void *MDNSResponder::Session::shared_callback_arg = NULL;
-bool MDNSResponder::Session::shared_continue_enumeration = true;
+const std::chrono::milliseconds MDNSResponder::DEFAULT_TIMEOUT(5000);
 
 void MDNSResponder::Session::resolve_callback(
     AvahiServiceResolver *r,
@@ -18,15 +16,32 @@ void MDNSResponder::Session::resolve_callback(
     AvahiStringList *txt,
     AvahiLookupResultFlags flags,
     void* userdata) {
-	// In my development system, this parameter receives apparently-garbage
-	// values; it does not (as one might expect) receive the value passed
-	// to avahi_service_resolver_new.
-	// assert(userdata);
     assert(r);
+    assert(userdata);
+    Resolution *resolution = static_cast<Resolution *>(userdata);
+    resolution->session->resolved(resolution, r, event, name, type, domain, host_name, address, port, txt, flags);
+}
+
+void MDNSResponder::Session::resolved(
+    Resolution *resolution,
+    AvahiServiceResolver *r,
+    AvahiResolverEvent event,
+    const char *name,
+    const char *type,
+    const char *domain,
+    const char *host_name,
+    const AvahiAddress *address,
+    uint16_t port,
+    AvahiStringList *txt,
+    AvahiLookupResultFlags flags
+) {
     /* Called whenever a service has been resolved successfully or timed out */
     switch (event) {
 	case AVAHI_RESOLVER_FAILURE:
-		throw avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(r)));
+		// One device failing to resolve should not stop the others being found
+		std::cerr << "Cannot resolve service '" << name << "': " << avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(r))) << std::endl;
+		free_resolution(resolution);
+		break;
 	case AVAHI_RESOLVER_FOUND:
 		{
 			char a[AVAHI_ADDRESS_STR_MAX], *t;
@@ -49,16 +64,21 @@ void MDNSResponder::Session::resolve_callback(
 					"\tmulticast: " << !!(flags & AVAHI_LOOKUP_RESULT_MULTICAST) << std::endl <<
 					"\tcached: " << !!(flags & AVAHI_LOOKUP_RESULT_CACHED) << std::endl
 			;
-			shared_continue_enumeration = shared_host_callback(
-				*address, host_name, port, id, shared_callback_arg
-			);
+			Instance &instance = instances[std::make_tuple(resolution->interface, resolution->protocol, std::string(name))];
+			instance.id = id;
+			instance.hostname = host_name;
+			if (!done && !host_callback(*address, host_name, port, id, callback_arg)) {
+				done = true;
+			}
 			avahi_free(t);
 		}
+		if (!stopping) {
+			free_resolution(resolution);
+		}
 		break;
 	default:
 		break;
     }
-    avahi_service_resolver_free(r);
 }
 
 void MDNSResponder::Session::new_device(
@@ -68,32 +88,30 @@ void MDNSResponder::Session::new_device(
 	const char *type,
 	const char *domain
 ) {
-	// TODO: Begin critical section
-	shared_host_callback = host_callback;
-	shared_callback_arg = callback_arg;
-	AvahiServiceResolver *ret = avahi_service_resolver_new(
+	Resolution *resolution = new Resolution;
+	resolution->session = this;
+	resolution->interface = interface;
+	resolution->protocol = protocol;
+	resolution->name = name;
+	resolution->resolver = avahi_service_resolver_new(
 		client,
 		interface,
 		protocol,
 		name,
 		type,
 		domain,
-		AVAHI_PROTO_UNSPEC,
+		// IPv4 only, so that a device seen over both protocols keeps one address
+		AVAHI_PROTO_INET,
 		AVAHI_LOOKUP_USE_MULTICAST,
 		resolve_callback,
-		// In my development system, this parameter appears to be
-		// ignored; it does not (as one might expect) get passed
-		// to resolve_callback.
-		NULL
+		resolution
 	);
-	bool continue_enumeration = shared_continue_enumeration;
-	// TODO: End critical section
-	if (!ret) {
-		throw avahi_strerror(avahi_client_errno(client));
+	if (!resolution->resolver) {
+		delete resolution;
+		std::cerr << "Cannot resolve service '" << name << "': " << avahi_strerror(avahi_client_errno(client)) << std::endl;
+		return;
 	}
-    if (!continue_enumeration) {
-		avahi_simple_poll_quit(simple_poll);
-    }
+	resolutions.insert(resolution);
 }
 
 void MDNSResponder::Session::browse_callback(
@@ -108,30 +126,52 @@ void MDNSResponder::Session::browse_callback(
 ) {
     assert(b);
     /* Called whenever a new services becomes available on the LAN or is removed from the LAN */
-    const char *errmsg;
     switch (event) {
 	case AVAHI_BROWSER_FAILURE:
-		errmsg = avahi_strerror(avahi_client_errno(avahi_service_browser_get_client(b)));
-		avahi_simple_poll_quit(simple_poll);
-		throw errmsg;
+		fail(avahi_strerror(avahi_client_errno(avahi_service_browser_get_client(b))));
+		break;
 	case AVAHI_BROWSER_NEW:
 		std::cerr << "(Browser) NEW: service '" << name << "' of type '" << type << "' in domain '" << domain << "'" << std::endl;
-		/* We ignore the returned resolver object. In the callback
-		   function we free it. If the server is terminated before
-		   the callback function is called the server will free
-		   the resolver for us. */
+		/* Resolve at once, alongside any others still outstanding. The
+		   resolver is freed once it has answered, or when watching once
+		   the service is removed; if the session ends first, freeing the
+		   client frees it. */
 		new_device(interface, protocol, name, type, domain);
 		break;
 	case AVAHI_BROWSER_REMOVE:
 #ifndef NDEBUG
 		std::cerr << "(Browser) REMOVE: service '" << name << "' of type '" << type << "' in domain '" << domain << "'" << std::endl;
 #endif /* ndef NDEBUG */
+		for (auto r = resolutions.begin(); r != resolutions.end(); ) {
+			Resolution *resolution = *r++;
+			if (resolution->interface == interface && resolution->protocol == protocol && resolution->name == name) {
+				free_resolution(resolution);
+			}
+		}
+		{
+			auto it = instances.find(std::make_tuple(interface, protocol, std::string(name)));
+			if (it == instances.end()) {
+				break;
+			}
+			Instance gone = it->second;
+			instances.erase(it);
+			for (auto &other: instances) {
+				if (std::get<2>(other.first) == name) {
+					// Still present on another interface or protocol
+					return;
+				}
+			}
+			if (remove_callback) {
+				remove_callback(gone.id, gone.hostname, callback_arg);
+			}
+		}
 		break;
 	case AVAHI_BROWSER_ALL_FOR_NOW:
 #ifndef NDEBUG
 		std::cerr << "(Browser) ALL_FOR_NOW" << std::endl;
 #endif /* ndef NDEBUG */
-		avahi_simple_poll_quit(simple_poll);
+		// Finishes once the resolves now outstanding are done, unless watching
+		all_for_now = true;
 		break;
 	case AVAHI_BROWSER_CACHE_EXHAUSTED:
 #ifndef NDEBUG
@@ -0,0 +1,97 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "atomicfile.h"
+#include "discoverycache.h"
+
+namespace mynanoleaf {
+
+DiscoveryCache::DiscoveryCache(const std::string &ppath) : path(ppath) {
+	load();
+}
+
+void DiscoveryCache::load() {
+	std::ifstream fs(path);
+	std::string line;
+	while (std::getline(fs, line)) {
+		std::istringstream words(line);
+		Entry entry;
+		if (words >> entry.id >> entry.address >> entry.port >> std::hex >> entry.layout_hash) {
+			entries[entry.id] = entry;
+		}
+	}
+}
+
+void DiscoveryCache::save() {
+	std::ostringstream contents;
+	for (auto &e: entries) {
+		contents <<
+			e.second.id << ' ' <<
+			e.second.address << ' ' <<
+			e.second.port << ' ' <<
+			std::hex << e.second.layout_hash << std::dec << std::endl;
+	}
+	replace_file(path, contents.str());
+}
+
+std::vector<DiscoveryCache::Entry> DiscoveryCache::get_entries() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<Entry> ret;
+	for (auto &e: entries) {
+		ret.push_back(e.second);
+	}
+	return ret;
+}
+
+bool DiscoveryCache::get(const std::string &id, Entry &entry) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(id);
+	if (it == entries.end()) {
+		return false;
+	}
+	entry = it->second;
+	return true;
+}
+
+bool DiscoveryCache::update(const std::string &id, const std::string &address, uint16_t port) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(id);
+	if (it != entries.end() && it->second.address == address && it->second.port == port) {
+		return false;
+	}
+	Entry &entry = entries[id];
+	entry.id = id;
+	entry.address = address;
+	entry.port = port;
+	if (it == entries.end()) {
+		entry.layout_hash = 0;
+	}
+	save();
+	return true;
+}
+
+void DiscoveryCache::set_layout_hash(const std::string &id, uint64_t layout_hash) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = entries.find(id);
+	if (it == entries.end() || it->second.layout_hash == layout_hash) {
+		return;
+	}
+	it->second.layout_hash = layout_hash;
+	save();
+}
+
+void DiscoveryCache::revalidate(std::function<void()> browse) {
+	wait();
+	revalidator = std::thread([browse]() {
+		try {
+			browse();
+		} catch (const char *errmsg) {
+			std::cerr << "Revalidating discovered devices failed: " << errmsg << std::endl;
+		} catch (const std::string &errmsg) {
+			std::cerr << "Revalidating discovered devices failed: " << errmsg << std::endl;
+		}
+	});
+}
+
+}
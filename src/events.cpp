@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <iostream>
+
+#include "events.h"
+
+namespace mynanoleaf {
+
+const std::chrono::milliseconds EventSubscription::INITIAL_BACKOFF(500);
+const std::chrono::milliseconds EventSubscription::MAX_BACKOFF(30000);
+
+void ServerSentEventParser::reset() {
+	line.clear();
+	id.clear();
+	data.clear();
+	have_data = false;
+	skip_lf = false;
+}
+
+void ServerSentEventParser::feed(const char *p, size_t n) {
+	const char *end = p + n;
+	while (p < end) {
+		if (skip_lf) {
+			skip_lf = false;
+			if (*p == '\n') {
+				p++;
+				continue;
+			}
+		}
+		const char *eol = p;
+		while (eol < end && *eol != '\n' && *eol != '\r') {
+			eol++;
+		}
+		line.append(p, eol - p);
+		if (eol == end) {
+			return;
+		}
+		// Lines may end in CR, LF or CRLF
+		skip_lf = (*eol == '\r');
+		p = eol + 1;
+		process_line();
+		line.clear();
+	}
+}
+
+void ServerSentEventParser::process_line() {
+	if (line.empty()) {
+		if (have_data) {
+			handler(id, data);
+		}
+		data.clear();
+		have_data = false;
+		return;
+	}
+	if (line[0] == ':') {
+		// Comment
+		return;
+	}
+	size_t colon = line.find(':');
+	size_t value_start = (colon == std::string::npos) ? line.size() : colon + 1;
+	if (value_start < line.size() && line[value_start] == ' ') {
+		value_start++;
+	}
+	size_t name_len = (colon == std::string::npos) ? line.size() : colon;
+	if (0 == line.compare(0, name_len, "data")) {
+		if (have_data) {
+			data += '\n';
+		}
+		data.append(line, value_start, std::string::npos);
+		have_data = true;
+	} else if (0 == line.compare(0, name_len, "id")) {
+		id.assign(line, value_start, std::string::npos);
+	}
+}
+
+EventSubscription::EventSubscription(
+	const std::string &hostname,
+	unsigned int port,
+	const std::string &path,
+	handler_t phandler,
+	uint16_t touch_events_port
+) :
+	curl(hostname, port),
+	multi(curl_multi_init()),
+	headers(NULL),
+	handler(phandler),
+	parser([this](const std::string &id, const std::string &data) { dispatch(id, data); }),
+	stopping(false),
+	connects(0),
+	events_received(0),
+	got_data(false)
+{
+	if (!multi) {
+		throw "curl_multi_init failed";
+	}
+	curl.set_path(path);
+	curl.setopt(CURLOPT_HTTPGET, 1L);
+	// Treat an error status as a dropped stream
+	curl.setopt(CURLOPT_FAILONERROR, 1L);
+	curl.setopt(CURLOPT_WRITEFUNCTION, write_callback);
+	curl.setopt(CURLOPT_WRITEDATA, this);
+	if (touch_events_port) {
+		headers = curl_slist_append(headers, ("TouchEventsPort: " + std::to_string(touch_events_port)).c_str());
+		curl.setopt(CURLOPT_HTTPHEADER, headers);
+	}
+	thread = std::thread(&EventSubscription::run, this);
+}
+
+EventSubscription::~EventSubscription() {
+	{
+		std::lock_guard<std::mutex> lock(wait_mutex);
+		stopping = true;
+	}
+	wait_cv.notify_all();
+	curl_multi_wakeup(multi);
+	thread.join();
+	curl_multi_cleanup(multi);
+	curl_slist_free_all(headers);
+}
+
+size_t EventSubscription::write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+	EventSubscription *sub = static_cast<EventSubscription *>(userdata);
+	sub->got_data = true;
+	sub->parser.feed(ptr, size * nmemb);
+	return size * nmemb;
+}
+
+void EventSubscription::dispatch(const std::string &id, const std::string &data) {
+	AuroraEvent event;
+	event.type = static_cast<EventType>(atoi(id.c_str()));
+	try {
+		json j = json::parse(data);
+		for (const json &e: j.at("events")) {
+			if (event.type == EVENT_TOUCH) {
+				event.panel_id = e.at("panelId").get<int>();
+				event.gesture = e.at("gesture").get<int>();
+			} else {
+				event.attr = e.at("attr").get<int>();
+				event.value = e.at("value");
+			}
+			events_received++;
+			handler(event);
+		}
+	} catch (const std::exception &e) {
+		std::cerr << "Ignoring malformed event: " << e.what() << std::endl;
+	} catch (...) {
+		// Nothing may be thrown back through curl
+		std::cerr << "Event handler failed" << std::endl;
+	}
+}
+
+void EventSubscription::stream_once() {
+	parser.reset();
+	got_data = false;
+	curl.prepare();
+	CURLMcode mres = curl_multi_add_handle(multi, curl);
+	if (mres != CURLM_OK) {
+		std::cerr << "Cannot subscribe to events: " << curl_multi_strerror(mres) << std::endl;
+		return;
+	}
+	connects++;
+	CURLcode res = CURLE_OK;
+	bool done = false;
+	while (!done && !stopping) {
+		int running;
+		curl_multi_perform(multi, &running);
+		CURLMsg *msg;
+		int queued;
+		while ((msg = curl_multi_info_read(multi, &queued))) {
+			if (msg->msg == CURLMSG_DONE) {
+				res = msg->data.result;
+				done = true;
+			}
+		}
+		if (!done) {
+			curl_multi_poll(multi, NULL, 0, 1000, NULL);
+		}
+	}
+	curl_multi_remove_handle(multi, curl);
+	if (done) {
+		try {
+			curl.finish(res);
+			std::cerr << "Event stream closed" << std::endl;
+		} catch (char const * const str) {
+			std::cerr << "Event stream failed: " << str << std::endl;
+		}
+	}
+}
+
+void EventSubscription::run() {
+	std::chrono::milliseconds backoff = INITIAL_BACKOFF;
+	while (!stopping) {
+		stream_once();
+		if (got_data) {
+			// It was working, so try again promptly
+			backoff = INITIAL_BACKOFF;
+		}
+		std::unique_lock<std::mutex> lock(wait_mutex);
+		wait_cv.wait_for(lock, backoff, [this]() { return stopping.load(); });
+		backoff = std::min(backoff * 2, MAX_BACKOFF);
+	}
+}
+
+}
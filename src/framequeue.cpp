@@ -0,0 +1,56 @@
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "framequeue.h"
+
+namespace mynanoleaf {
+
+FrameSender::FrameSender(IPStream &pstream) : stream(pstream), stopping(false) {
+	event_fd = eventfd(0, EFD_CLOEXEC);
+	if (event_fd < 0) {
+		throw std::string(strerror(errno));
+	}
+	thread = std::thread(&FrameSender::run, this);
+}
+
+FrameSender::~FrameSender() {
+	stopping.store(true, std::memory_order_release);
+	notify();
+	thread.join();
+	close(event_fd);
+}
+
+void FrameSender::notify() {
+	uint64_t one = 1;
+	ssize_t ret = write(event_fd, &one, sizeof(one));
+	if (ret < 0) {
+		std::cerr << "eventfd: " << strerror(errno) << std::endl;
+	}
+}
+
+void FrameSender::run() {
+	for (;;) {
+		uint64_t count;
+		ssize_t ret = read(event_fd, &count, sizeof(count));
+		if (ret < 0 && errno != EINTR) {
+			std::cerr << "eventfd: " << strerror(errno) << std::endl;
+			return;
+		}
+		try {
+			const std::vector<PanelCommand> *commands;
+			while ((commands = queue.consume()) != NULL) {
+				write_panel_commands(stream, *commands);
+			}
+		} catch (const std::string &sstr) {
+			std::cerr << "Frame sender exception: " << sstr << std::endl;
+		}
+		if (stopping.load(std::memory_order_acquire)) {
+			return;
+		}
+	}
+}
+
+}
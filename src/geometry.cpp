@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+#include "geometry.h"
+
+namespace mynanoleaf {
+
+// Panels sharing an edge have centroids one inradius apart each side of it;
+// the nearest panels sharing only a vertex are a whole side length apart.
+static const double EDGE_NEIGHBOUR_DISTANCE = 1.25 / std::sqrt(3.0);
+static const double EDGE_MATCH_TOLERANCE = 0.1;
+
+LayoutGeometry::LayoutGeometry(const Layout &layout)
+:
+	hash(hash_layout(layout)),
+	side_length(layout.side_length > 0 ? layout.side_length : 1)
+{
+	build_panels(layout);
+	build_grid();
+	build_adjacency();
+}
+
+uint64_t LayoutGeometry::hash_layout(const Layout &layout) {
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	auto mix = [&h](int v) {
+		for (unsigned int i = 0; i < sizeof(v); i++) {
+			h ^= static_cast<uint8_t>(static_cast<unsigned int>(v) >> (8 * i));
+			h *= 0x100000001b3ULL;
+		}
+	};
+	mix(layout.side_length);
+	mix(layout.positions.size());
+	for (auto &p: layout.positions) {
+		mix(p.id);
+		mix(p.x);
+		mix(p.y);
+		mix(p.o);
+	}
+	return h;
+}
+
+std::shared_ptr<const LayoutGeometry> LayoutGeometry::get(const Layout &layout) {
+	static std::mutex cache_mutex;
+	static std::unordered_map<uint64_t, std::weak_ptr<const LayoutGeometry> > cache;
+	uint64_t h = hash_layout(layout);
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	std::shared_ptr<const LayoutGeometry> ret = cache[h].lock();
+	if (!ret) {
+		ret = std::make_shared<const LayoutGeometry>(layout);
+		cache[h] = ret;
+	}
+	return ret;
+}
+
+int LayoutGeometry::index_of(int panel_id) const {
+	auto it = index_by_id.find(panel_id);
+	return (it == index_by_id.end()) ? -1 : static_cast<int>(it->second);
+}
+
+void LayoutGeometry::build_panels(const Layout &layout) {
+	// Circumradius of an equilateral triangle
+	double r = side_length / std::sqrt(3.0);
+	panels.resize(layout.positions.size());
+	for (size_t i = 0; i < layout.positions.size(); i++) {
+		const PanelPosition &pos = layout.positions[i];
+		PanelGeometry &pg = panels[i];
+		pg.id = pos.id;
+		pg.centroid.x = pos.x;
+		pg.centroid.y = pos.y;
+		// Counter-clockwise from the apex, which points up at o == 0
+		for (int k = 0; k < 3; k++) {
+			double a = (pos.o + 90 + 120 * k) * M_PI / 180.0;
+			pg.vertices[k].x = pos.x + r * std::cos(a);
+			pg.vertices[k].y = pos.y + r * std::sin(a);
+		}
+		index_by_id[pos.id] = i;
+	}
+}
+
+int LayoutGeometry::cell_col(double x) const {
+	return static_cast<int>(std::floor((x - grid_origin.x) / side_length));
+}
+
+int LayoutGeometry::cell_row(double y) const {
+	return static_cast<int>(std::floor((y - grid_origin.y) / side_length));
+}
+
+void LayoutGeometry::build_grid() {
+	grid_origin.x = grid_origin.y = 0;
+	grid_cols = grid_rows = 1;
+	if (panels.size()) {
+		double max_x = panels[0].centroid.x, max_y = panels[0].centroid.y;
+		grid_origin = panels[0].centroid;
+		for (auto &p: panels) {
+			grid_origin.x = std::min(grid_origin.x, p.centroid.x);
+			grid_origin.y = std::min(grid_origin.y, p.centroid.y);
+			max_x = std::max(max_x, p.centroid.x);
+			max_y = std::max(max_y, p.centroid.y);
+		}
+		grid_cols = cell_col(max_x) + 1;
+		grid_rows = cell_row(max_y) + 1;
+	}
+	// Counting sort of panels into cells
+	cell_offsets.assign(grid_cols * grid_rows + 1, 0);
+	for (auto &p: panels) {
+		cell_offsets[cell_row(p.centroid.y) * grid_cols + cell_col(p.centroid.x) + 1]++;
+	}
+	for (size_t c = 1; c < cell_offsets.size(); c++) {
+		cell_offsets[c] += cell_offsets[c - 1];
+	}
+	cell_panels.resize(panels.size());
+	std::vector<uint32_t> fill(cell_offsets.begin(), cell_offsets.end() - 1);
+	for (size_t i = 0; i < panels.size(); i++) {
+		int c = cell_row(panels[i].centroid.y) * grid_cols + cell_col(panels[i].centroid.x);
+		cell_panels[fill[c]++] = i;
+	}
+}
+
+template<typename F> void LayoutGeometry::for_each_in_cells(int col0, int row0, int col1, int row1, F f) const {
+	col0 = std::max(col0, 0);
+	row0 = std::max(row0, 0);
+	col1 = std::min(col1, grid_cols - 1);
+	row1 = std::min(row1, grid_rows - 1);
+	for (int row = row0; row <= row1; row++) {
+		for (int col = col0; col <= col1; col++) {
+			int c = row * grid_cols + col;
+			for (uint32_t k = cell_offsets[c]; k < cell_offsets[c + 1]; k++) {
+				f(cell_panels[k]);
+			}
+		}
+	}
+}
+
+static Point edge_midpoint(const PanelGeometry &pg, int k) {
+	const Point &a = pg.vertices[k];
+	const Point &b = pg.vertices[(k + 1) % 3];
+	return Point{(a.x + b.x) / 2, (a.y + b.y) / 2};
+}
+
+static bool share_edge(const PanelGeometry &a, const PanelGeometry &b, double tolerance) {
+	for (int i = 0; i < 3; i++) {
+		Point ma = edge_midpoint(a, i);
+		for (int j = 0; j < 3; j++) {
+			Point mb = edge_midpoint(b, j);
+			if (std::hypot(ma.x - mb.x, ma.y - mb.y) <= tolerance) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void LayoutGeometry::build_adjacency() {
+	adjacency_offsets.resize(panels.size() + 1);
+	adjacency.clear();
+	std::vector<uint32_t> candidates;
+	for (size_t i = 0; i < panels.size(); i++) {
+		adjacency_offsets[i] = adjacency.size();
+		candidates.clear();
+		within_radius(panels[i].centroid, EDGE_NEIGHBOUR_DISTANCE * side_length, candidates);
+		std::sort(candidates.begin(), candidates.end());
+		for (uint32_t j: candidates) {
+			if (j != i && share_edge(panels[i], panels[j], EDGE_MATCH_TOLERANCE * side_length)) {
+				adjacency.push_back(j);
+			}
+		}
+	}
+	adjacency_offsets[panels.size()] = adjacency.size();
+}
+
+void LayoutGeometry::within_radius(const Point &centre, double radius, std::vector<uint32_t> &result) const {
+	double r2 = radius * radius;
+	for_each_in_cells(
+		cell_col(centre.x - radius), cell_row(centre.y - radius),
+		cell_col(centre.x + radius), cell_row(centre.y + radius),
+		[&](uint32_t i) {
+			double dx = panels[i].centroid.x - centre.x;
+			double dy = panels[i].centroid.y - centre.y;
+			if (dx * dx + dy * dy <= r2) {
+				result.push_back(i);
+			}
+		}
+	);
+}
+
+/**
+ * Clips the ray origin + t * direction, for t in [t0, t1], to a
+ * counter-clockwise triangle. Returns false if nothing is left.
+ */
+static bool clip_to_triangle(const PanelGeometry &pg, const Point &origin, const Point &direction, double &t0, double &t1) {
+	for (int k = 0; k < 3; k++) {
+		const Point &a = pg.vertices[k];
+		const Point &b = pg.vertices[(k + 1) % 3];
+		// Outward normal of a counter-clockwise edge
+		double nx = b.y - a.y, ny = a.x - b.x;
+		double num = nx * (origin.x - a.x) + ny * (origin.y - a.y);
+		double den = nx * direction.x + ny * direction.y;
+		if (den == 0) {
+			if (num > 0) {
+				return false;
+			}
+		} else {
+			double t = -num / den;
+			if (den < 0) {
+				t0 = std::max(t0, t);
+			} else {
+				t1 = std::min(t1, t);
+			}
+			if (t0 > t1) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void LayoutGeometry::along_ray(
+	const Point &origin,
+	const Point &direction,
+	double max_distance,
+	std::vector<std::pair<double, uint32_t> > &result
+) const {
+	double len = std::hypot(direction.x, direction.y);
+	if (len == 0 || panels.empty()) {
+		return;
+	}
+	Point d{direction.x / len, direction.y / len};
+	// Clip to the grid, widened by a cell on each side
+	double t_begin = 0, t_end = max_distance;
+	double lo[2] = { grid_origin.x - side_length, grid_origin.y - side_length };
+	double hi[2] = { grid_origin.x + (grid_cols + 1) * side_length, grid_origin.y + (grid_rows + 1) * side_length };
+	double o[2] = { origin.x, origin.y };
+	double dv[2] = { d.x, d.y };
+	for (int axis = 0; axis < 2; axis++) {
+		if (dv[axis] == 0) {
+			if (o[axis] < lo[axis] || o[axis] > hi[axis]) {
+				return;
+			}
+		} else {
+			double ta = (lo[axis] - o[axis]) / dv[axis];
+			double tb = (hi[axis] - o[axis]) / dv[axis];
+			t_begin = std::max(t_begin, std::min(ta, tb));
+			t_end = std::min(t_end, std::max(ta, tb));
+		}
+	}
+	if (t_begin > t_end) {
+		return;
+	}
+	// Sample every half cell; a triangle reaches less than one cell from its
+	// centroid, so the 3x3 block around each sample covers every panel crossed.
+	std::vector<uint32_t> candidates;
+	int last_col = -1, last_row = -1;
+	for (double t = t_begin; ; t += side_length / 2) {
+		t = std::min(t, t_end);
+		int col = cell_col(origin.x + t * d.x);
+		int row = cell_row(origin.y + t * d.y);
+		if (col != last_col || row != last_row) {
+			for_each_in_cells(col - 1, row - 1, col + 1, row + 1, [&](uint32_t i) {
+				candidates.push_back(i);
+			});
+			last_col = col;
+			last_row = row;
+		}
+		if (t >= t_end) {
+			break;
+		}
+	}
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	size_t first = result.size();
+	for (uint32_t i: candidates) {
+		double t0 = 0, t1 = max_distance;
+		if (clip_to_triangle(panels[i], origin, d, t0, t1)) {
+			result.push_back(std::make_pair(t0, i));
+		}
+	}
+	std::sort(result.begin() + first, result.end());
+}
+
+}
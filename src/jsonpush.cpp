@@ -0,0 +1,331 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "jsonpush.h"
+
+namespace mynanoleaf {
+
+void JsonPushParser::reset() {
+	lex = LEX_NONE;
+	expect = EXPECT_VALUE;
+	containers.clear();
+	token.clear();
+	token_is_key = false;
+	unicode_digits = 0;
+	unicode_value = 0;
+	high_surrogate = 0;
+	literal = NULL;
+	literal_pos = 0;
+	offset = 0;
+	error = nullptr;
+}
+
+void JsonPushParser::syntax_error(const char *what) {
+	std::ostringstream msg;
+	msg << "JSON syntax error at byte " << offset << ": " << what;
+	throw msg.str();
+}
+
+void JsonPushParser::append_utf8(uint32_t cp) {
+	if (cp < 0x80) {
+		token += static_cast<char>(cp);
+	} else if (cp < 0x800) {
+		token += static_cast<char>(0xc0 | (cp >> 6));
+		token += static_cast<char>(0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+		token += static_cast<char>(0xe0 | (cp >> 12));
+		token += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+		token += static_cast<char>(0x80 | (cp & 0x3f));
+	} else {
+		token += static_cast<char>(0xf0 | (cp >> 18));
+		token += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+		token += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+		token += static_cast<char>(0x80 | (cp & 0x3f));
+	}
+}
+
+void JsonPushParser::flush_surrogate() {
+	if (high_surrogate) {
+		// Unpaired
+		append_utf8(0xfffd);
+		high_surrogate = 0;
+	}
+}
+
+void JsonPushParser::finish_unicode() {
+	uint32_t cp = unicode_value;
+	if (cp >= 0xd800 && cp < 0xdc00) {
+		flush_surrogate();
+		high_surrogate = cp;
+	} else if (cp >= 0xdc00 && cp < 0xe000) {
+		if (high_surrogate) {
+			append_utf8(0x10000 + ((high_surrogate - 0xd800) << 10) + (cp - 0xdc00));
+			high_surrogate = 0;
+		} else {
+			append_utf8(0xfffd);
+		}
+	} else {
+		flush_surrogate();
+		append_utf8(cp);
+	}
+}
+
+/**
+ * Consumes string content up to the next quote, escape or end of input,
+ * copying runs of plain characters at once. Returns the bytes consumed.
+ */
+size_t JsonPushParser::feed_string(const char *p, const char *end) {
+	const char *start = p;
+	while (p < end && *p != '"' && *p != '\\' && static_cast<unsigned char>(*p) >= 0x20) {
+		p++;
+	}
+	if (p > start) {
+		flush_surrogate();
+		token.append(start, p - start);
+	}
+	return p - start;
+}
+
+void JsonPushParser::finish_number() {
+	const char *s = token.c_str();
+	char *endp;
+	errno = 0;
+	if (token.find_first_of(".eE") == std::string::npos) {
+		long long v = strtoll(s, &endp, 10);
+		if (*endp == '\0' && errno == 0) {
+			lex = LEX_NONE;
+			value_done();
+			on_integer(v);
+			return;
+		}
+	}
+	errno = 0;
+	double d = strtod(s, &endp);
+	if (*endp != '\0' || token == "-" || errno == ERANGE) {
+		syntax_error("invalid number");
+	}
+	lex = LEX_NONE;
+	value_done();
+	on_real(d);
+}
+
+void JsonPushParser::start_value() {
+	if (expect != EXPECT_VALUE && expect != EXPECT_FIRST_VALUE) {
+		syntax_error("unexpected value");
+	}
+}
+
+void JsonPushParser::feed(const char *p, size_t n) {
+	const char *end = p + n;
+	while (p < end) {
+		char c = *p;
+		switch (lex) {
+		case LEX_STRING:
+			if (c == '"') {
+				flush_surrogate();
+				lex = LEX_NONE;
+				if (token_is_key) {
+					expect = EXPECT_COLON;
+					on_key(token);
+				} else {
+					value_done();
+					on_string(token);
+				}
+			} else if (c == '\\') {
+				lex = LEX_STRING_ESCAPE;
+			} else if (static_cast<unsigned char>(c) < 0x20) {
+				syntax_error("control character in string");
+			} else {
+				size_t used = feed_string(p, end);
+				p += used;
+				offset += used;
+				continue;
+			}
+			break;
+		case LEX_STRING_ESCAPE:
+			lex = LEX_STRING;
+			if (c == 'u') {
+				lex = LEX_STRING_UNICODE;
+				unicode_digits = 0;
+				unicode_value = 0;
+				break;
+			}
+			flush_surrogate();
+			switch (c) {
+			case '"': token += '"'; break;
+			case '\\': token += '\\'; break;
+			case '/': token += '/'; break;
+			case 'b': token += '\b'; break;
+			case 'f': token += '\f'; break;
+			case 'n': token += '\n'; break;
+			case 'r': token += '\r'; break;
+			case 't': token += '\t'; break;
+			default:
+				syntax_error("invalid escape");
+			}
+			break;
+		case LEX_STRING_UNICODE:
+			unicode_value <<= 4;
+			if (c >= '0' && c <= '9') {
+				unicode_value |= c - '0';
+			} else if (c >= 'a' && c <= 'f') {
+				unicode_value |= c - 'a' + 10;
+			} else if (c >= 'A' && c <= 'F') {
+				unicode_value |= c - 'A' + 10;
+			} else {
+				syntax_error("invalid unicode escape");
+			}
+			if (++unicode_digits == 4) {
+				finish_unicode();
+				lex = LEX_STRING;
+			}
+			break;
+		case LEX_NUMBER:
+			if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E') {
+				token += c;
+				break;
+			}
+			finish_number();
+			// Reprocess the terminating character
+			continue;
+		case LEX_LITERAL:
+			if (c != literal[literal_pos]) {
+				syntax_error("invalid literal");
+			}
+			if (literal[++literal_pos] == '\0') {
+				lex = LEX_NONE;
+				value_done();
+				if (literal[0] == 'n') {
+					on_null();
+				} else {
+					on_bool(literal[0] == 't');
+				}
+			}
+			break;
+		case LEX_NONE:
+			switch (c) {
+			case ' ':
+			case '\t':
+			case '\n':
+			case '\r': {
+				// Skip the whole run, which pretty-printed documents have plenty of
+				const char *start = p;
+				while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+					p++;
+				}
+				offset += p - start;
+				continue;
+			}
+			case '{':
+			case '[':
+				start_value();
+				containers.push_back(c);
+				if (c == '{') {
+					expect = EXPECT_FIRST_KEY;
+					on_start_object();
+				} else {
+					expect = EXPECT_FIRST_VALUE;
+					on_start_array();
+				}
+				break;
+			case '}':
+			case ']':
+				if (
+					containers.empty() ||
+					containers.back() != ((c == '}') ? '{' : '[') ||
+					(expect != EXPECT_COMMA_OR_END && expect != ((c == '}') ? EXPECT_FIRST_KEY : EXPECT_FIRST_VALUE))
+				) {
+					syntax_error("unexpected close");
+				}
+				containers.pop_back();
+				value_done();
+				if (c == '}') {
+					on_end_object();
+				} else {
+					on_end_array();
+				}
+				break;
+			case ',':
+				if (expect != EXPECT_COMMA_OR_END) {
+					syntax_error("unexpected ','");
+				}
+				expect = (containers.back() == '{') ? EXPECT_KEY : EXPECT_VALUE;
+				break;
+			case ':':
+				if (expect != EXPECT_COLON) {
+					syntax_error("unexpected ':'");
+				}
+				expect = EXPECT_VALUE;
+				break;
+			case '"':
+				if (expect == EXPECT_KEY || expect == EXPECT_FIRST_KEY) {
+					token_is_key = true;
+				} else {
+					start_value();
+					token_is_key = false;
+				}
+				token.clear();
+				lex = LEX_STRING;
+				break;
+			case 't':
+			case 'f':
+			case 'n':
+				start_value();
+				literal = (c == 't') ? "true" : (c == 'f') ? "false" : "null";
+				literal_pos = 1;
+				lex = LEX_LITERAL;
+				break;
+			default:
+				if (c == '-' || (c >= '0' && c <= '9')) {
+					start_value();
+					token.clear();
+					token += c;
+					lex = LEX_NUMBER;
+				} else {
+					syntax_error("unexpected character");
+				}
+				break;
+			}
+			break;
+		}
+		p++;
+		offset++;
+	}
+}
+
+void JsonPushParser::finish() {
+	rethrow_error();
+	if (lex == LEX_NUMBER) {
+		finish_number();
+	}
+	if (lex != LEX_NONE || expect != EXPECT_NOTHING) {
+		syntax_error("truncated document");
+	}
+}
+
+size_t JsonPushParser::write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+	JsonPushParser *parser = static_cast<JsonPushParser *>(userdata);
+	if (parser->error) {
+		return 0;
+	}
+	try {
+		parser->feed(ptr, size * nmemb);
+	} catch (...) {
+		// Exceptions must not pass through curl
+		parser->error = std::current_exception();
+		return 0;
+	}
+	return size * nmemb;
+}
+
+void JsonPushParser::rethrow_error() {
+	if (error) {
+		std::exception_ptr e = error;
+		error = nullptr;
+		std::rethrow_exception(e);
+	}
+}
+
+}
@@ -1,6 +1,11 @@
 #include <cstdlib>
 
 #include "aurora.h"
+#include "canvas.h"
+#include "discoverycache.h"
+#include "geometry.h"
+#include "pairing.h"
+#include "renderloop.h"
 
 #if 1
 #define AURORA_HOSTNAME "Nanoleaf-Light-Panels-53-3b-5d.local"
@@ -11,28 +16,121 @@
 #define AURORA_ID "74:A9:47:AD:62:C1"
 #endif
 
+#define FRAME_RATE 30
+#define RUN_SECONDS 10
+
+#if 0
+/* Play raw 24-bit RGB frames of this size from a file, or "-" for stdin */
+#define CANVAS_PATH "-"
+#define CANVAS_WIDTH 320
+#define CANVAS_HEIGHT 180
+#endif
+
+#ifdef CANVAS_PATH
+void play_canvas(mynanoleaf::Aurora &aurora, mynanoleaf::RenderLoop &loop) {
+	mynanoleaf::CanvasFormat format(CANVAS_WIDTH, CANVAS_HEIGHT);
+	mynanoleaf::PanelLayout layout;
+	std::shared_ptr<const mynanoleaf::CanvasSampler> sampler;
+	std::unique_ptr<mynanoleaf::CanvasSource> source = mynanoleaf::CanvasSource::open(CANVAS_PATH, format.frame_size());
+	mynanoleaf::RGBBuffer colours;
+	loop.run([&aurora, &format, &layout, &sampler, &source, &colours](uint64_t tick, std::vector<mynanoleaf::PanelCommand> &commands) {
+		// Picks up any new layout once a second, as the cached one ages
+		if (tick % FRAME_RATE == 0) {
+			layout = aurora.get_panel_layout();
+			sampler = mynanoleaf::CanvasSampler::get(layout, format);
+		}
+		const uint8_t *canvas = source->next();
+		if (!canvas) {
+			return false;
+		}
+		sampler->reduce(canvas, colours);
+		mynanoleaf::make_panel_commands(colours, layout.layout.positions, 1, commands);
+		return true;
+	});
+}
+#endif /* def CANVAS_PATH */
+
 void do_external_control(mynanoleaf::Aurora &aurora, mynanoleaf::IPStream &stream) {
-	std::vector<mynanoleaf::PanelCommand> commands;
+	mynanoleaf::RenderLoop loop(stream, FRAME_RATE);
+#ifdef CANVAS_PATH
+	play_canvas(aurora, loop);
+	loop.get_stats().report(std::cerr);
+	return;
+#endif /* def CANVAS_PATH */
+	// Touched panels flash white for a third of a second
+	mynanoleaf::TouchListener touch;
+	std::vector<int> ids;
 	for (auto &p: aurora.get_panel_positions()) {
-		std::vector<mynanoleaf::Frame> frames;
-		mynanoleaf::Frame *f = new mynanoleaf::Frame(0xa0, 0x52, 0x2d, 1);
-		frames.push_back(*f);
-		auto *pc = new mynanoleaf::PanelCommand(p.id, frames);
-		commands.push_back(*pc);
+		ids.push_back(p.id);
 	}
-	write_panel_commands(stream, commands);
+	touch.set_panel_ids(ids);
+	std::vector<unsigned int> flash(ids.size(), 0);
+	aurora.subscribe(mynanoleaf::Aurora::event_listener_t(), touch.get_port());
+	loop.set_touch_listener(&touch, [&flash](const std::vector<mynanoleaf::TouchEvent> &touches) {
+		for (auto &t: touches) {
+			if (t.panel_index >= 0 && t.type == mynanoleaf::TOUCH_DOWN) {
+				flash[t.panel_index] = FRAME_RATE / 3;
+			}
+		}
+	});
+	std::vector<mynanoleaf::PanelPosition> positions;
+	loop.run([&aurora, &flash, &positions](uint64_t tick, std::vector<mynanoleaf::PanelCommand> &commands) {
+		// Picks up any new layout once a second, as the cached one ages
+		if (tick % FRAME_RATE == 0) {
+			positions = aurora.get_panel_positions();
+		}
+		// Pulse once per second
+		unsigned int phase = tick % FRAME_RATE;
+		unsigned int level = 128 + 127 * (phase < FRAME_RATE / 2 ? phase : FRAME_RATE - phase) / (FRAME_RATE / 2);
+		commands.clear();
+		size_t i = 0;
+		for (auto &p: positions) {
+			std::vector<mynanoleaf::Frame> frames;
+			if (i < flash.size() && flash[i]) {
+				flash[i]--;
+				frames.push_back(mynanoleaf::Frame(0xff, 0xff, 0xff, 1));
+			} else {
+				frames.push_back(mynanoleaf::Frame(0xa0 * level / 255, 0x52 * level / 255, 0x2d * level / 255, 1));
+			}
+			commands.push_back(mynanoleaf::PanelCommand(p.id, frames));
+			i++;
+		}
+		return tick < FRAME_RATE * RUN_SECONDS;
+	});
+	aurora.unsubscribe();
+	loop.get_stats().report(std::cerr);
 }
 
 #if 1
 #define CATCH_EXCEPTIONS
 #endif
 
-void try_to_manipulate_aurora(mynanoleaf::Aurora &aurora) {
+/**
+ * Reports an error from an asynchronous request, returning true if there
+ * was one.
+ */
+bool failed(std::exception_ptr error) {
+	if (!error) {
+		return false;
+	}
+#ifdef CATCH_EXCEPTIONS
+	try {
+#endif /* CATCH_EXCEPTIONS */
+		std::rethrow_exception(error);
+#ifdef CATCH_EXCEPTIONS
+	} catch (char const * const str) {
+		std::cerr << "Aurora exception: " << str << std::endl;
+	} catch (const std::string &sstr) {
+		std::cerr << "Aurora exception: " << sstr << std::endl;
+	}
+#endif /* CATCH_EXCEPTIONS */
+	return true;
+}
+
+void try_to_manipulate_aurora(mynanoleaf::Aurora &aurora, mynanoleaf::IPStream &sock) {
 #ifdef CATCH_EXCEPTIONS
 	try {
 #endif /* CATCH_EXCEPTIONS */
-		aurora.get_info();
-		mynanoleaf::IPStream &sock = aurora.external_control();
 		do_external_control(aurora, sock);
 #ifdef CATCH_EXCEPTIONS
 	} catch (char const * const str) {
@@ -51,6 +149,7 @@ main(int argc, char *argv[])
 		throw curl_easy_strerror(res);
 	}
 
+	mynanoleaf::DiscoveryCache cache;
 #if defined(AURORA_HOSTNAME)
 	new mynanoleaf::Aurora(AURORA_HOSTNAME);
 #else /* ndef AURORA_HOSTNAME */
@@ -61,11 +160,36 @@ main(int argc, char *argv[])
 #else /* ndef AURORA_ID */
 	wanted_id_p = NULL;
 #endif /* AURORA_ID */
-	mynanoleaf::Aurora::discover(wanted_id_p);
+	mynanoleaf::Aurora::discover(wanted_id_p, cache);
 #endif /* ndef AURORA_HOSTNAME */
+	// Pair with and set up all devices concurrently from this thread
+	mynanoleaf::RequestEngine engine;
+	mynanoleaf::PairingManager pairing(engine);
+	std::vector<std::pair<mynanoleaf::Aurora *, mynanoleaf::IPStream *> > ready;
 	for (mynanoleaf::Aurora *aurora: mynanoleaf::Aurora::get_instances()) {
-		try_to_manipulate_aurora(*aurora);
+		pairing.add(*aurora, [aurora, &engine, &ready, &cache](mynanoleaf::Aurora &, std::exception_ptr error) {
+			if (failed(error)) {
+				return;
+			}
+			aurora->get_info(engine, [aurora, &engine, &ready, &cache](std::exception_ptr error) {
+				if (failed(error)) {
+					return;
+				}
+				cache.set_layout_hash(aurora->get_credential_key(), mynanoleaf::LayoutGeometry::hash_layout(aurora->get_panel_layout().layout));
+				aurora->external_control(engine, [aurora, &ready](mynanoleaf::IPStream *sock, std::exception_ptr error) {
+					if (!failed(error)) {
+						ready.push_back(std::make_pair(aurora, sock));
+					}
+				});
+			});
+		});
+	}
+	engine.run();
+	for (auto &r: ready) {
+		try_to_manipulate_aurora(*r.first, *r.second);
 	}
+	// The revalidation may still refer to the devices
+	cache.wait();
 	for (mynanoleaf::Aurora *aurora: mynanoleaf::Aurora::get_instances()) {
 		delete aurora;
 	}
@@ -0,0 +1,512 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <set>
+
+#include "mdns.h"
+
+namespace mynanoleaf {
+
+const std::chrono::milliseconds MDNSQuerier::FIRST_RETRY(250);
+const std::chrono::milliseconds MDNSQuerier::QUIET_PERIOD(1000);
+
+/** Enough for any chain of compression pointers in one datagram. */
+static const unsigned int MAX_NAME_JUMPS = 64;
+
+static std::string fold_case(const std::string &name) {
+	std::string folded(name);
+	for (auto &c: folded) {
+		if (c >= 'A' && c <= 'Z') {
+			c = c - 'A' + 'a';
+		}
+	}
+	return folded;
+}
+
+static uint16_t get16(const uint8_t *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return (static_cast<uint32_t>(get16(p)) << 16) | get16(p + 2);
+}
+
+static void put16(std::vector<uint8_t> &out, uint16_t v) {
+	out.push_back(v >> 8);
+	out.push_back(v & 0xff);
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t v) {
+	put16(out, v >> 16);
+	put16(out, v & 0xffff);
+}
+
+static std::string read_name(const uint8_t *data, size_t size, size_t &offset) {
+	std::string name;
+	size_t pos = offset;
+	bool jumped = false;
+	for (unsigned int jumps = 0; ; ) {
+		if (pos >= size) {
+			throw std::string("DNS name runs past end of message");
+		}
+		uint8_t len = data[pos];
+		if ((len & 0xc0) == 0xc0) {
+			if (pos + 1 >= size || ++jumps > MAX_NAME_JUMPS) {
+				throw std::string("Bad DNS name compression");
+			}
+			if (!jumped) {
+				offset = pos + 2;
+				jumped = true;
+			}
+			pos = ((len & 0x3f) << 8) | data[pos + 1];
+			continue;
+		}
+		if (len & 0xc0) {
+			throw std::string("Unknown DNS label type");
+		}
+		if (len == 0) {
+			if (!jumped) {
+				offset = pos + 1;
+			}
+			return name;
+		}
+		if (pos + 1 + len > size) {
+			throw std::string("DNS label runs past end of message");
+		}
+		if (!name.empty()) {
+			name += '.';
+		}
+		for (size_t i = pos + 1; i < pos + 1 + len; i++) {
+			char c = static_cast<char>(data[i]);
+			if (c == '.' || c == '\\') {
+				name += '\\';
+			}
+			name += c;
+		}
+		pos += 1 + len;
+	}
+}
+
+static void write_name(std::vector<uint8_t> &out, const std::string &name) {
+	std::string label;
+	for (size_t i = 0; i <= name.size(); i++) {
+		if (i == name.size() || name[i] == '.') {
+			if (label.empty() || label.size() > 63) {
+				if (label.empty() && name.empty()) {
+					break;
+				}
+				throw std::string("Bad DNS name '") + name + "'";
+			}
+			out.push_back(label.size());
+			out.insert(out.end(), label.begin(), label.end());
+			label.clear();
+		} else if (name[i] == '\\' && i + 1 < name.size()) {
+			label += name[++i];
+		} else {
+			label += name[i];
+		}
+	}
+	out.push_back(0);
+}
+
+std::string DNSRecord::get_txt(const std::string &key) const {
+	for (auto &s: txt) {
+		if (s.size() > key.size() && s[key.size()] == '=' && DNSMessage::same_name(s.substr(0, key.size()), key)) {
+			return s.substr(key.size() + 1);
+		}
+	}
+	return "";
+}
+
+bool DNSMessage::same_name(const std::string &a, const std::string &b) {
+	return a.size() == b.size() && fold_case(a) == fold_case(b);
+}
+
+void DNSMessage::parse(const uint8_t *data, size_t size) {
+	if (size < 12) {
+		throw std::string("DNS message too short");
+	}
+	id = get16(data);
+	flags = get16(data + 2);
+	unsigned int qdcount = get16(data + 4);
+	unsigned int rrcount = get16(data + 6) + get16(data + 8) + get16(data + 10);
+	size_t offset = 12;
+	questions.clear();
+	records.clear();
+	for (unsigned int i = 0; i < qdcount; i++) {
+		DNSQuestion q;
+		q.name = read_name(data, size, offset);
+		if (offset + 4 > size) {
+			throw std::string("DNS question runs past end of message");
+		}
+		q.type = get16(data + offset);
+		offset += 4;
+		questions.push_back(q);
+	}
+	for (unsigned int i = 0; i < rrcount; i++) {
+		DNSRecord r;
+		r.name = read_name(data, size, offset);
+		if (offset + 10 > size) {
+			throw std::string("DNS record runs past end of message");
+		}
+		r.type = get16(data + offset);
+		uint16_t rclass = get16(data + offset + 2) & MDNS_CLASS_MASK;
+		r.ttl = get32(data + offset + 4);
+		size_t rdlength = get16(data + offset + 8);
+		offset += 10;
+		size_t end = offset + rdlength;
+		if (end > size) {
+			throw std::string("DNS record data runs past end of message");
+		}
+		if (rclass != DNS_CLASS_IN) {
+			offset = end;
+			continue;
+		}
+		char a[INET6_ADDRSTRLEN];
+		size_t rdata = offset;
+		switch (r.type) {
+		case DNS_TYPE_A:
+			if (rdlength != 4 || !inet_ntop(AF_INET, data + offset, a, sizeof(a))) {
+				throw std::string("Bad A record");
+			}
+			r.address = a;
+			break;
+		case DNS_TYPE_AAAA:
+			if (rdlength != 16 || !inet_ntop(AF_INET6, data + offset, a, sizeof(a))) {
+				throw std::string("Bad AAAA record");
+			}
+			r.address = a;
+			break;
+		case DNS_TYPE_PTR:
+			r.target = read_name(data, end, rdata);
+			break;
+		case DNS_TYPE_SRV:
+			if (rdlength < 7) {
+				throw std::string("Bad SRV record");
+			}
+			// Priority and weight do not matter on a link
+			r.port = get16(data + offset + 4);
+			rdata += 6;
+			r.target = read_name(data, end, rdata);
+			break;
+		case DNS_TYPE_TXT:
+			while (rdata < end) {
+				size_t len = data[rdata++];
+				if (rdata + len > end) {
+					throw std::string("Bad TXT record");
+				}
+				if (len) {
+					r.txt.push_back(std::string(reinterpret_cast<const char *>(data + rdata), len));
+				}
+				rdata += len;
+			}
+			break;
+		default:
+			offset = end;
+			continue;
+		}
+		offset = end;
+		records.push_back(r);
+	}
+}
+
+void DNSMessage::encode(std::vector<uint8_t> &out) const {
+	out.clear();
+	put16(out, id);
+	put16(out, flags);
+	put16(out, questions.size());
+	put16(out, records.size());
+	put16(out, 0);
+	put16(out, 0);
+	for (auto &q: questions) {
+		write_name(out, q.name);
+		put16(out, q.type);
+		put16(out, DNS_CLASS_IN);
+	}
+	for (auto &r: records) {
+		write_name(out, r.name);
+		put16(out, r.type);
+		put16(out, DNS_CLASS_IN);
+		put32(out, r.ttl);
+		size_t rdlength_at = out.size();
+		put16(out, 0);
+		uint8_t addr[16];
+		switch (r.type) {
+		case DNS_TYPE_A:
+			if (inet_pton(AF_INET, r.address.c_str(), addr) != 1) {
+				throw std::string("Bad IPv4 address '") + r.address + "'";
+			}
+			out.insert(out.end(), addr, addr + 4);
+			break;
+		case DNS_TYPE_AAAA:
+			if (inet_pton(AF_INET6, r.address.c_str(), addr) != 1) {
+				throw std::string("Bad IPv6 address '") + r.address + "'";
+			}
+			out.insert(out.end(), addr, addr + 16);
+			break;
+		case DNS_TYPE_PTR:
+			write_name(out, r.target);
+			break;
+		case DNS_TYPE_SRV:
+			put16(out, 0);
+			put16(out, 0);
+			put16(out, r.port);
+			write_name(out, r.target);
+			break;
+		case DNS_TYPE_TXT:
+			for (auto &s: r.txt) {
+				if (s.size() > 255) {
+					throw std::string("TXT string too long");
+				}
+				out.push_back(s.size());
+				out.insert(out.end(), s.begin(), s.end());
+			}
+			if (r.txt.empty()) {
+				// An empty TXT record still holds one empty string
+				out.push_back(0);
+			}
+			break;
+		default:
+			throw std::string("Cannot encode DNS record type ") + std::to_string(r.type);
+		}
+		size_t rdlength = out.size() - rdlength_at - 2;
+		out[rdlength_at] = rdlength >> 8;
+		out[rdlength_at + 1] = rdlength & 0xff;
+	}
+}
+
+MDNSQuerier::MDNSQuerier(
+	const std::string &pgroup,
+	uint16_t pport,
+	const std::string &pinterface_address
+) :
+	group(pgroup),
+	port(pport),
+	interface_address(pinterface_address),
+	fd(-1),
+	next_id(1),
+	queries_sent(0),
+	responses_received(0)
+{
+	struct in_addr addr;
+	if (inet_pton(AF_INET, group.c_str(), &addr) != 1) {
+		throw std::string("Bad mDNS group address '") + group + "'";
+	}
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::string(strerror(errno));
+	}
+	// Link-local: responders discard anything that has been routed
+	unsigned char ttl = 255, loop = 1;
+	if (
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+		setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+	) {
+		std::string errmsg(strerror(errno));
+		close(fd);
+		throw errmsg;
+	}
+	if (!interface_address.empty()) {
+		if (inet_pton(AF_INET, interface_address.c_str(), &addr) != 1) {
+			close(fd);
+			throw std::string("Bad interface address '") + interface_address + "'";
+		}
+		if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &addr, sizeof(addr)) < 0) {
+			std::string errmsg(strerror(errno));
+			close(fd);
+			throw errmsg;
+		}
+	}
+}
+
+MDNSQuerier::~MDNSQuerier() {
+	close(fd);
+}
+
+void MDNSQuerier::send(const std::vector<DNSQuestion> &questions) {
+	DNSMessage query;
+	query.id = next_id++;
+	query.questions = questions;
+	std::vector<uint8_t> buf;
+	query.encode(buf);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	inet_pton(AF_INET, group.c_str(), &addr.sin_addr);
+	addr.sin_port = htons(port);
+	if (sendto(fd, buf.data(), buf.size(), 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+		throw std::string("mDNS query: ") + strerror(errno);
+	}
+	queries_sent++;
+}
+
+bool MDNSQuerier::receive(
+	const std::string &service_name,
+	std::map<std::string, Instance> &instances,
+	std::map<std::string, std::string> &addresses
+) {
+	bool learnt = false;
+	uint8_t buf[9000];
+	for (;;) {
+		ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				std::cerr << "mDNS receive: " << strerror(errno) << std::endl;
+			}
+			return learnt;
+		}
+		DNSMessage response;
+		try {
+			response.parse(buf, n);
+		} catch (const std::string &errmsg) {
+#ifndef NDEBUG
+			std::cerr << "Ignoring mDNS response: " << errmsg << std::endl;
+#endif /* ndef NDEBUG */
+			continue;
+		}
+		if (!(response.flags & DNS_FLAG_RESPONSE)) {
+			continue;
+		}
+		responses_received++;
+		// The instances first, since their other records may come before them
+		for (auto &r: response.records) {
+			if (r.type == DNS_TYPE_PTR && r.ttl > 0 && DNSMessage::same_name(r.name, service_name)) {
+				auto added = instances.insert(std::make_pair(fold_case(r.target), Instance()));
+				if (added.second) {
+					added.first->second.service.name = r.target;
+					learnt = true;
+				}
+			}
+		}
+		for (auto &r: response.records) {
+			if (r.type == DNS_TYPE_A || r.type == DNS_TYPE_AAAA) {
+				std::string &address = addresses[fold_case(r.name)];
+				if (address.empty() || (r.type == DNS_TYPE_A && address.find(':') != std::string::npos)) {
+					address = r.address;
+					learnt = true;
+				}
+				continue;
+			}
+			if (r.type != DNS_TYPE_SRV && r.type != DNS_TYPE_TXT) {
+				continue;
+			}
+			auto it = instances.find(fold_case(r.name));
+			if (it == instances.end()) {
+				continue;
+			}
+			Instance &instance = it->second;
+			if (r.type == DNS_TYPE_SRV && !instance.has_srv) {
+				instance.has_srv = true;
+				instance.service.hostname = r.target;
+				instance.service.port = r.port;
+				learnt = true;
+			} else if (r.type == DNS_TYPE_TXT && !instance.has_txt) {
+				instance.has_txt = true;
+				instance.service.id = r.get_txt("id");
+				learnt = true;
+			}
+		}
+	}
+}
+
+void MDNSQuerier::query(
+	const std::string &service_type,
+	found_t found,
+	std::chrono::milliseconds timeout
+) {
+	static const std::string domain(".local");
+	std::string service_name(service_type);
+	if (service_name.size() < domain.size() || !DNSMessage::same_name(service_name.substr(service_name.size() - domain.size()), domain)) {
+		service_name += domain;
+	}
+	std::map<std::string, Instance> instances;
+	std::map<std::string, std::string> addresses;
+	// Those already asked, so that anything newly missing is asked about at once
+	std::set<std::pair<std::string, uint16_t> > asked;
+	auto start = std::chrono::steady_clock::now();
+	auto deadline = start + timeout;
+	auto last_learnt = start;
+	auto next_send = start;
+	std::chrono::milliseconds retry(FIRST_RETRY);
+	for (;;) {
+		auto now = std::chrono::steady_clock::now();
+		std::vector<DNSQuestion> missing;
+		for (auto &i: instances) {
+			const Instance &instance = i.second;
+			if (instance.reported) {
+				continue;
+			}
+			if (!instance.has_srv) {
+				missing.push_back(DNSQuestion{instance.service.name, DNS_TYPE_SRV});
+			} else if (!addresses.count(fold_case(instance.service.hostname))) {
+				missing.push_back(DNSQuestion{instance.service.hostname, DNS_TYPE_A});
+			}
+			if (!instance.has_txt) {
+				missing.push_back(DNSQuestion{instance.service.name, DNS_TYPE_TXT});
+			}
+		}
+		std::vector<DNSQuestion> questions;
+		bool retrying = (now >= next_send);
+		if (retrying) {
+			questions.push_back(DNSQuestion{service_name, DNS_TYPE_PTR});
+			next_send = now + retry;
+			retry *= 2;
+		}
+		for (auto &q: missing) {
+			if (asked.insert(std::make_pair(fold_case(q.name), q.type)).second || retrying) {
+				questions.push_back(q);
+			}
+		}
+		if (!questions.empty()) {
+			send(questions);
+		}
+		if (now >= deadline) {
+			if (!missing.empty()) {
+				std::cerr << "mDNS query timed out with services unresolved" << std::endl;
+			}
+			return;
+		}
+		auto quiet_until = last_learnt + QUIET_PERIOD;
+		if (missing.empty() && now >= quiet_until) {
+			return;
+		}
+		auto until = std::min(deadline, next_send);
+		if (missing.empty()) {
+			until = std::min(until, quiet_until);
+		}
+		struct pollfd pfd = {fd, POLLIN, 0};
+		int wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count() + 1;
+		if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR) {
+			throw std::string("mDNS poll: ") + strerror(errno);
+		}
+		if (!(pfd.revents & POLLIN) || !receive(service_name, instances, addresses)) {
+			continue;
+		}
+		last_learnt = std::chrono::steady_clock::now();
+		for (auto &i: instances) {
+			Instance &instance = i.second;
+			if (instance.reported || !instance.has_srv || !instance.has_txt) {
+				continue;
+			}
+			auto address = addresses.find(fold_case(instance.service.hostname));
+			if (address == addresses.end()) {
+				continue;
+			}
+			instance.reported = true;
+			instance.service.address = address->second;
+			if (!found(instance.service)) {
+				return;
+			}
+		}
+	}
+}
+
+}
@@ -0,0 +1,48 @@
+#include <csignal>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+
+#include "mockcontroller.h"
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void on_signal(int) {
+	interrupted = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *info_path = (argc > 1) ? argv[1] : "example-responses/controller-info.json";
+	uint16_t port = (argc > 2) ? strtoul(argv[2], NULL, 0) : 16021;
+	const char *protocol = (argc > 3) ? argv[3] : "udp";
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	try {
+		mynanoleaf::MockController mock(info_path, port, protocol);
+		if (argc > 4) {
+			// Answers mDNS on the loopback interface, as the device with this ID
+			mock.advertise(argv[4]);
+		}
+		std::cerr << "Serving " << info_path << " on 127.0.0.1:" << mock.get_http_port() <<
+			", auth token " << mock.get_token() <<
+			", " << protocol << " stream port " << mock.get_stream_port() << std::endl;
+		uint64_t last_packets = 0;
+		while (!interrupted) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			uint64_t packets = mock.get_packets_received();
+			std::cerr << "Requests: " << mock.get_requests_served() <<
+				", packets: " << packets << " (" << packets - last_packets << "/s)" <<
+				", bytes: " << mock.get_bytes_received() << std::endl;
+			last_packets = packets;
+		}
+	} catch (char const * const str) {
+		std::cerr << "Mock controller exception: " << str << std::endl;
+		return EXIT_FAILURE;
+	} catch (const std::string &sstr) {
+		std::cerr << "Mock controller exception: " << sstr << std::endl;
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,658 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+#include <fstream>
+#include <sstream>
+
+#include "mockcontroller.h"
+
+namespace mynanoleaf {
+
+static const char *MOCK_API_PREFIX = "/api/v1/";
+static const char *MOCK_TOKEN = "MockControllerAuthToken00000000";
+static const char *MOCK_SERVICE_NAME = "_nanoleafapi._tcp.local";
+/** The most a legacy unicast answer may say to cache it for. */
+static const uint32_t MOCK_MDNS_TTL = 10;
+/** Where the controller takes version 2 frames, whatever it was asked. */
+static const uint16_t MOCK_V2_STREAM_PORT = 60222;
+
+static int bind_loopback(int sock_type, uint16_t port, uint16_t &bound_port) {
+	int fd = socket(AF_INET, sock_type | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::string(strerror(errno));
+	}
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	socklen_t len = sizeof(addr);
+	if (
+		bind(fd, reinterpret_cast<sockaddr *>(&addr), len) < 0 ||
+		(sock_type == SOCK_STREAM && listen(fd, 16) < 0) ||
+		getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0
+	) {
+		std::string errmsg(strerror(errno));
+		close(fd);
+		throw errmsg;
+	}
+	bound_port = ntohs(addr.sin_port);
+	return fd;
+}
+
+MockController::MockController(
+	const std::string &info_path,
+	uint16_t phttp_port,
+	const std::string &pstream_protocol
+) :
+	token(MOCK_TOKEN),
+	stream_protocol(pstream_protocol),
+	stream_version(PROTOCOL_V1),
+	http_fd(-1),
+	stream_fd(-1),
+	stream_conn_fd(-1),
+	wake_fd(-1),
+	dropping_events(false),
+	touch_fd(-1),
+	touch_events_port(0),
+	pairing_open(true),
+	mdns_fd(-1),
+	stopping(false),
+	requests_served(0),
+	packets_received(0),
+	bytes_received(0)
+{
+	std::ifstream fs(info_path);
+	if (!fs) {
+		throw std::string("Cannot open ") + info_path;
+	}
+	info = json::parse(fs);
+	if (stream_protocol != "udp" && stream_protocol != "tcp") {
+		throw std::string("Unrecognised protocol '") + stream_protocol + "'";
+	}
+	http_fd = bind_loopback(SOCK_STREAM, phttp_port, http_port);
+	stream_fd = bind_loopback((stream_protocol == "udp") ? SOCK_DGRAM : SOCK_STREAM, 0, stream_port);
+	touch_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (touch_fd < 0) {
+		throw std::string(strerror(errno));
+	}
+	wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd < 0) {
+		throw std::string(strerror(errno));
+	}
+	thread = std::thread(&MockController::run, this);
+}
+
+MockController::~MockController() {
+	stopping = true;
+	wake();
+	thread.join();
+	for (auto &c: connections) {
+		close(c.first);
+	}
+	if (stream_conn_fd >= 0) {
+		close(stream_conn_fd);
+	}
+	close(stream_fd);
+	close(http_fd);
+	close(touch_fd);
+	close(wake_fd);
+	if (mdns_fd >= 0) {
+		close(mdns_fd);
+	}
+}
+
+bool MockController::listen_v2_stream() {
+	if (stream_port == MOCK_V2_STREAM_PORT) {
+		return true;
+	}
+	int fd;
+	uint16_t port;
+	try {
+		fd = bind_loopback(SOCK_DGRAM, MOCK_V2_STREAM_PORT, port);
+	} catch (const std::string &errmsg) {
+		std::cerr << "Mock controller cannot listen on port " << MOCK_V2_STREAM_PORT << ": " << errmsg << std::endl;
+		return false;
+	}
+	// Only the mock's own thread polls the stream socket, and this runs on it
+	close(stream_fd);
+	stream_fd = fd;
+	stream_port = port;
+	return true;
+}
+
+void MockController::advertise(const std::string &id, uint16_t port, const std::string &group) {
+	if (mdns_fd >= 0) {
+		throw std::string("Already advertising");
+	}
+	struct ip_mreq mreq;
+	memset(&mreq, 0, sizeof(mreq));
+	if (inet_pton(AF_INET, group.c_str(), &mreq.imr_multiaddr) != 1) {
+		throw std::string("Bad mDNS group address '") + group + "'";
+	}
+	mreq.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::string(strerror(errno));
+	}
+	int one = 1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0 ||
+		bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+		setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0
+	) {
+		std::string errmsg(strerror(errno));
+		close(fd);
+		throw errmsg;
+	}
+	mdns_id = id;
+	mdns_fd = fd;
+	wake();
+}
+
+void MockController::wake() {
+	uint64_t one = 1;
+	if (::write(wake_fd, &one, sizeof(one)) < 0) {
+		std::cerr << "eventfd: " << strerror(errno) << std::endl;
+	}
+}
+
+void MockController::queue_event(int type, const json &events) {
+	std::ostringstream out;
+	out << "id: " << type << "\n" << "data: " << json{{"events", events}}.dump() << "\n\n";
+	std::lock_guard<std::mutex> lock(event_mutex);
+	pending_events.push_back(std::make_pair(type, out.str()));
+}
+
+void MockController::push_event(int type, const json &events) {
+	queue_event(type, events);
+	wake();
+}
+
+bool MockController::push_touch(const std::vector<TouchEvent> &touches) {
+	uint16_t port = touch_events_port;
+	if (!port) {
+		return false;
+	}
+	std::lock_guard<std::mutex> lock(event_mutex);
+	write_touch_events(touches, touch_buf);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (sendto(touch_fd, touch_buf.data(), touch_buf.size(), 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+		throw std::string(strerror(errno));
+	}
+	return true;
+}
+
+void MockController::drop_event_streams() {
+	dropping_events = true;
+	wake();
+}
+
+/**
+ * Passes queued events on to the subscribed connections, or closes them
+ * if asked to.
+ */
+void MockController::send_events() {
+	std::vector<std::pair<int, std::string> > events;
+	{
+		std::lock_guard<std::mutex> lock(event_mutex);
+		std::swap(events, pending_events);
+	}
+	bool drop = dropping_events.exchange(false);
+	for (auto it = connections.begin(); it != connections.end(); ) {
+		Connection &conn = it->second;
+		if (conn.event_types.empty()) {
+			++it;
+			continue;
+		}
+		if (drop) {
+			close(it->first);
+			it = connections.erase(it);
+			continue;
+		}
+		for (auto &e: events) {
+			if (std::find(conn.event_types.begin(), conn.event_types.end(), e.first) != conn.event_types.end()) {
+				conn.out += e.second;
+			}
+		}
+		++it;
+	}
+}
+
+void MockController::run() {
+	std::vector<struct pollfd> fds;
+	while (!stopping) {
+		fds.clear();
+		fds.push_back(pollfd{wake_fd, POLLIN, 0});
+		fds.push_back(pollfd{http_fd, POLLIN, 0});
+		fds.push_back(pollfd{stream_fd, POLLIN, 0});
+		if (stream_conn_fd >= 0) {
+			fds.push_back(pollfd{stream_conn_fd, POLLIN, 0});
+		}
+		if (mdns_fd >= 0) {
+			fds.push_back(pollfd{mdns_fd, POLLIN, 0});
+		}
+		for (auto &c: connections) {
+			fds.push_back(pollfd{c.first, static_cast<short>(POLLIN | (c.second.out.empty() ? 0 : POLLOUT)), 0});
+		}
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::cerr << "poll: " << strerror(errno) << std::endl;
+			return;
+		}
+		for (auto &pfd: fds) {
+			if (!pfd.revents) {
+				continue;
+			}
+			if (pfd.fd == wake_fd) {
+				uint64_t count;
+				if (::read(wake_fd, &count, sizeof(count)) < 0) {
+					std::cerr << "eventfd: " << strerror(errno) << std::endl;
+				}
+				continue;
+			} else if (pfd.fd == http_fd) {
+				accept_http();
+			} else if (pfd.fd == stream_fd && stream_protocol == "tcp") {
+				int fd = accept4(stream_fd, NULL, NULL, SOCK_CLOEXEC);
+				if (fd >= 0) {
+					if (stream_conn_fd >= 0) {
+						close(stream_conn_fd);
+					}
+					stream_conn_fd = fd;
+					stream_buf.clear();
+				}
+			} else if (pfd.fd == stream_fd || pfd.fd == stream_conn_fd) {
+				read_stream();
+			} else if (pfd.fd == mdns_fd) {
+				answer_mdns();
+			} else {
+				auto it = connections.find(pfd.fd);
+				if (it != connections.end() && !read_http(pfd.fd, it->second)) {
+					close(pfd.fd);
+					connections.erase(it);
+				}
+			}
+		}
+		send_events();
+	}
+}
+
+void MockController::accept_http() {
+	int fd = accept4(http_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		std::cerr << "accept: " << strerror(errno) << std::endl;
+		return;
+	}
+	connections[fd];
+}
+
+/**
+ * Services one readiness event on an HTTP connection. Returns false
+ * once the connection should be closed.
+ */
+bool MockController::read_http(int fd, Connection &conn) {
+	char buf[4096];
+	ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n == 0) {
+		return false;
+	} else if (n > 0) {
+		conn.in.append(buf, n);
+	} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		return false;
+	}
+	// An /events stream takes over its connection
+	while (!conn.close_after && conn.event_types.empty() && handle_request(conn)) {
+	}
+	while (!conn.out.empty()) {
+		n = ::send(fd, conn.out.data(), conn.out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		conn.out.erase(0, n);
+	}
+	return !conn.close_after;
+}
+
+/**
+ * Handles one complete request at the start of conn.in, if there is
+ * one, appending the response to conn.out.
+ */
+bool MockController::handle_request(Connection &conn) {
+	size_t header_end = conn.in.find("\r\n\r\n");
+	if (header_end == std::string::npos) {
+		return false;
+	}
+	std::istringstream headers(conn.in.substr(0, header_end));
+	std::string method, path, version, line;
+	headers >> method >> path >> version;
+	std::getline(headers, line);
+	size_t content_length = 0;
+	bool close_after = false;
+	uint16_t touch_port = 0;
+	while (std::getline(headers, line)) {
+		if (0 == strncasecmp(line.c_str(), "Content-Length:", 15)) {
+			content_length = strtoul(line.c_str() + 15, NULL, 10);
+		} else if (0 == strncasecmp(line.c_str(), "TouchEventsPort:", 16)) {
+			touch_port = strtoul(line.c_str() + 16, NULL, 10);
+		} else if (0 == strncasecmp(line.c_str(), "Connection: close", 17)) {
+			close_after = true;
+		}
+	}
+	size_t body_start = header_end + 4;
+	if (conn.in.size() < body_start + content_length) {
+		return false;
+	}
+	std::string body = conn.in.substr(body_start, content_length);
+	conn.in.erase(0, body_start + content_length);
+	conn.close_after = close_after;
+	size_t events_at = path.find("/events?id=");
+	if (method == "GET" && events_at != std::string::npos && path.compare(0, events_at, MOCK_API_PREFIX + token) == 0) {
+		std::istringstream ids(path.substr(events_at + 11));
+		std::string id;
+		while (std::getline(ids, id, ',')) {
+			conn.event_types.push_back(atoi(id.c_str()));
+		}
+		if (touch_port) {
+			touch_events_port = touch_port;
+		}
+		conn.out += "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n\r\n";
+		requests_served++;
+		return true;
+	}
+	unsigned int status;
+	std::string response;
+	try {
+		respond(method, path, body, status, response);
+	} catch (const std::exception &e) {
+		status = 400;
+		response.clear();
+	}
+	std::ostringstream out;
+	out << "HTTP/1.1 " << status << " " <<
+		((status == 204) ? "No Content" : (status < 300) ? "OK" : (status == 401) ? "Unauthorized" : (status == 403) ? "Forbidden" : (status == 404) ? "Not Found" : (status == 503) ? "Service Unavailable" : "Bad Request") << "\r\n";
+	if (response.size()) {
+		out << "Content-Type: application/json\r\n";
+	}
+	out << "Content-Length: " << response.size() << "\r\n\r\n" << response;
+	conn.out += out.str();
+	requests_served++;
+	return true;
+}
+
+/**
+ * Checks that animData holds the number of panels and frames it claims.
+ */
+static bool valid_anim_data(const std::string &anim_data) {
+	std::istringstream in(anim_data);
+	unsigned int panel_count;
+	if (!(in >> panel_count)) {
+		return false;
+	}
+	for (unsigned int i = 0; i < panel_count; i++) {
+		unsigned int panel_id, frame_count;
+		if (!(in >> panel_id >> frame_count) || frame_count == 0) {
+			return false;
+		}
+		for (unsigned int f = 0; f < frame_count * 5; f++) {
+			unsigned int v;
+			if (!(in >> v)) {
+				return false;
+			}
+		}
+	}
+	std::string rest;
+	return !(in >> rest);
+}
+
+void MockController::respond(
+	const std::string &method,
+	const std::string &path,
+	const std::string &body,
+	unsigned int &status,
+	std::string &response
+) {
+	status = 404;
+	size_t prefix_len = strlen(MOCK_API_PREFIX);
+	if (path.compare(0, prefix_len, MOCK_API_PREFIX) != 0) {
+		return;
+	}
+	std::string rest = path.substr(prefix_len);
+	if (method == "POST" && (rest == "new" || rest == "new/")) {
+		if (!pairing_open) {
+			status = 403;
+			return;
+		}
+		status = 200;
+		response = json{{"auth_token", token}}.dump();
+		return;
+	}
+	size_t slash = rest.find('/');
+	if (rest.substr(0, slash) != token) {
+		status = 401;
+		return;
+	}
+	std::string endpoint = (slash == std::string::npos) ? "" : rest.substr(slash);
+	while (endpoint.size() && endpoint.back() == '/') {
+		endpoint.pop_back();
+	}
+	std::lock_guard<std::mutex> lock(info_mutex);
+	if (method == "GET") {
+		json::json_pointer ptr(endpoint);
+		if (info.contains(ptr)) {
+			status = 200;
+			response = info.at(ptr).dump();
+		}
+	} else if (method == "PUT" && endpoint == "/effects") {
+		json request = json::parse(body);
+		if (request.contains("write") && request["write"].value("animType", "") == "extControl") {
+			stream_version = (request["write"].value("extControlVersion", "v1") == "v2") ? PROTOCOL_V2 : PROTOCOL_V1;
+			if (stream_version == PROTOCOL_V1) {
+				status = 200;
+				response = json{
+					{"streamControlIpAddr", "127.0.0.1"},
+					{"streamControlPort", stream_port},
+					{"streamControlProtocol", stream_protocol}
+				}.dump();
+			} else if (stream_protocol != "udp") {
+				// Version 2 is only ever streamed over UDP
+				status = 400;
+			} else if (listen_v2_stream()) {
+				// As the controller does: no content, and frames go to its fixed port
+				status = 204;
+			} else {
+				status = 503;
+			}
+		} else if (request.contains("write") && request["write"].value("animType", "") == "custom") {
+			const json &write = request["write"];
+			if (!valid_anim_data(write.value("animData", ""))) {
+				status = 400;
+				return;
+			}
+			std::string name = write.value("animName", "");
+			if (write.value("command", "") == "add") {
+				json &list = info["effects"]["effectsList"];
+				if (std::find(list.begin(), list.end(), name) == list.end()) {
+					list.push_back(name);
+				}
+			}
+			info["effects"]["select"] = name;
+			custom_effect = write;
+			queue_event(3, json::array({{{"attr", 1}, {"value", name}}}));
+			status = 204;
+		} else {
+			if (request.contains("select")) {
+				info["effects"]["select"] = request["select"];
+				queue_event(3, json::array({{{"attr", 1}, {"value", request["select"]}}}));
+			}
+			status = 204;
+		}
+	} else if (method == "PUT" && endpoint == "/state") {
+		static const char *attrs[] = { NULL, "on", "brightness", "hue", "sat", "ct", "colorMode" };
+		json request = json::parse(body);
+		json events = json::array();
+		for (auto it = request.begin(); it != request.end(); ++it) {
+			if (info["state"].contains(it.key()) && it.value().contains("value")) {
+				info["state"][it.key()]["value"] = it.value()["value"];
+				for (int attr = 1; attr < 7; attr++) {
+					if (it.key() == attrs[attr]) {
+						events.push_back({{"attr", attr}, {"value", it.value()["value"]}});
+					}
+				}
+			}
+		}
+		if (events.size()) {
+			queue_event(1, events);
+		}
+		status = 204;
+	}
+}
+
+void MockController::read_stream() {
+	bool datagram = (stream_protocol == "udp");
+	int fd = datagram ? stream_fd : stream_conn_fd;
+	// Drain everything queued, so that datagrams are not dropped while polling
+	for (;;) {
+		size_t old_size = datagram ? 0 : stream_buf.size();
+		stream_buf.resize(old_size + 65536);
+		ssize_t n = recv(fd, stream_buf.data() + old_size, 65536, MSG_DONTWAIT);
+		if (n <= 0) {
+			stream_buf.resize(old_size);
+			if (n == 0 && !datagram) {
+				close(stream_conn_fd);
+				stream_conn_fd = -1;
+			}
+			return;
+		}
+		packet.received = std::chrono::steady_clock::now();
+		stream_buf.resize(old_size + n);
+		bytes_received += n;
+		decode_stream();
+		if (datagram) {
+			stream_buf.clear();
+		}
+	}
+}
+
+/**
+ * Answers a service, instance or host query with everything the querier
+ * needs, as controllers do, sending it straight back to the querier.
+ */
+void MockController::answer_mdns() {
+	std::ostringstream host;
+	host << "mock-controller-" << http_port << ".local";
+	std::string instance = "Mock Controller " + mdns_id + "." + MOCK_SERVICE_NAME;
+	uint8_t buf[9000];
+	for (;;) {
+		struct sockaddr_in from;
+		socklen_t from_len = sizeof(from);
+		ssize_t n = recvfrom(mdns_fd, buf, sizeof(buf), MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&from), &from_len);
+		if (n < 0) {
+			return;
+		}
+		DNSMessage query, answer;
+		try {
+			query.parse(buf, n);
+		} catch (const std::string &errmsg) {
+			std::cerr << "Mock mDNS: " << errmsg << std::endl;
+			continue;
+		}
+		if (query.flags & DNS_FLAG_RESPONSE) {
+			continue;
+		}
+		bool want_ptr = false, want_srv = false, want_txt = false, want_a = false;
+		for (auto &q: query.questions) {
+			bool any = (q.type == DNS_TYPE_ANY);
+			if (DNSMessage::same_name(q.name, MOCK_SERVICE_NAME) && (any || q.type == DNS_TYPE_PTR)) {
+				want_ptr = want_srv = want_txt = want_a = true;
+			} else if (DNSMessage::same_name(q.name, instance)) {
+				want_srv = want_srv || any || q.type == DNS_TYPE_SRV;
+				want_txt = want_txt || any || q.type == DNS_TYPE_TXT;
+				want_a = want_a || want_srv;
+			} else if (DNSMessage::same_name(q.name, host.str()) && (any || q.type == DNS_TYPE_A)) {
+				want_a = true;
+			}
+		}
+		if (want_ptr) {
+			DNSRecord ptr(MOCK_SERVICE_NAME, DNS_TYPE_PTR, MOCK_MDNS_TTL);
+			ptr.target = instance;
+			answer.records.push_back(ptr);
+		}
+		if (want_srv) {
+			DNSRecord srv(instance, DNS_TYPE_SRV, MOCK_MDNS_TTL);
+			srv.target = host.str();
+			srv.port = http_port;
+			answer.records.push_back(srv);
+		}
+		if (want_txt) {
+			DNSRecord txt(instance, DNS_TYPE_TXT, MOCK_MDNS_TTL);
+			txt.txt.push_back("id=" + mdns_id);
+			txt.txt.push_back("md=NL22");
+			answer.records.push_back(txt);
+		}
+		if (want_a) {
+			DNSRecord a(host.str(), DNS_TYPE_A, MOCK_MDNS_TTL);
+			a.address = "127.0.0.1";
+			answer.records.push_back(a);
+		}
+		if (answer.records.empty()) {
+			continue;
+		}
+		// A legacy unicast answer repeats the query's ID and questions
+		answer.id = query.id;
+		answer.flags = DNS_FLAG_RESPONSE | DNS_FLAG_AUTHORITATIVE;
+		answer.questions = query.questions;
+		std::vector<uint8_t> out;
+		answer.encode(out);
+		if (sendto(mdns_fd, out.data(), out.size(), 0, reinterpret_cast<sockaddr *>(&from), from_len) < 0) {
+			std::cerr << "Mock mDNS: " << strerror(errno) << std::endl;
+		}
+	}
+}
+
+void MockController::decode_stream() {
+	size_t off = 0;
+	for (;;) {
+		size_t consumed = read_panel_commands(
+			stream_buf.data() + off,
+			stream_buf.size() - off,
+			stream_version,
+			packet.commands
+		);
+		if (!consumed) {
+			break;
+		}
+		packet.version = stream_version;
+		packet.size = consumed;
+		packets_received++;
+		if (packet_callback) {
+			packet_callback(packet);
+		}
+		off += consumed;
+	}
+	stream_buf.erase(stream_buf.begin(), stream_buf.begin() + off);
+}
+
+}
@@ -0,0 +1,69 @@
+#include <iostream>
+
+#include "pairing.h"
+
+namespace mynanoleaf {
+
+const std::chrono::milliseconds PairingManager::DEFAULT_INTERVAL(500);
+const std::chrono::milliseconds PairingManager::DEFAULT_ATTEMPT_TIMEOUT(2000);
+
+PairingManager::PairingManager(
+	RequestEngine &pengine,
+	std::chrono::milliseconds pinterval,
+	std::chrono::milliseconds pgive_up_after,
+	std::chrono::milliseconds pattempt_timeout
+) :
+	engine(pengine),
+	interval(pinterval),
+	attempt_timeout(pattempt_timeout),
+	give_up_after(pgive_up_after),
+	unpaired(0),
+	attempts(0)
+{
+}
+
+void PairingManager::add(Aurora &aurora, paired_t done) {
+	if (aurora.has_auth_token()) {
+		if (done) {
+			done(aurora, nullptr);
+		}
+		return;
+	}
+	std::cerr << "Waiting for the button to be held on '" << aurora.get_credential_key() << "'" << std::endl;
+	std::shared_ptr<Pairing> pairing = std::make_shared<Pairing>();
+	pairing->aurora = &aurora;
+	pairing->done = done;
+	if (give_up_after.count()) {
+		pairing->deadline = std::chrono::steady_clock::now() + give_up_after;
+	} else {
+		pairing->deadline = std::chrono::steady_clock::time_point::max();
+	}
+	unpaired++;
+	attempt(pairing);
+}
+
+void PairingManager::attempt(std::shared_ptr<Pairing> pairing) {
+	attempts++;
+	pairing->aurora->request_token(engine, attempt_timeout, [this, pairing](std::exception_ptr error) {
+		// Until the button is held, each attempt fails with 403 Forbidden
+		if (error && std::chrono::steady_clock::now() + interval < pairing->deadline) {
+			engine.add_timer(interval, [this, pairing]() {
+				attempt(pairing);
+			});
+			return;
+		}
+		finish(pairing, error);
+	});
+}
+
+void PairingManager::finish(std::shared_ptr<Pairing> pairing, std::exception_ptr error) {
+	unpaired--;
+	if (error) {
+		std::cerr << "Gave up pairing with '" << pairing->aurora->get_credential_key() << "'" << std::endl;
+	}
+	if (pairing->done) {
+		pairing->done(*pairing->aurora, error);
+	}
+}
+
+}
@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <iostream>
+
+#include "discovery.h"
+#include "registry.h"
+
+namespace mynanoleaf {
+
+const std::chrono::milliseconds DeviceRegistry::RETRY_INTERVAL(5000);
+
+DeviceRegistry::DeviceRegistry(DiscoveryCache *pcache, listener_t plistener) :
+	cache(pcache),
+	listener(plistener),
+	stopping(false)
+{
+	devices_t initial;
+	if (cache) {
+		for (auto &entry: cache->get_entries()) {
+			Device device;
+			device.id = entry.id;
+			device.address = entry.address;
+			device.port = entry.port;
+			device.present = true;
+			device.generation = 1;
+			device.aurora = std::make_shared<Aurora>(entry.address, entry.port, entry.id);
+			initial.push_back(device);
+		}
+	}
+	publish(initial);
+}
+
+void DeviceRegistry::start() {
+	if (thread.joinable()) {
+		return;
+	}
+	stopping = false;
+	thread = std::thread(&DeviceRegistry::run, this);
+}
+
+void DeviceRegistry::stop() {
+	{
+		std::lock_guard<std::mutex> lock(stop_mutex);
+		stopping = true;
+	}
+	stop_cond.notify_all();
+	if (thread.joinable()) {
+		thread.join();
+	}
+}
+
+/** Devices without an id= TXT entry are known by their hostname. */
+static std::string device_key(const std::string &id, const std::string &host) {
+	return id.empty() ? host : id;
+}
+
+static bool found_callback(const AvahiAddress &address, const std::string &host, uint16_t port, const std::string &id, void *userdata) {
+	DeviceRegistry *tthis = static_cast<DeviceRegistry *>(userdata);
+	// Called from Avahi, which exceptions cannot pass through
+	try {
+		tthis->add_or_update(device_key(id, host), MDNSResponder::connectable_address(address, host), port);
+	} catch (const std::string &errmsg) {
+		std::cerr << "Cannot record device " << host << ": " << errmsg << std::endl;
+	} catch (const char *errmsg) {
+		std::cerr << "Cannot record device " << host << ": " << errmsg << std::endl;
+	}
+	return true; // Continue enumeration
+}
+
+static void removed_callback(const std::string &id, const std::string &host, void *userdata) {
+	DeviceRegistry *tthis = static_cast<DeviceRegistry *>(userdata);
+	const std::string key = device_key(id, host);
+	try {
+		tthis->remove(key);
+	} catch (const std::string &errmsg) {
+		std::cerr << "Cannot remove device " << key << ": " << errmsg << std::endl;
+	} catch (const char *errmsg) {
+		std::cerr << "Cannot remove device " << key << ": " << errmsg << std::endl;
+	}
+}
+
+void DeviceRegistry::run() {
+	while (!stopping) {
+		try {
+			MDNSResponder mdns;
+			mdns.watch(Aurora::NANOLEAF_MDNS_SERVICE_TYPE, found_callback, removed_callback, this, stopping);
+		} catch (const char *errmsg) {
+			std::cerr << "Discovery failed: " << errmsg << std::endl;
+		} catch (const std::string &errmsg) {
+			std::cerr << "Discovery failed: " << errmsg << std::endl;
+		}
+		// The daemon may be restarting
+		std::unique_lock<std::mutex> lock(stop_mutex);
+		stop_cond.wait_for(lock, RETRY_INTERVAL, [this]() { return stopping.load(); });
+	}
+}
+
+void DeviceRegistry::add_or_update(const std::string &id, const std::string &address, uint16_t port) {
+	Device changed;
+	{
+		std::lock_guard<std::mutex> lock(write_mutex);
+		devices_t next(*snapshot());
+		auto it = std::find_if(next.begin(), next.end(), [&id](const Device &d) { return d.id == id; });
+		if (it == next.end()) {
+			Device device;
+			device.id = id;
+			device.address = address;
+			device.port = port;
+			device.present = true;
+			device.generation = 1;
+			device.aurora = std::make_shared<Aurora>(address, port, id);
+			next.push_back(device);
+			it = next.end() - 1;
+		} else if (it->present && it->address == address && it->port == port) {
+			return;
+		} else {
+			if (it->address != address || it->port != port) {
+				it->address = address;
+				it->port = port;
+				it->aurora->set_address(address, port);
+			}
+			if (!it->present) {
+				it->present = true;
+				it->generation++;
+			}
+		}
+		changed = *it;
+		publish(next);
+	}
+#ifndef NDEBUG
+	std::cerr << "Device ID '" << id << "' is at " << address << ":" << port << std::endl;
+#endif /* ndef NDEBUG */
+	if (cache) {
+		cache->update(id, address, port);
+	}
+	if (listener) {
+		listener(changed);
+	}
+}
+
+void DeviceRegistry::remove(const std::string &id) {
+	Device changed;
+	{
+		std::lock_guard<std::mutex> lock(write_mutex);
+		devices_t next(*snapshot());
+		auto it = std::find_if(next.begin(), next.end(), [&id](const Device &d) { return d.id == id; });
+		if (it == next.end() || !it->present) {
+			return;
+		}
+		it->present = false;
+		changed = *it;
+		publish(next);
+	}
+#ifndef NDEBUG
+	std::cerr << "Device ID '" << id << "' has gone away" << std::endl;
+#endif /* ndef NDEBUG */
+	if (listener) {
+		listener(changed);
+	}
+}
+
+}
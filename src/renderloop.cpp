@@ -0,0 +1,107 @@
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "renderloop.h"
+
+namespace mynanoleaf {
+
+void RenderStats::report(std::ostream &os) const {
+	os << "Frames rendered: " << frames_rendered <<
+		", dropped: " << frames_dropped <<
+		", touches: " << touches_received <<
+		", jitter mean: " << mean_jitter().count() << "ns" <<
+		", max: " << max_jitter.count() << "ns" << std::endl;
+}
+
+RenderLoop::RenderLoop(IPStream &pstream, unsigned int frame_rate)
+:
+	stream(pstream),
+	period(std::chrono::nanoseconds(std::chrono::seconds(1)) / frame_rate),
+	touch_listener(NULL)
+{
+	assert(frame_rate > 0);
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		throw std::string(strerror(errno));
+	}
+}
+
+RenderLoop::~RenderLoop() {
+	if (timer_fd >= 0) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+}
+
+static struct timespec to_timespec(std::chrono::nanoseconds ns) {
+	struct timespec ts;
+	ts.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(ns).count();
+	ts.tv_nsec = (ns - std::chrono::seconds(ts.tv_sec)).count();
+	return ts;
+}
+
+void RenderLoop::run(effect_t effect) {
+	// steady_clock is CLOCK_MONOTONIC, so its epoch matches the timer's.
+	std::chrono::nanoseconds start = std::chrono::steady_clock::now().time_since_epoch();
+	struct itimerspec its;
+	its.it_value = to_timespec(start + period);
+	its.it_interval = to_timespec(period);
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		throw std::string(strerror(errno));
+	}
+	uint64_t tick = 0;
+	struct pollfd fds[2];
+	fds[0].fd = timer_fd;
+	fds[0].events = POLLIN;
+	// poll() ignores negative descriptors
+	fds[1].fd = touch_listener ? touch_listener->get_fd() : -1;
+	fds[1].events = POLLIN;
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::string(strerror(errno));
+		}
+		if (fds[1].revents & POLLIN) {
+			if (touch_listener->receive(touches)) {
+				stats.touches_received += touches.size();
+				touch_handler(touches);
+			}
+		}
+		if (!(fds[0].revents & POLLIN)) {
+			continue;
+		}
+		uint64_t expirations;
+		ssize_t ret = read(timer_fd, &expirations, sizeof(expirations));
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw std::string(strerror(errno));
+		}
+		assert(ret == sizeof(expirations) && expirations > 0);
+		stats.frames_dropped += expirations - 1;
+		tick += expirations;
+		std::chrono::nanoseconds jitter =
+			std::chrono::steady_clock::now().time_since_epoch() - (start + period * tick);
+		stats.total_jitter += jitter;
+		if (jitter > stats.max_jitter) {
+			stats.max_jitter = jitter;
+		}
+		if (!effect(tick - 1, commands)) {
+			break;
+		}
+		write_panel_commands(stream, commands);
+		stats.frames_rendered++;
+	}
+	struct itimerspec disarm;
+	memset(&disarm, 0, sizeof(disarm));
+	timerfd_settime(timer_fd, 0, &disarm, NULL);
+}
+
+}
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "requestengine.h"
+
+namespace mynanoleaf {
+
+static void check_multi(CURLMcode res) {
+	if (res != CURLM_OK) {
+		throw curl_multi_strerror(res);
+	}
+}
+
+RequestEngine::RequestEngine(size_t pmax_concurrent) :
+	multi(curl_multi_init()),
+	max_concurrent(std::max(pmax_concurrent, static_cast<size_t>(1)))
+{
+	if (!multi) {
+		throw "curl_multi_init failed";
+	}
+}
+
+RequestEngine::~RequestEngine() {
+	// Abandon anything unfinished without calling its completion
+	for (auto &a: active) {
+		curl_multi_remove_handle(multi, a.first);
+	}
+	curl_multi_cleanup(multi);
+}
+
+void RequestEngine::submit(CURL *handle, completion_t done) {
+	if (
+		active.count(handle) ||
+		std::any_of(waiting.begin(), waiting.end(), [handle](const std::pair<CURL *, completion_t> &w) { return w.first == handle; })
+	) {
+		throw std::string("A request is already pending on this handle");
+	}
+	waiting.push_back(std::make_pair(handle, done));
+	start_waiting();
+}
+
+void RequestEngine::start_waiting() {
+	while (active.size() < max_concurrent && !waiting.empty()) {
+		std::pair<CURL *, completion_t> w = std::move(waiting.front());
+		waiting.pop_front();
+		check_multi(curl_multi_add_handle(multi, w.first));
+		active.insert(std::move(w));
+	}
+}
+
+void RequestEngine::collect() {
+	std::vector<std::pair<completion_t, CURLcode> > finished;
+	CURLMsg *msg;
+	int queued;
+	while ((msg = curl_multi_info_read(multi, &queued))) {
+		if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+		CURL *handle = msg->easy_handle;
+		CURLcode result = msg->data.result;
+		curl_multi_remove_handle(multi, handle);
+		auto it = active.find(handle);
+		if (it != active.end()) {
+			finished.push_back(std::make_pair(std::move(it->second), result));
+			active.erase(it);
+		}
+	}
+	// Free slots before calling out, so that completions can chain requests
+	start_waiting();
+	for (auto &f: finished) {
+		f.first(f.second);
+	}
+}
+
+void RequestEngine::add_timer(std::chrono::milliseconds delay, timer_callback_t fn) {
+	timers.insert(std::make_pair(std::chrono::steady_clock::now() + delay, std::move(fn)));
+}
+
+void RequestEngine::fire_timers() {
+	std::vector<timer_callback_t> due;
+	auto now = std::chrono::steady_clock::now();
+	while (!timers.empty() && timers.begin()->first <= now) {
+		due.push_back(std::move(timers.begin()->second));
+		timers.erase(timers.begin());
+	}
+	// Timers added by these run on a later pass
+	for (auto &fn: due) {
+		fn();
+	}
+}
+
+size_t RequestEngine::run_once(int timeout_ms) {
+	int running;
+	check_multi(curl_multi_perform(multi, &running));
+	collect();
+	fire_timers();
+	if (!get_pending()) {
+		return 0;
+	}
+	if (!timers.empty()) {
+		long long until_next = std::chrono::duration_cast<std::chrono::milliseconds>(
+			timers.begin()->first - std::chrono::steady_clock::now()
+		).count() + 1;
+		if (until_next < timeout_ms) {
+			timeout_ms = until_next < 0 ? 0 : static_cast<int>(until_next);
+		}
+	}
+	// Unlike curl_multi_wait, this also sleeps when only timers are pending
+	check_multi(curl_multi_poll(multi, NULL, 0, timeout_ms, NULL));
+	check_multi(curl_multi_perform(multi, &running));
+	collect();
+	fire_timers();
+	return get_pending();
+}
+
+void RequestEngine::run() {
+	while (run_once()) {
+	}
+}
+
+}
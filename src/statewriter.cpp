@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <iostream>
+
+#include "statewriter.h"
+
+namespace mynanoleaf {
+
+const std::chrono::milliseconds StateWriter::DEFAULT_WINDOW(50);
+
+StateWriter::StateWriter(Aurora &paurora, std::chrono::milliseconds pwindow) :
+	aurora(paurora),
+	window(pwindow),
+	pending(json::object()),
+	changes(0),
+	requests(0)
+{
+}
+
+StateWriter::~StateWriter() {
+	try {
+		commit();
+	} catch (char const * const str) {
+		std::cerr << "Cannot commit state: " << str << std::endl;
+	} catch (const std::string &sstr) {
+		std::cerr << "Cannot commit state: " << sstr << std::endl;
+	}
+}
+
+void StateWriter::set(const char *field, json value) {
+	pending[field] = std::move(value);
+	changes++;
+	poll();
+}
+
+void StateWriter::set_on(bool on) {
+	set("on", json{{"value", on}});
+}
+
+void StateWriter::set_brightness(int value, unsigned int duration) {
+	set("brightness", json{{"value", value}, {"duration", duration}});
+}
+
+void StateWriter::set_hue(int value) {
+	// Hue and saturation select a different colour mode from colour temperature
+	pending.erase("ct");
+	set("hue", json{{"value", value}});
+}
+
+void StateWriter::set_sat(int value) {
+	pending.erase("ct");
+	set("sat", json{{"value", value}});
+}
+
+void StateWriter::set_ct(int value) {
+	pending.erase("hue");
+	pending.erase("sat");
+	set("ct", json{{"value", value}});
+}
+
+std::chrono::milliseconds StateWriter::get_timeout() const {
+	if (pending.empty()) {
+		return std::chrono::milliseconds(-1);
+	}
+	auto remaining = last_sent + window - std::chrono::steady_clock::now();
+	auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(remaining);
+	// Rounds up, or the last part of a millisecond spins on a zero timeout
+	if (timeout < remaining) {
+		timeout += std::chrono::milliseconds(1);
+	}
+	return std::max(timeout, std::chrono::milliseconds(0));
+}
+
+bool StateWriter::poll() {
+	if (pending.empty() || std::chrono::steady_clock::now() - last_sent < window) {
+		return false;
+	}
+	commit();
+	return true;
+}
+
+void StateWriter::commit() {
+	if (pending.empty()) {
+		return;
+	}
+	json changes_to_send = json::object();
+	std::swap(changes_to_send, pending);
+	last_sent = std::chrono::steady_clock::now();
+	requests++;
+	try {
+		aurora.put_state(changes_to_send);
+	} catch (...) {
+		// Keep the failed changes for the next attempt, unless superseded
+		for (auto it = changes_to_send.begin(); it != changes_to_send.end(); ++it) {
+			if (!pending.contains(it.key())) {
+				pending[it.key()] = it.value();
+			}
+		}
+		throw;
+	}
+}
+
+}
@@ -19,8 +19,9 @@ IPStream::IPStream(
 	const std::string &ipaddr,
 	uint16_t port,
 	int sock_type,
-	int sock_proto
-) {
+	int sock_proto,
+	ProtocolVersion version
+) : encoder(PacketEncoder::create(version)), bytes_written(0) {
 	fd = socket(AF_INET, sock_type, sock_proto);
 	if (fd < 0) {
 		throw std::string(std::strerror(errno));
@@ -52,28 +53,7 @@ IPStream::~IPStream() {
 	}
 }
 
-static std::string hexdump(const void *p, size_t n) {
-	static const char *hexdigits = "0123456789abcdef";
-	const unsigned char *pc = static_cast<const unsigned char *>(p);
-	std::ostringstream ret;
-	for (; n; --n, ++pc) {
-		if (
-			(*pc >= 'a' && *pc <= 'z') ||
-			(*pc >= 'A' && *pc <= 'Z') ||
-			(*pc >= '0' && *pc <= '9')
-		) {
-			ret << *pc;
-		} else {
-			ret << "\\x" << hexdigits[*pc >> 4] << hexdigits[*pc & 0x0F];
-		}
-	}
-	return ret.str();
-}
-
 void IPStream::write(const void *p, size_t n) {
-	if (n) {
-		std::cerr << "Writing: " << hexdump(p, n) << std::endl;
-	}
 	while (n > 0) {
 		int ret = ::write(fd, p, n);
 		if (ret < 0) {
@@ -81,14 +61,20 @@ void IPStream::write(const void *p, size_t n) {
 		}
 		p = static_cast<const unsigned char *>(p) + ret;
 		n -= ret;
+		bytes_written += ret;
 	}
 }
 
-IPStream *IPStream::create(const std::string &proto, const std::string &ipaddr, uint16_t port) {
+IPStream *IPStream::create(
+	const std::string &proto,
+	const std::string &ipaddr,
+	uint16_t port,
+	ProtocolVersion version
+) {
 	if (proto == "udp") {
-		return new BufferedUDPStream(ipaddr, port);
+		return new BufferedUDPStream(ipaddr, port, version);
 	} else if (proto == "tcp") {
-		return new TCPStream(ipaddr, port);
+		return new TCPStream(ipaddr, port, version);
 	} else {
 		std::ostringstream msg;
 		msg << "Unrecognised protocol '" << proto << "'";
@@ -98,23 +84,232 @@ IPStream *IPStream::create(const std::string &proto, const std::string &ipaddr,
 
 UDPStream::UDPStream(
 	const std::string &ipaddr,
-	uint16_t port
-) : IPStream(ipaddr, port, SOCK_DGRAM, IPPROTO_UDP) {
+	uint16_t port,
+	ProtocolVersion version
+) : IPStream(ipaddr, port, SOCK_DGRAM, IPPROTO_UDP, version) {
 }
 
 TCPStream::TCPStream(
 	const std::string &ipaddr,
-	uint16_t port
-) : IPStream(ipaddr, port, SOCK_STREAM, IPPROTO_TCP) {
+	uint16_t port,
+	ProtocolVersion version
+) : IPStream(ipaddr, port, SOCK_STREAM, IPPROTO_TCP, version) {
+}
+
+void Frame::write(IPStream &stream) const {
+	stream.write(r);
+	stream.write(g);
+	stream.write(b);
+	stream.write(0); // White; ignored
+	assert(t < 256);
+	stream.write(static_cast<uint8_t>(t));
+}
+
+void PanelCommand::write(IPStream &stream) const {
+	assert(panel_id < 256);
+	stream.write(static_cast<uint8_t>(panel_id));
+	assert(frames.size() < 256);
+	stream.write(static_cast<uint8_t>(frames.size()));
+	for (auto &f: frames) {
+		f.write(stream);
+	}
+}
+
+PacketEncoder *PacketEncoder::create(ProtocolVersion version) {
+	switch (version) {
+	case PROTOCOL_V1:
+		return new VersionedPacketEncoder<PROTOCOL_V1>();
+	case PROTOCOL_V2:
+		return new VersionedPacketEncoder<PROTOCOL_V2>();
+	default:
+		std::ostringstream msg;
+		msg << "Unrecognised protocol version " << version;
+		throw msg.str();
+	}
 }
 
 void write_panel_commands(IPStream &stream, const std::vector<PanelCommand> &commands) {
-	assert(commands.size() < 256);
-	stream.write(static_cast<uint8_t>(commands.size()));
-	for (auto &c: commands) {
-		c.write(stream);
+	stream.send(commands);
+}
+
+template<ProtocolVersion V> static size_t read_packet(
+	const uint8_t *begin,
+	const uint8_t *end,
+	std::vector<PanelCommand> &commands
+) {
+	typedef WireFormat<V> Format;
+	size_t panel_count;
+	const uint8_t *p = Format::get_header(begin, end, panel_count);
+	if (!p) {
+		return 0;
+	}
+	commands.clear();
+	commands.reserve(panel_count);
+	for (size_t i = 0; i < panel_count; i++) {
+		commands.push_back(PanelCommand(0));
+		p = Format::get_panel(p, end, commands.back());
+		if (!p) {
+			commands.clear();
+			return 0;
+		}
+	}
+	return p - begin;
+}
+
+size_t read_panel_commands(
+	const void *p,
+	size_t n,
+	ProtocolVersion version,
+	std::vector<PanelCommand> &commands
+) {
+	const uint8_t *begin = static_cast<const uint8_t *>(p);
+	switch (version) {
+	case PROTOCOL_V1:
+		return read_packet<PROTOCOL_V1>(begin, begin + n, commands);
+	case PROTOCOL_V2:
+		return read_packet<PROTOCOL_V2>(begin, begin + n, commands);
+	default:
+		std::ostringstream msg;
+		msg << "Unrecognised protocol version " << version;
+		throw msg.str();
+	}
+}
+
+void DeltaWriter::write_panel_commands(const std::vector<PanelCommand> &commands) {
+	bool refresh = frames_since_refresh + 1 >= refresh_interval;
+	if (!refresh) {
+		size_t n = 0;
+		for (auto &c: commands) {
+			const std::vector<Frame> &frames = c.get_frames();
+			if (frames.empty()) {
+				continue;
+			}
+			auto it = last_sent.find(c.get_panel_id());
+			if (it != last_sent.end() && frames.size() == 1 && it->second.same_colour(frames.back())) {
+				continue;
+			}
+			// Assign over existing elements to reuse their frame storage
+			if (n < changed.size()) {
+				changed[n] = c;
+			} else {
+				changed.push_back(c);
+			}
+			n++;
+		}
+		changed.erase(changed.begin() + n, changed.end());
+		if (!n) {
+			frames_since_refresh++;
+			return;
+		}
+	}
+	const std::vector<PanelCommand> &sent = refresh ? commands : changed;
+	// Throws, leaving last_sent as it was, if the write fails
+	mynanoleaf::write_panel_commands(stream, sent);
+	for (auto &c: sent) {
+		const std::vector<Frame> &frames = c.get_frames();
+		if (frames.empty()) {
+			continue;
+		}
+		auto it = last_sent.find(c.get_panel_id());
+		if (it == last_sent.end()) {
+			last_sent.emplace(c.get_panel_id(), frames.back());
+		} else {
+			it->second = frames.back();
+		}
+	}
+	frames_since_refresh = refresh ? 0 : frames_since_refresh + 1;
+}
+
+bool read_touch_events(const void *p, size_t n, std::vector<TouchEvent> &events) {
+	typedef WireFormat<PROTOCOL_V2> W;
+	const uint8_t *begin = static_cast<const uint8_t *>(p);
+	if (n < TouchEvent::HEADER_SIZE) {
+		return false;
+	}
+	size_t count = W::get_u16(begin);
+	if (n != TouchEvent::HEADER_SIZE + count * TouchEvent::ENTRY_SIZE) {
+		return false;
+	}
+	const uint8_t *q = begin + TouchEvent::HEADER_SIZE;
+	for (size_t i = 0; i < count; i++, q += TouchEvent::ENTRY_SIZE) {
+		events.push_back(TouchEvent(W::get_u16(q), static_cast<TouchType>(q[2] >> 4), q[2] & 0x0f, W::get_u16(q + 3)));
+	}
+	return true;
+}
+
+void write_touch_events(const std::vector<TouchEvent> &events, std::vector<uint8_t> &buf) {
+	typedef WireFormat<PROTOCOL_V2> W;
+	buf.resize(TouchEvent::HEADER_SIZE + events.size() * TouchEvent::ENTRY_SIZE);
+	uint8_t *q = W::put_u16(buf.data(), static_cast<uint16_t>(events.size()));
+	for (auto &e: events) {
+		q = W::put_u16(q, e.panel_id);
+		*q++ = (e.type << 4) | (e.strength & 0x0f);
+		q = W::put_u16(q, e.swiped_from);
+	}
+}
+
+TouchListener::TouchListener(uint16_t pport) : datagrams(0), malformed(0) {
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::string(strerror(errno));
+	}
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(pport);
+	socklen_t len = sizeof(addr);
+	if (
+		bind(fd, reinterpret_cast<sockaddr *>(&addr), len) < 0 ||
+		getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len) < 0
+	) {
+		std::string errmsg(strerror(errno));
+		close(fd);
+		throw errmsg;
+	}
+	port = ntohs(addr.sin_port);
+	// Large enough for a touch on every panel
+	buf.resize(TouchEvent::HEADER_SIZE + 65535 * TouchEvent::ENTRY_SIZE);
+}
+
+TouchListener::~TouchListener() {
+	close(fd);
+}
+
+void TouchListener::set_panel_ids(const std::vector<int> &ids) {
+	panel_indices.clear();
+	for (size_t i = 0; i < ids.size(); i++) {
+		panel_indices[static_cast<uint16_t>(ids[i])] = i;
+	}
+}
+
+size_t TouchListener::receive(std::vector<TouchEvent> &events) {
+	events.clear();
+	for (;;) {
+		ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				throw std::string(strerror(errno));
+			}
+			break;
+		}
+		datagrams++;
+		size_t first = events.size();
+		if (!read_touch_events(buf.data(), n, events)) {
+			malformed++;
+			continue;
+		}
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		for (size_t i = first; i < events.size(); i++) {
+			auto it = panel_indices.find(events[i].panel_id);
+			events[i].panel_index = (it == panel_indices.end()) ? -1 : it->second;
+			events[i].received = now;
+		}
 	}
-	stream.flush();
+	return events.size();
 }
 
 }